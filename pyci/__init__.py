@@ -20,7 +20,8 @@ from pyci._pyci import secondquant_op, wavefunction, one_spin_wfn, two_spin_wfn
 from pyci._pyci import doci_wfn, fullci_wfn, genci_wfn, sparse_op
 from pyci._pyci import get_num_threads, set_num_threads, popcnt, ctz
 from pyci._pyci import compute_overlap, compute_rdms, compute_transition_rdms,compute_rdms_1234
-from pyci._pyci import add_hci, compute_enpt2
+from pyci._pyci import add_hci, compute_enpt2, compute_enpt2_multistate
+from pyci._pyci import compute_enpt2_semistochastic
 
 from pyci.utility import make_senzero_integrals, reduce_senzero_integrals, spinize_rdms,spinize_rdms_1234,spin_free_rdms
 from pyci.utility import odometer_one_spin, odometer_two_spin
@@ -54,6 +55,8 @@ __all__ = [
     "compute_rdms",
     "compute_transition_rdms",
     "compute_enpt2",
+    "compute_enpt2_multistate",
+    "compute_enpt2_semistochastic",
     "make_senzero_integrals",
     "reduce_senzero_integrals",
     "spinize_rdms",
@@ -148,6 +148,7 @@ class FanCI(metaclass=ABCMeta):
         norm_det: Sequence[Tuple[int, float]] = None,
         constraints: Dict[str, Tuple[Callable, Callable]] = None,
         fill: str = "excitation",
+        direct: bool = False,
     ) -> None:
         r"""
         Initialize the FanCI problem.
@@ -173,6 +174,8 @@ class FanCI(metaclass=ABCMeta):
         fill : ('excitation' | 'seniority' | None)
             Whether to fill the projection ("P") space by excitation level, by seniority, or not
             at all (in which case ``wfn`` must already be filled).
+        direct : bool, default=False
+            Whether to evaluate the CI matrix elements on the fly instead of storing them.
 
         """
         # Generate constraints dict
@@ -200,7 +203,7 @@ class FanCI(metaclass=ABCMeta):
         wfn = fill_wavefunction(wfn, nproj, fill)
 
         # Compute CI matrix operator with nproj rows and len(wfn) columns
-        ci_op = pyci.sparse_op(ham, wfn, nrow=nproj, ncol=len(wfn), symmetric=False)
+        ci_op = pyci.sparse_op(ham, wfn, nrow=nproj, ncol=len(wfn), symmetric=False, direct=direct)
 
         # Compute arrays of occupations
         sspace = wfn.to_occ_array()
@@ -319,6 +322,7 @@ class FanCI(metaclass=ABCMeta):
         nocc_up = self._wfn.nocc_up
         nocc_dn = self._wfn.nocc_dn
         constraints = self._constraints
+        direct = self._ci_op.direct
         ci_cls = self._wfn.__class__
 
         # Start at sample 1
@@ -362,6 +366,7 @@ class FanCI(metaclass=ABCMeta):
                 nparam,
                 constraints=constraints,
                 fill=fill,
+                direct=direct,
             )
 
             # Go to next iteration
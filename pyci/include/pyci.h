@@ -15,14 +15,20 @@
 
 #pragma once
 
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <future>
 #include <ios>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
 #include <stdexcept>
 #include <string>
 #include <thread>
@@ -33,7 +39,6 @@
 #include <Eigen/Core>
 #include <Eigen/SparseCore>
 
-#include <Spectra/MatOp/SparseSymMatProd.h>
 #include <Spectra/SymEigsSolver.h>
 
 #include <pybind11/numpy.h>
@@ -63,6 +68,24 @@
 #define PYCI_SPARSEOP_RESIZE_FACTOR 1.5
 #endif
 
+/* Number of determinants hashed and prefetched at once by batched lookups. */
+
+#ifndef PYCI_INDEX_BATCH
+#define PYCI_INDEX_BATCH 16
+#endif
+
+/* Number of independently locked shards in a concurrent wave function builder or ENPT2 pass. */
+
+#ifndef PYCI_BUILDER_SHARDS
+#define PYCI_BUILDER_SHARDS 64
+#endif
+
+/* Number of determinants hashed at once while the index of a wave function is built. */
+
+#ifndef PYCI_DICT_BLOCK
+#define PYCI_DICT_BLOCK 1048576
+#endif
+
 /* Minimum number of individual jobs per thread. */
 
 #ifndef PYCI_CHUNKSIZE_MIN
@@ -127,6 +150,56 @@ Hash spookyhash(T length, const U *data) {
     return h;
 }
 
+template<long N>
+inline Hash spookyhash_fixed(const ulong *data) {
+    // SpookyHash::Short for a message of N < 24 words, unrolled at compile time
+    static_assert(N > 0 && N < 24, "message is too long for SpookyHash::Short");
+    ulong a = 0x23a23cf5033c3c81UL, b = 0xb3816f6a2c68e530UL;
+    ulong c = 0xdeadbeefdeadbeefUL, d = 0xdeadbeefdeadbeefUL;
+    long i = 0;
+    for (; i + 4 <= N; i += 4) {
+        c += data[i];
+        d += data[i + 1];
+        SpookyHash::ShortMix(a, b, c, d);
+        a += data[i + 2];
+        b += data[i + 3];
+    }
+    if (N % 4 >= 2) {
+        c += data[i];
+        d += data[i + 1];
+        SpookyHash::ShortMix(a, b, c, d);
+        i += 2;
+    }
+    d += static_cast<ulong>(N * sizeof(ulong)) << 56;
+    if (N % 2) {
+        c += data[i];
+    } else {
+        c += 0xdeadbeefdeadbeefUL;
+        d += 0xdeadbeefdeadbeefUL;
+    }
+    SpookyHash::ShortEnd(a, b, c, d);
+    return Hash(a, b);
+}
+
+/* The row, HCI and PT2 kernels are not templated on the determinant width. Their work that
+ * scales with the width is hashing determinants and scanning their occupations; spookyhash
+ * below and fill_occs/fill_virs dispatch the common widths to fixed-width code. The phase
+ * kernels only visit the words between two orbitals and do not depend on the width. */
+
+inline Hash spookyhash(const long nword, const ulong *det) {
+    // dispatch the common determinant widths to fixed-width code
+    switch (nword) {
+    case 1:
+        return spookyhash_fixed<1>(det);
+    case 2:
+        return spookyhash_fixed<2>(det);
+    case 4:
+        return spookyhash_fixed<4>(det);
+    default:
+        return spookyhash<long, ulong>(nword, det);
+    }
+}
+
 /* Vector template types. */
 
 template<typename T>
@@ -156,6 +229,11 @@ using CDenseVector = Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, 1>>;
 template<class KeyType, class ValueType>
 using HashMap = phmap::flat_hash_map<KeyType, ValueType>;
 
+/* Hash map split into 16 unlocked submaps, which threads can fill concurrently, one submap each. */
+
+template<class KeyType, class ValueType>
+using ParallelHashMap = phmap::parallel_flat_hash_map<KeyType, ValueType>;
+
 /* Pybind11 NumPy array types. */
 
 template<typename Scalar>
@@ -164,15 +242,43 @@ using Array = pybind11::array_t<Scalar, pybind11::array::c_style | pybind11::arr
 template<typename Scalar>
 using ColMajorArray = pybind11::array_t<Scalar, pybind11::array::f_style | pybind11::array::forcecast>;
 
+/* Read-only NumPy view of memory owned by a Python object, which the view keeps alive. The view is
+ * counted in nview until it is freed, so that the owner can refuse to move the memory meanwhile. */
+
+struct ViewRef final {
+    pybind11::object owner;
+    long *nview;
+
+    static void destroy(void *ptr) {
+        ViewRef *ref = static_cast<ViewRef *>(ptr);
+        --*ref->nview;
+        delete ref;
+    }
+};
+
+template<typename Scalar>
+Array<Scalar> view_array(const pybind11::object &owner, long &nview,
+                         const std::vector<pybind11::ssize_t> &shape, const Scalar *ptr) {
+    std::unique_ptr<ViewRef> ref(new ViewRef{owner, &nview});
+    pybind11::capsule base(ref.get(), &ViewRef::destroy);
+    ref.release();
+    ++nview;
+    Array<Scalar> array(shape, ptr, base);
+    array.attr("setflags")(pybind11::arg("write") = false);
+    return array;
+}
+
 /* Forward-declare classes. */
 
 struct SQuantOp;
+struct HeatBath;
 struct Wfn;
 struct OneSpinWfn;
 struct TwoSpinWfn;
 struct DOCIWfn;
 struct FullCIWfn;
 struct GenCIWfn;
+struct FullCISigma;
 struct SparseOp;
 
 /* Number of threads global variable. */
@@ -219,6 +325,19 @@ void setbit_det(const long, ulong *);
 
 void clearbit_det(const long, ulong *);
 
+bool testbit_det(const long, const ulong *);
+
+double diag_det(const SQuantOp &, const long, const long *, const long, const long *);
+
+double diag_single_det(const SQuantOp &, const long, const long *, const long, const long *,
+                       const long, const long);
+
+double diag_double_det(const SQuantOp &, const long, const long *, const long, const long *,
+                       const long, const long, const long, const long);
+
+double diag_mixed_det(const SQuantOp &, const long, const long *, const long, const long *,
+                      const long, const long, const long, const long);
+
 void compute_rdms(const DOCIWfn &, const double *, double *, double *);
 
 void compute_rdms_1234(const DOCIWfn &, const double *, double *, double *, double *, double *, double *, double *, double *);
@@ -244,7 +363,19 @@ long add_hci(const SQuantOp &, WfnType &, const double *, const double, const lo
 
 template<class WfnType>
 double compute_enpt2(const SQuantOp &, const WfnType &, const double *, const double, const double,
-                     const long = -1);
+                     const long = -1, const long = 0);
+
+template<class WfnType>
+void compute_enpt2_multistate(const SQuantOp &, const WfnType &, const long, const double *,
+                              const double *, double *, const double, const long = -1,
+                              const long = 0);
+
+template<class WfnType>
+std::pair<double, double> compute_enpt2_semistochastic(const SQuantOp &, const WfnType &,
+                                                       const double *, const double, const double,
+                                                       const double, const long, const double,
+                                                       const long, const long, const long = -1,
+                                                       const long = 0);
 
 /* Free Python interface functions. */
 
@@ -278,15 +409,27 @@ long py_add_hci(const SQuantOp &, WfnType &, const Array<double>, const double,
 
 template<class WfnType>
 double py_compute_enpt2(const SQuantOp &, const WfnType &, const Array<double>, const double,
-                        const double, const long = -1);
+                        const double, const long = -1, const long = 0);
+
+template<class WfnType>
+Array<double> py_compute_enpt2_multistate(const SQuantOp &, const WfnType &, const Array<double>,
+                                          const Array<double>, const double, const long = -1,
+                                          const long = 0);
+
+template<class WfnType>
+pybind11::tuple py_compute_enpt2_semistochastic(const SQuantOp &, const WfnType &,
+                                                const Array<double>, const double, const double,
+                                                const double, const long, const double, const long,
+                                                const long, const long = -1, const long = 0);
 
 /* Second quantized operator class. */
 
 struct SQuantOp final {
 public:
     long nbasis;
-    double ecore, *one_mo, *two_mo, *h, *v, *w;
-    Array<double> one_mo_array, two_mo_array, h_array, v_array, w_array;
+    double ecore, *one_mo, *two_mo, *h, *v, *w, *coulomb, *exchange;
+    Array<double> one_mo_array, two_mo_array, h_array, v_array, w_array, coulomb_array,
+        exchange_array;
 
     SQuantOp(void);
 
@@ -299,6 +442,93 @@ public:
     SQuantOp(const double, const Array<double>, const Array<double>);
 
     void to_file(const std::string &, const long, const long, const double) const;
+
+    const HeatBath &heat_bath(const int) const;
+
+private:
+    mutable Vector<std::shared_ptr<const HeatBath>> heatbath;
+};
+
+/* Heat-bath excitation lists.
+ *
+ * For each source orbital or pair of orbitals, the target orbitals or pairs of orbitals are
+ * sorted by decreasing magnitude of their matrix element, so that a loop over the excitations of
+ * a determinant can stop at the first one below a threshold. Targets with a zero matrix element,
+ * or that are always occupied, are not stored. The opposite-spin lists store no values, since the
+ * value of target ab of key ij is |two_mo[nbasis ** 2 * ij + ab]|; they hold one target for each
+ * nonzero integral, half the memory of two_mo. The lists of a second quantized operator are
+ * built on first use, which is not thread-safe. */
+
+struct HeatBath final {
+public:
+    enum : int { pair, same_spin, opposite_spin };
+
+    long nbasis, nkey;
+    AlignedVector<long> ptr;
+    AlignedVector<unsigned> targets;
+    AlignedVector<double> values;
+
+    HeatBath(const SQuantOp &, const int);
+};
+
+/* Concurrent wave function builder.
+ *
+ * Determinants are distributed by hash over mutex-protected shards, so many threads can add to
+ * the same builder at once; the builder is then compacted into a wave function. */
+
+struct WfnBuilder final {
+public:
+    long nword;
+
+    WfnBuilder(const long);
+
+    WfnBuilder(const WfnBuilder &) = delete;
+
+    long size(void) const;
+
+    bool add_det_with_rank(const ulong *, const Hash &);
+
+    void compact(ulong *, Hash *);
+
+private:
+    struct Shard {
+        std::mutex mutex;
+        HashMap<Hash, long> dict;
+        AlignedVector<ulong> dets;
+    };
+
+    Vector<Shard> shards;
+
+    void compact_shards(const long, const long, const long *, ulong *, Hash *);
+};
+
+/* Batch of determinant lookups.
+ *
+ * Candidate determinants are collected with their hashes, then looked up in a wave function all
+ * at once, so that the cache misses of the lookups overlap instead of stalling one by one. */
+
+struct DetBatch final {
+public:
+    long nword;
+    AlignedVector<ulong> dets;
+    AlignedVector<Hash> ranks;
+    AlignedVector<long> indices;
+
+    DetBatch(const long);
+
+    long size(void) const;
+
+    const ulong *det_ptr(const long) const;
+
+    void push(const ulong *, const Hash &);
+
+    void clear(void);
+
+    template<class WfnType>
+    void lookup(const WfnType &wfn) {
+        indices.resize(ranks.size());
+        wfn.index_dets_with_rank(dets.data(), ranks.data(), size(), indices.data());
+    }
 };
 
 /* Wave function classes. */
@@ -306,11 +536,15 @@ public:
 struct Wfn {
 public:
     long nbasis, nocc, nocc_up, nocc_dn, nvir, nvir_up, nvir_dn;
-    long ndet, nword, nword2, maxrank_up, maxrank_dn;
+    long ndet, nword, nword2, maxrank_up, maxrank_dn, generation;
+    bool complete, frozen, lean;
 
 protected:
+    long nview;
     AlignedVector<ulong> dets;
-    HashMap<Hash, long> dict;
+    ParallelHashMap<Hash, long> dict;
+    AlignedVector<long> binoms;
+    AlignedVector<unsigned> slots;
 
 public:
     Wfn(const Wfn &);
@@ -323,14 +557,52 @@ public:
 
     void squeeze(void);
 
+    void add_dets_from_builder(WfnBuilder &);
+
 protected:
     Wfn(void);
 
     void init(const long, const long, const long);
+
+    void init_complete(void);
+
+    void check_views(void) const;
+
+    long rank_string(const ulong *, const long) const;
+
+    void freeze_dets(const long, long *);
+
+    void compact_dets(const long, long *);
+
+    void rebuild_index(const long);
+
+    long search_det(const ulong *, const long) const;
+
+    void init_lean(const long);
+
+    void reserve_slots(const long, const long);
+
+    long find_slot(const ulong *, const ulong, const long) const;
+
+    long insert_slot(const ulong *, const ulong, const long);
+
+    void prefetch_rank(const Hash &) const;
+
+    void hash_dets(const ulong *, const long, const long, Hash *) const;
+
+    void build_dict(const long);
+
+    void insert_dict(const Hash *, const long, const long);
+
+private:
+    void insert_dict_thread(const Hash *, const long, const long, const long, const long);
 };
 
 struct OneSpinWfn : public Wfn {
 public:
+    using Wfn::complete;
+    using Wfn::frozen;
+    using Wfn::lean;
     using Wfn::maxrank_dn;
     using Wfn::maxrank_up;
     using Wfn::nbasis;
@@ -377,6 +649,12 @@ public:
 
     long index_det_from_rank(const Hash) const;
 
+    long index_det_with_rank(const ulong *, const Hash) const;
+
+    void index_dets(const ulong *, const long, long *) const;
+
+    void index_dets_with_rank(const ulong *, const Hash *, const long, long *) const;
+
     void copy_det(const long, ulong *) const;
 
     Hash rank_det(const ulong *) const;
@@ -389,33 +667,60 @@ public:
 
     void add_hartreefock_det(void);
 
-    void add_all_dets(long = -1);
+    void add_all_dets(long = -1, const std::string & = "hash");
 
     void add_excited_dets(const ulong *, const long);
 
     void add_dets_from_wfn(const OneSpinWfn &);
 
+    void add_dets(const ulong *, const long, long *);
+
+    void remove_dets(const long *, const long, long *);
+
+    void prune(const double *, const long, const double, long *);
+
     void reserve(const long);
 
+    void freeze(long *);
+
+    void lean_index(void);
+
     Array<ulong> py_getitem(const long) const;
 
     Array<ulong> py_to_det_array(long, long) const;
 
+    static Array<ulong> py_det_view(const pybind11::object &);
+
     Array<long> py_to_occ_array(long, long) const;
 
     long py_index_det(const Array<ulong>) const;
 
+    Array<long> py_index_dets(const Array<ulong>) const;
+
+    Array<long> py_freeze(void);
+
     Hash py_rank_det(const Array<ulong>) const;
 
     long py_add_det(const Array<ulong>);
 
     long py_add_occs(const Array<long>);
 
+    Array<long> py_add_dets(const Array<ulong>);
+
+    Array<long> py_add_occs_array(const Array<long>);
+
+    Array<long> py_remove_dets(const Array<long>);
+
+    Array<long> py_prune(const Array<double>, const double);
+
     long py_add_excited_dets(const long, const pybind11::object);
 };
 
 struct TwoSpinWfn : public Wfn {
 public:
+    using Wfn::complete;
+    using Wfn::frozen;
+    using Wfn::lean;
     using Wfn::maxrank_dn;
     using Wfn::maxrank_up;
     using Wfn::nbasis;
@@ -462,6 +767,12 @@ public:
 
     long index_det_from_rank(const Hash) const;
 
+    long index_det_with_rank(const ulong *, const Hash) const;
+
+    void index_dets(const ulong *, const long, long *) const;
+
+    void index_dets_with_rank(const ulong *, const Hash *, const long, long *) const;
+
     void copy_det(const long, ulong *) const;
 
     Hash rank_det(const ulong *) const;
@@ -474,33 +785,60 @@ public:
 
     void add_hartreefock_det(void);
 
-    void add_all_dets(long = -1);
+    void add_all_dets(long = -1, const std::string & = "hash");
 
     void add_excited_dets(const ulong *, const long, const long);
 
     void add_dets_from_wfn(const TwoSpinWfn &);
 
+    void add_dets(const ulong *, const long, long *);
+
+    void remove_dets(const long *, const long, long *);
+
+    void prune(const double *, const long, const double, long *);
+
     void reserve(const long);
 
+    void freeze(long *);
+
+    void lean_index(void);
+
     Array<ulong> py_getitem(const long) const;
 
     Array<ulong> py_to_det_array(long, long) const;
 
+    static Array<ulong> py_det_view(const pybind11::object &);
+
     Array<long> py_to_occ_array(long, long) const;
 
     long py_index_det(const Array<ulong>) const;
 
+    Array<long> py_index_dets(const Array<ulong>) const;
+
+    Array<long> py_freeze(void);
+
     Hash py_rank_det(const Array<ulong>) const;
 
     long py_add_det(const Array<ulong>);
 
     long py_add_occs(const Array<long>);
 
+    Array<long> py_add_dets(const Array<ulong>);
+
+    Array<long> py_add_occs_array(const Array<long>);
+
+    Array<long> py_remove_dets(const Array<long>);
+
+    Array<long> py_prune(const Array<double>, const double);
+
     long py_add_excited_dets(const long, const pybind11::object);
 };
 
 struct DOCIWfn final : public OneSpinWfn {
 public:
+    using Wfn::complete;
+    using Wfn::frozen;
+    using Wfn::lean;
     using Wfn::maxrank_dn;
     using Wfn::maxrank_up;
     using Wfn::nbasis;
@@ -538,6 +876,9 @@ public:
 
 struct FullCIWfn final : public TwoSpinWfn {
 public:
+    using Wfn::complete;
+    using Wfn::frozen;
+    using Wfn::lean;
     using Wfn::maxrank_dn;
     using Wfn::maxrank_up;
     using Wfn::nbasis;
@@ -577,6 +918,9 @@ public:
 
 struct GenCIWfn final : public OneSpinWfn {
 public:
+    using Wfn::complete;
+    using Wfn::frozen;
+    using Wfn::lean;
     using Wfn::maxrank_dn;
     using Wfn::maxrank_up;
     using Wfn::nbasis;
@@ -616,18 +960,69 @@ public:
     GenCIWfn(const long, const long, const long, const Array<long>);
 };
 
+/* Alpha/beta string-factorized sigma vector engine for FullCI wave functions. */
+
+struct FullCISigma final {
+public:
+    long nbasis, ndet;
+
+private:
+    struct StringList {
+        long nstr, nocc;
+        AlignedVector<long> occs;
+        AlignedVector<long> row_ptr, row_str, row_det;
+        AlignedVector<long> single_ptr, single_str, single_orb;
+        AlignedVector<double> single_sign, single_val;
+        AlignedVector<long> double_ptr, double_str;
+        AlignedVector<double> double_val;
+    };
+
+    const double *one_mo, *two_mo;
+    StringList up, dn;
+    AlignedVector<double> diag;
+
+public:
+    FullCISigma(void);
+
+    FullCISigma(const SQuantOp &, const FullCIWfn &, const long);
+
+    void diagonal(double *) const;
+
+    void perform_op(const double *, double *) const;
+
+private:
+    void init_strings(StringList &, const long, const long, const AlignedVector<ulong> &,
+                      const HashMap<Hash, long> &);
+
+    void perform_op_up_thread(const double *, double *, const long, const long) const;
+
+    void perform_op_dn_thread(const double *, double *, const long, const long) const;
+};
+
 /* Sparse matrix operator class. */
 
 struct SparseOp final {
 public:
-    long nrow, ncol, size;
-    double ecore;
-    bool symmetric;
+    long nrow, ncol, size, compact, ndrop;
+    double ecore, droptol;
+    bool symmetric, direct, exact;
     pybind11::tuple shape;
 
 private:
     AlignedVector<double> data;
-    AlignedVector<long> indices, indptr;
+    AlignedVector<long> indices, indptr, byteptr;
+    AlignedVector<std::uint32_t> cindices;
+    AlignedVector<std::uint8_t> bytes;
+    AlignedVector<ulong> excitations;
+    const SQuantOp *ham_ptr;
+    const Wfn *wfn_ptr;
+    long wfn_generation, nview;
+    pybind11::object ham_ref, wfn_ref;
+    void (SparseOp::*direct_thread)(const double *, double *, const long, const long) const;
+    void (SparseOp::*diagonal_thread)(double *, const long, const long) const;
+    double (SparseOp::*direct_element)(const long, const long) const;
+    void (SparseOp::*refill_thread)(const SQuantOp &, const long, const long, const long);
+    FullCISigma sigma;
 
 public:
     SparseOp(const SparseOp &);
@@ -636,14 +1031,24 @@ public:
 
     SparseOp(const long, const long, const bool);
 
-    SparseOp(const SQuantOp &, const DOCIWfn &, const long, const long, const bool);
+    SparseOp(const SQuantOp &, const DOCIWfn &, const long, const long, const bool,
+             const bool = false, const pybind11::object = pybind11::none(), const bool = false,
+             const double = 0.0);
 
-    SparseOp(const SQuantOp &, const FullCIWfn &, const long, const long, const bool);
+    SparseOp(const SQuantOp &, const FullCIWfn &, const long, const long, const bool,
+             const bool = false, const pybind11::object = pybind11::none(), const bool = false,
+             const double = 0.0);
 
-    SparseOp(const SQuantOp &, const GenCIWfn &, const long, const long, const bool);
+    SparseOp(const SQuantOp &, const GenCIWfn &, const long, const long, const bool,
+             const bool = false, const pybind11::object = pybind11::none(), const bool = false,
+             const double = 0.0);
+
+    static long compact_mode(const pybind11::object);
 
     pybind11::object dtype(void) const;
 
+    pybind11::object py_compact(void) const;
+
     const double *data_ptr(const long) const;
 
     const long *indices_ptr(const long) const;
@@ -656,12 +1061,34 @@ public:
 
     void perform_op_symm(const double *, double *) const;
 
+    void perform_op_direct(const double *, double *) const;
+
+    void perform_op_compact(const double *, double *) const;
+
+    void diagonal(double *) const;
+
+    void refill(const SQuantOp &);
+
     void solve_ci(const long, const double *, const long, const long, const double, double *,
                   double *) const;
 
+    void solve_davidson(const long, const double *, const long, const long, const long,
+                        const double, const std::string &, double *, double *) const;
+
     template<class WfnType>
     void update(const SQuantOp &, const WfnType &, const long, const long, const long);
 
+    template<class WfnType>
+    void hold(const SQuantOp &, const WfnType &);
+
+    template<class WfnType>
+    long count_rows(const SQuantOp &, const WfnType &, const long, const long, long *,
+                    long * = nullptr) const;
+
+    template<class WfnType>
+    static long py_count_nnz(const SQuantOp &, const WfnType &, const long, const long,
+                             const bool, const double);
+
     void reserve(const long);
 
     void squeeze(void);
@@ -670,26 +1097,78 @@ public:
 
     Array<double> py_matvec_out(const Array<double>, Array<double>) const;
 
+    Array<double> py_diagonal(void) const;
+
     pybind11::tuple py_solve_ci(const long, pybind11::object, const long, const long,
-                                const double) const;
+                                const double, const std::string &, const std::string &) const;
 
     template<class WfnType>
-    void py_update(const SQuantOp &, const WfnType &);
+    void py_update(const SQuantOp &, const WfnType &, const pybind11::object);
 
-    Array<double> py_data() const;
+    static Array<double> py_data(const pybind11::object &);
 
-    Array<long> py_indices() const;
+    static Array<long> py_indices(const pybind11::object &);
 
-    Array<long> py_indptr() const;
+    static Array<long> py_indptr(const pybind11::object &);
+
+    static pybind11::object py_to_scipy_csr(const pybind11::object &);
 
 private:
-    void sort_row(const long);
+    template<class WfnType>
+    void perform_op_direct_thread(const double *, double *, const long, const long) const;
+
+    template<class WfnType>
+    void diagonal_direct_thread(double *, const long, const long) const;
+
+    template<class WfnType>
+    double get_element_direct(const long, const long) const;
+
+    void diagonal_stored_thread(double *, const long, const long) const;
+
+    template<class WfnType>
+    void update_thread(const SQuantOp &, const WfnType &, const long, const long,
+                       AlignedVector<double> &, AlignedVector<long> &, AlignedVector<long> &,
+                       long &) const;
+
+    template<class WfnType>
+    void update_exact(const SQuantOp &, const WfnType &, const long, const long);
+
+    template<class WfnType>
+    void count_thread(const SQuantOp &, const WfnType &, const long, const long, long *,
+                      long *, long &) const;
+
+    template<class WfnType>
+    void fill_thread(const SQuantOp &, const WfnType &, const long, const long);
+
+    template<class WfnType>
+    void refill_values_thread(const SQuantOp &, const long, const long, const long);
+
+    void check_wfn(void) const;
+
+    void check_views(void) const;
+
+    void decode_row(const long, long *) const;
+
+    void add_row(const SQuantOp &, const DOCIWfn &, const long, ulong *, long *, long *, ulong *,
+                 long *, AlignedVector<double> &, AlignedVector<long> &,
+                 AlignedVector<long> &) const;
+
+    void add_row(const SQuantOp &, const FullCIWfn &, const long, ulong *, long *, long *, ulong *,
+                 long *, AlignedVector<double> &, AlignedVector<long> &,
+                 AlignedVector<long> &) const;
+
+    void add_row(const SQuantOp &, const GenCIWfn &, const long, ulong *, long *, long *, ulong *,
+                 long *, AlignedVector<double> &, AlignedVector<long> &,
+                 AlignedVector<long> &) const;
 
-    void add_row(const SQuantOp &, const DOCIWfn &, const long, ulong *, long *, long *);
+    void add_row_indices(const DOCIWfn &, const long, ulong *, long *, long *, ulong *, long *,
+                         AlignedVector<long> &) const;
 
-    void add_row(const SQuantOp &, const FullCIWfn &, const long, ulong *, long *, long *);
+    void add_row_indices(const FullCIWfn &, const long, ulong *, long *, long *, ulong *, long *,
+                         AlignedVector<long> &) const;
 
-    void add_row(const SQuantOp &, const GenCIWfn &, const long, ulong *, long *, long *);
+    void add_row_indices(const GenCIWfn &, const long, ulong *, long *, long *, ulong *, long *,
+                         AlignedVector<long> &) const;
 };
 
 /* FanCI objective classes. */
@@ -63,12 +63,13 @@ def add_seniorities(wfn, *seniorities):
 
     # Add determinants of specified seniorities
     for s in seniorities:
+        occs_list = []
         if not s:
             # Seniority-zero
             for occs_up in occ_up_array:
                 occs[0, :] = occs_up
                 occs[1, :] = occs_up
-                wfn.add_occs(occs)
+                occs_list.append(occs.copy())
         else:
             # Seniority-nonzero
             pairs = (wfn.nocc - s) // 2
@@ -77,14 +78,14 @@ def add_seniorities(wfn, *seniorities):
                     occs[0, :] = occs_up
                     for occs_dn in combinations(occs_up, wfn.nocc_dn):
                         occs[1, : wfn.nocc_dn] = occs_dn
-                        wfn.add_occs(occs)
+                        occs_list.append(occs.copy())
             elif not pairs:
                 for occs_up in occ_up_array:
                     occs[0, :] = occs_up
                     virs_up = np.setdiff1d(brange, occs_up, assume_unique=True)
                     for occs_dn in combinations(virs_up, wfn.nocc_dn):
                         occs[1, : wfn.nocc_dn] = occs_dn
-                        wfn.add_occs(occs)
+                        occs_list.append(occs.copy())
             else:
                 for occs_up in occ_up_array:
                     occs[0, :] = occs_up
@@ -93,4 +94,6 @@ def add_seniorities(wfn, *seniorities):
                         occs[1, :pairs] = occs_i_dn
                         for occs_a_dn in combinations(virs_up, wfn.nocc_dn - pairs):
                             occs[1, pairs : wfn.nocc_dn] = occs_a_dn
-                            wfn.add_occs(occs)
+                            occs_list.append(occs.copy())
+        if occs_list:
+            wfn.add_occs_array(np.array(occs_list))
@@ -157,6 +157,26 @@ w : numpy.ndarray
 
 )""");
 
+secondquant_op.def_readonly("coulomb", &SQuantOp::coulomb_array, R"""(
+Coulomb integral array :math:`J_{pq} = \left<pq|V|pq\right> = g_{pqpq}`.
+
+Returns
+-------
+coulomb : numpy.ndarray
+    Coulomb integral array.
+
+)""");
+
+secondquant_op.def_readonly("exchange", &SQuantOp::exchange_array, R"""(
+Exchange integral array :math:`K_{pq} = \left<pq|V|qp\right> = g_{pqqp}`.
+
+Returns
+-------
+exchange : numpy.ndarray
+    Exchange integral array.
+
+)""");
+
 secondquant_op.def(py::init<const std::string &>(), R"""(
 Initialize a second-quantized operator instance.
 
@@ -285,6 +305,36 @@ nvir_dn : int
 
 )""");
 
+wavefunction.def_readonly("complete", &Wfn::complete, R"""(
+Whether the wave function contains every determinant in its space.
+
+Returns
+-------
+complete : bool
+    Whether the wave function contains every determinant in its space.
+
+)""");
+
+wavefunction.def_readonly("frozen", &Wfn::frozen, R"""(
+Whether the wave function is frozen.
+
+Returns
+-------
+frozen : bool
+    Whether the wave function is frozen.
+
+)""");
+
+wavefunction.def_readonly("lean", &Wfn::lean, R"""(
+Whether the wave function indexes its determinants with a lean table.
+
+Returns
+-------
+lean : bool
+    Whether the wave function indexes its determinants with a lean table.
+
+)""");
+
 wavefunction.def("__len__", &Wfn::length, R"""(
 Return the number of determinants in the wave function.
 
@@ -355,6 +405,19 @@ array : numpy.ndarray
 )""",
                  py::arg("low") = -1, py::arg("high") = -1);
 
+one_spin_wfn.def("det_view", &OneSpinWfn::py_det_view, R"""(
+Return a read-only view of the determinants in the wave function.
+
+The view shares memory with the wave function. While any view exists, methods that would modify the
+determinants raise BufferError; delete the views first.
+
+Returns
+-------
+array : numpy.ndarray
+    Determinant array.
+
+)""");
+
 one_spin_wfn.def("to_occ_array", &OneSpinWfn::py_to_occ_array, R"""(
 Return a section of the wave function as a numpy.ndarray of occupation vectors.
 
@@ -394,6 +457,25 @@ index : int
 )""",
                  py::arg("det"));
 
+one_spin_wfn.def("index_dets", &OneSpinWfn::py_index_dets, R"""(
+Return the indices of determinants ``dets`` in the wave function.
+
+The determinants are hashed and their table entries are prefetched in batches. The index of a
+determinant that is not in the wave function is -1.
+
+Parameters
+----------
+dets : numpy.ndarray
+    Array of determinants, with shape (n, nword).
+
+Returns
+-------
+indices : numpy.ndarray
+    Indices of determinants or -1.
+
+)""",
+                 py::arg("dets"));
+
 one_spin_wfn.def("index_det_from_rank", &OneSpinWfn::index_det_from_rank, R"""(
 Return the index of determinant with rank ``rank`` in the wave function.
 
@@ -460,19 +542,62 @@ index : int
 )""",
                  py::arg("occs"));
 
+one_spin_wfn.def("add_dets", &OneSpinWfn::py_add_dets, R"""(
+Add an array of determinants to the wave function.
+
+The determinants are hashed in parallel and added in order.
+
+Parameters
+----------
+dets : numpy.ndarray
+    Array of determinants, with shape (n, nword).
+
+Returns
+-------
+indices : numpy.ndarray
+    Index of each determinant in the wave function, whether it was added or already present.
+
+)""",
+                 py::arg("dets"));
+
+one_spin_wfn.def("add_occs_array", &OneSpinWfn::py_add_occs_array, R"""(
+Add an array of occupation vectors to the wave function.
+
+The determinants are hashed in parallel and added in order.
+
+Parameters
+----------
+occs_array : numpy.ndarray
+    Array of occupation vectors, with shape (n, nocc_up).
+
+Returns
+-------
+indices : numpy.ndarray
+    Index of each determinant in the wave function, whether it was added or already present.
+
+)""",
+                 py::arg("occs_array"));
+
 one_spin_wfn.def("add_hartreefock_det", &OneSpinWfn::add_hartreefock_det,
                  "Add the Hartree-Fock determinant to the wave function.");
 
 one_spin_wfn.def("add_all_dets", &OneSpinWfn::add_all_dets, R"""(
 Add all determinants to the wave function.
 
+Determinants already in the wave function are moved to their colex rank, so sparse operators
+built from it must then be built again.
+
 Parameters
 ----------
 nthread : int
     Number of threads to use.
+index : {"hash", "rank"}, default="hash"
+    How the determinants are indexed. ``"hash"`` builds the usual hash table. ``"rank"`` makes
+    the wave function complete: determinants are indexed directly by their colex rank, without a
+    hash table, so ``index_det_from_rank`` cannot be used and no more determinants can be added.
 
 )""",
-                 py::arg("nthread") = -1);
+                 py::arg("nthread") = -1, py::arg("index") = "hash");
 
 one_spin_wfn.def("add_excited_dets", &OneSpinWfn::py_add_excited_dets, R"""(
 Add excited determinants to the wave function.
@@ -509,6 +634,71 @@ n : int
 )""",
                  py::arg("n"));
 
+one_spin_wfn.def("lean_index", &OneSpinWfn::lean_index, R"""(
+Index the determinants with a lean table.
+
+The hash table, which stores a 128-bit hash and an index per determinant, is replaced by an
+open-addressing table of 32-bit indices that is probed by comparing stored determinants. Indexing
+determinants by their hash with ``index_det_from_rank`` is then unavailable.
+
+)""");
+
+one_spin_wfn.def("freeze", &OneSpinWfn::py_freeze, R"""(
+Freeze the wave function.
+
+The determinants are sorted and found by binary search instead of by hash table, which is freed.
+No more determinants can be added to a frozen wave function. Sparse operators built from the wave
+function before it was frozen must be built again.
+
+Returns
+-------
+perm : numpy.ndarray
+    Previous index of each determinant. Coefficient vectors are reordered as ``coeffs[perm]``.
+
+)""");
+
+one_spin_wfn.def("remove_dets", &OneSpinWfn::py_remove_dets, R"""(
+Remove determinants from the wave function.
+
+The remaining determinants keep their order, and the index is rebuilt. A complete wave function
+is no longer complete afterwards; a frozen one stays frozen. Sparse operators built from the wave
+function must be built again.
+
+Parameters
+----------
+indices : numpy.ndarray
+    Indices of the determinants to remove.
+
+Returns
+-------
+map : numpy.ndarray
+    New index of each previous determinant, or -1 if it was removed. Coefficient vectors are
+    reduced as ``coeffs[map != -1]``.
+
+)""",
+                 py::arg("indices"));
+
+one_spin_wfn.def("prune", &OneSpinWfn::py_prune, R"""(
+Remove the determinants with small coefficients from the wave function.
+
+As with ``remove_dets``, sparse operators built from the wave function must be built again.
+
+Parameters
+----------
+coeffs : numpy.ndarray
+    Coefficient vector, or array of coefficient vectors with one row per state.
+threshold : float
+    A determinant is kept if the magnitude of its coefficient in any vector is >= threshold.
+
+Returns
+-------
+map : numpy.ndarray
+    New index of each previous determinant, or -1 if it was removed. Coefficient vectors are
+    reduced as ``coeffs[..., map != -1]``.
+
+)""",
+                 py::arg("coeffs"), py::arg("threshold"));
+
 /*
 Section: Two-spin wavefunction class
 */
@@ -567,6 +757,19 @@ array : numpy.ndarray
 )""",
                  py::arg("low") = -1, py::arg("high") = -1);
 
+two_spin_wfn.def("det_view", &TwoSpinWfn::py_det_view, R"""(
+Return a read-only view of the determinants in the wave function.
+
+The view shares memory with the wave function. While any view exists, methods that would modify the
+determinants raise BufferError; delete the views first.
+
+Returns
+-------
+array : numpy.ndarray
+    Determinant array.
+
+)""");
+
 two_spin_wfn.def("to_occ_array", &TwoSpinWfn::py_to_occ_array, R"""(
 Return a section of the wave function as a numpy.ndarray of occupation vectors.
 
@@ -606,6 +809,25 @@ index : int
 )""",
                  py::arg("det"));
 
+two_spin_wfn.def("index_dets", &TwoSpinWfn::py_index_dets, R"""(
+Return the indices of determinants ``dets`` in the wave function.
+
+The determinants are hashed and their table entries are prefetched in batches. The index of a
+determinant that is not in the wave function is -1.
+
+Parameters
+----------
+dets : numpy.ndarray
+    Array of determinants, with shape (n, 2, nword).
+
+Returns
+-------
+indices : numpy.ndarray
+    Indices of determinants or -1.
+
+)""",
+                 py::arg("dets"));
+
 two_spin_wfn.def("index_det_from_rank", &TwoSpinWfn::index_det_from_rank, R"""(
 Return the index of determinant with rank ``rank`` in the wave function.
 
@@ -672,19 +894,62 @@ index : int
 )""",
                  py::arg("occs"));
 
+two_spin_wfn.def("add_dets", &TwoSpinWfn::py_add_dets, R"""(
+Add an array of determinants to the wave function.
+
+The determinants are hashed in parallel and added in order.
+
+Parameters
+----------
+dets : numpy.ndarray
+    Array of determinants, with shape (n, 2, nword).
+
+Returns
+-------
+indices : numpy.ndarray
+    Index of each determinant in the wave function, whether it was added or already present.
+
+)""",
+                 py::arg("dets"));
+
+two_spin_wfn.def("add_occs_array", &TwoSpinWfn::py_add_occs_array, R"""(
+Add an array of occupation vectors to the wave function.
+
+The determinants are hashed in parallel and added in order.
+
+Parameters
+----------
+occs_array : numpy.ndarray
+    Array of occupation vectors, with shape (n, 2, nocc_up).
+
+Returns
+-------
+indices : numpy.ndarray
+    Index of each determinant in the wave function, whether it was added or already present.
+
+)""",
+                 py::arg("occs_array"));
+
 two_spin_wfn.def("add_hartreefock_det", &TwoSpinWfn::add_hartreefock_det,
                  "Add the Hartree-Fock determinant to the wave function.");
 
 two_spin_wfn.def("add_all_dets", &TwoSpinWfn::add_all_dets, R"""(
 Add all determinants to the wave function.
 
+Determinants already in the wave function are moved to their colex rank, so sparse operators
+built from it must then be built again.
+
 Parameters
 ----------
 nthread : int
     Number of threads to use.
+index : {"hash", "rank"}, default="hash"
+    How the determinants are indexed. ``"hash"`` builds the usual hash table. ``"rank"`` makes
+    the wave function complete: determinants are indexed directly by their colex rank, without a
+    hash table, so ``index_det_from_rank`` cannot be used and no more determinants can be added.
 
 )""",
-                 py::arg("nthread") = -1);
+                 py::arg("nthread") = -1, py::arg("index") = "hash");
 
 two_spin_wfn.def("add_excited_dets", &TwoSpinWfn::py_add_excited_dets, R"""(
 Add excited determinants to the wave function.
@@ -721,6 +986,71 @@ n : int
 )""",
                  py::arg("n"));
 
+two_spin_wfn.def("lean_index", &TwoSpinWfn::lean_index, R"""(
+Index the determinants with a lean table.
+
+The hash table, which stores a 128-bit hash and an index per determinant, is replaced by an
+open-addressing table of 32-bit indices that is probed by comparing stored determinants. Indexing
+determinants by their hash with ``index_det_from_rank`` is then unavailable.
+
+)""");
+
+two_spin_wfn.def("freeze", &TwoSpinWfn::py_freeze, R"""(
+Freeze the wave function.
+
+The determinants are sorted and found by binary search instead of by hash table, which is freed.
+No more determinants can be added to a frozen wave function. Sparse operators built from the wave
+function before it was frozen must be built again.
+
+Returns
+-------
+perm : numpy.ndarray
+    Previous index of each determinant. Coefficient vectors are reordered as ``coeffs[perm]``.
+
+)""");
+
+two_spin_wfn.def("remove_dets", &TwoSpinWfn::py_remove_dets, R"""(
+Remove determinants from the wave function.
+
+The remaining determinants keep their order, and the index is rebuilt. A complete wave function
+is no longer complete afterwards; a frozen one stays frozen. Sparse operators built from the wave
+function must be built again.
+
+Parameters
+----------
+indices : numpy.ndarray
+    Indices of the determinants to remove.
+
+Returns
+-------
+map : numpy.ndarray
+    New index of each previous determinant, or -1 if it was removed. Coefficient vectors are
+    reduced as ``coeffs[map != -1]``.
+
+)""",
+                 py::arg("indices"));
+
+two_spin_wfn.def("prune", &TwoSpinWfn::py_prune, R"""(
+Remove the determinants with small coefficients from the wave function.
+
+As with ``remove_dets``, sparse operators built from the wave function must be built again.
+
+Parameters
+----------
+coeffs : numpy.ndarray
+    Coefficient vector, or array of coefficient vectors with one row per state.
+threshold : float
+    A determinant is kept if the magnitude of its coefficient in any vector is >= threshold.
+
+Returns
+-------
+map : numpy.ndarray
+    New index of each previous determinant, or -1 if it was removed. Coefficient vectors are
+    reduced as ``coeffs[..., map != -1]``.
+
+)""",
+                 py::arg("coeffs"), py::arg("threshold"));
+
 /*
 Section: DOCI wave function class
 */
@@ -885,6 +1215,12 @@ py::class_<SparseOp> sparse_op(m, "sparse_op");
 
 sparse_op.doc() = R"""(
 Sparse matrix operator class.
+
+The rows and columns of an operator built from a wave function refer to its determinants by
+index. Appending determinants keeps the operator valid, and ``update`` extends it to the new rows.
+Removing or reordering determinants, with ``remove_dets``, ``prune``, ``freeze``, or
+``add_all_dets``, invalidates it: products and diagonals of a direct operator, ``refill``, and
+``update`` then raise RuntimeError, and the operator must be built again.
 )""";
 
 sparse_op.def_readonly("ecore", &SparseOp::ecore, R"""(
@@ -907,6 +1243,37 @@ symmetric : bool
 
 )""");
 
+sparse_op.def_readonly("direct", &SparseOp::direct, R"""(
+Whether the matrix elements are evaluated on the fly instead of being stored.
+
+Returns
+-------
+direct : bool
+    Whether the sparse matrix operator is direct (matrix-free).
+
+)""");
+
+sparse_op.def_readonly("exact", &SparseOp::exact, R"""(
+Whether the sparse matrix operator is built in two passes with an exact-size allocation.
+
+)""");
+
+sparse_op.def_readonly("droptol", &SparseOp::droptol, R"""(
+Magnitude below which off-diagonal matrix elements are not stored.
+
+)""");
+
+sparse_op.def_readonly("ndrop", &SparseOp::ndrop, R"""(
+Number of off-diagonal matrix elements that were not stored because of ``droptol``.
+
+)""");
+
+sparse_op.def_property_readonly("compact", &SparseOp::py_compact, R"""(
+Storage of the column indices (None: 64-bit, "uint32": 32-bit, "varint": delta/varint-encoded
+rows).
+
+)""");
+
 sparse_op.def_readonly("size", &SparseOp::size, R"""(
 Number of non-zero matrix elements.
 
@@ -939,7 +1306,8 @@ dtype : numpy.dtype
 
 )""");
 
-sparse_op.def(py::init<const SQuantOp &, const DOCIWfn &, const long, const long, const bool>(), R"""(
+sparse_op.def(py::init<const SQuantOp &, const DOCIWfn &, const long, const long, const bool,
+                       const bool, const py::object, const bool, const double>(), R"""(
 Initialize a sparse matrix operator.
 
 Parameters
@@ -954,18 +1322,94 @@ ncol : int, default=len(wfn)
     Number of columns in matrix, using the first ``ncol`` determinants in ``wfn``.
 symmetric : bool, default=False
     Whether to make the sparse matrix operator symmetric/Hermitian.
+direct : bool, default=False
+    Whether to evaluate the matrix elements on the fly in each matrix-vector product instead
+    of storing them. A direct operator keeps references to ``ham`` and ``wfn``. Square direct
+    FullCI operators group the determinants by their alpha and beta strings and evaluate the
+    matrix-vector product string-pair by string-pair.
+compact : {None, "uint32", "varint"}, default=None
+    Storage of the column indices. ``None`` stores 64-bit indices, ``"uint32"`` stores 32-bit
+    indices, and ``"varint"`` stores each row as the varint-encoded gaps between its sorted
+    column indices.
+    Compact storage reduces the memory footprint and bandwidth of the matrix-vector product.
+    Ignored by direct operators.
+exact : bool, default=False
+    Whether to count the nonzero elements of each row in a first pass, then allocate the matrix
+    once and fill it in place in a second pass. This keeps the peak memory of the build at the
+    size of the final matrix, at the cost of enumerating the excitations twice.
+droptol : float, default=0.0
+    Off-diagonal matrix elements with magnitude below this tolerance are not stored.
+    Ignored by direct operators.
 
 )""",
               py::arg("ham"), py::arg("wfn"), py::arg("nrow") = -1, py::arg("ncol") = -1,
-              py::arg("symmetric") = true);
+              py::arg("symmetric") = true, py::arg("direct") = false,
+              py::arg("compact") = py::none(), py::arg("exact") = false, py::arg("droptol") = 0.0);
 
-sparse_op.def(py::init<const SQuantOp &, const FullCIWfn &, const long, const long, const bool>(),
+sparse_op.def(py::init<const SQuantOp &, const FullCIWfn &, const long, const long, const bool,
+                       const bool, const py::object, const bool, const double>(),
               py::arg("ham"), py::arg("wfn"), py::arg("nrow") = -1, py::arg("ncol") = -1,
-              py::arg("symmetric") = true);
+              py::arg("symmetric") = true, py::arg("direct") = false,
+              py::arg("compact") = py::none(), py::arg("exact") = false, py::arg("droptol") = 0.0);
 
-sparse_op.def(py::init<const SQuantOp &, const GenCIWfn &, const long, const long, const bool>(),
+sparse_op.def(py::init<const SQuantOp &, const GenCIWfn &, const long, const long, const bool,
+                       const bool, const py::object, const bool, const double>(),
               py::arg("ham"), py::arg("wfn"), py::arg("nrow") = -1, py::arg("ncol") = -1,
-              py::arg("symmetric") = true);
+              py::arg("symmetric") = true, py::arg("direct") = false,
+              py::arg("compact") = py::none(), py::arg("exact") = false, py::arg("droptol") = 0.0);
+
+sparse_op.def_static("count_nnz", &SparseOp::py_count_nnz<DOCIWfn>, R"""(
+Count the nonzero elements of a sparse matrix operator without building it.
+
+Parameters
+----------
+ham : pyci.secondquant_op
+    Hamiltonian.
+wfn : pyci.wavefunction
+    Wave function.
+nrow : int, default=len(wfn)
+    Number of rows in matrix, using the first ``nrow`` determinants in ``wfn``.
+ncol : int, default=len(wfn)
+    Number of columns in matrix, using the first ``ncol`` determinants in ``wfn``.
+symmetric : bool, default=True
+    Whether to count only the lower triangle of a symmetric/Hermitian operator.
+droptol : float, default=0.0
+    Off-diagonal matrix elements with magnitude below this tolerance are not counted.
+
+Returns
+-------
+nnz : int
+    Number of nonzero elements that the sparse matrix operator would store.
+
+)""",
+                     py::arg("ham"), py::arg("wfn"), py::arg("nrow") = -1, py::arg("ncol") = -1,
+                     py::arg("symmetric") = true, py::arg("droptol") = 0.0);
+
+sparse_op.def_static("count_nnz", &SparseOp::py_count_nnz<FullCIWfn>, py::arg("ham"),
+                     py::arg("wfn"), py::arg("nrow") = -1, py::arg("ncol") = -1,
+                     py::arg("symmetric") = true, py::arg("droptol") = 0.0);
+
+sparse_op.def_static("count_nnz", &SparseOp::py_count_nnz<GenCIWfn>, py::arg("ham"),
+                     py::arg("wfn"), py::arg("nrow") = -1, py::arg("ncol") = -1,
+                     py::arg("symmetric") = true, py::arg("droptol") = 0.0);
+
+sparse_op.def("refill", &SparseOp::refill, R"""(
+Recompute the matrix elements of a sparse matrix operator from a new Hamiltonian.
+
+The sparsity pattern is kept, and each element is recomputed from its excitation descriptor
+without any determinant lookups. The descriptors are computed on the first call and reused by
+later calls, at the cost of 8 bytes per stored element. A stored operator holds only a weak
+reference to its wave function, which must still exist. A direct operator holds a reference to
+the new Hamiltonian in place of the old one. A stored operator built with ``droptol > 0`` cannot
+be refilled, since the new Hamiltonian would drop different elements; build a new operator instead.
+
+Parameters
+----------
+ham : pyci.secondquant_op
+    Hamiltonian, over the same number of orbitals as the wave function.
+
+)""",
+              py::arg("ham"));
 
 sparse_op.def("update", &SparseOp::py_update<DOCIWfn>, R"""(
 Update a sparse matrix operator for the HCI algorithm.
@@ -976,6 +1420,9 @@ ham : pyci.secondquant_op
     Hamiltonian.
 wfn : pyci.wavefunction
     Wave function.
+droptol : float, optional
+    Drop tolerance for the new rows, which must equal the operator's current tolerance, so that
+    every row is dropped alike. The operator's current tolerance is used if this is not specified.
 
 Notes
 -----
@@ -984,11 +1431,13 @@ This method doesn't work with rectangular operators. Those must
 be re-initialized from the wave function object.
 
 )""",
-              py::arg("ham"), py::arg("wfn"));
+              py::arg("ham"), py::arg("wfn"), py::arg("droptol") = py::none());
 
-sparse_op.def("update", &SparseOp::py_update<FullCIWfn>, py::arg("ham"), py::arg("wfn"));
+sparse_op.def("update", &SparseOp::py_update<FullCIWfn>, py::arg("ham"), py::arg("wfn"),
+              py::arg("droptol") = py::none());
 
-sparse_op.def("update", &SparseOp::py_update<GenCIWfn>, py::arg("ham"), py::arg("wfn"));
+sparse_op.def("update", &SparseOp::py_update<GenCIWfn>, py::arg("ham"), py::arg("wfn"),
+              py::arg("droptol") = py::none());
 
 sparse_op.def("__call__", &SparseOp::py_matvec, R"""(
 Compute the matrix vector product of the sparse matrix operator with vector ``x``.
@@ -1043,6 +1492,16 @@ Return the :math:`\left(i, j\right)`-th element of the sparse matrix operator.
 )""",
               py::arg("i"), py::arg("j"));
 
+sparse_op.def("diagonal", &SparseOp::py_diagonal, R"""(
+Return the diagonal of the sparse matrix operator.
+
+Returns
+-------
+diag : np.ndarray
+    Diagonal matrix elements (without the constant/"zero-electron" integral).
+
+)""");
+
 sparse_op.def("solve", &SparseOp::py_solve_ci, R"""(
 Solve a CI eigenproblem.
 
@@ -1051,13 +1510,27 @@ Parameters
 n : int, default=1
     Number of lowest eigenpairs to find.
 c0 : np.ndarray, default=[1,0,...,0]
-    Initial guess for lowest eigenvector.
+    Initial guess for lowest eigenvector, of shape ``(nrow,)``. With ``method="davidson"``, this
+    can also be an array of shape ``(k, nrow)`` holding several guess vectors, e.g., the
+    eigenvectors of a previous solve.
 ncv : int, default=min(nrow, max(2 * n + 1, 20))
-    Number of Lanczos vectors to use.
+    Number of Lanczos vectors to use. With ``method="davidson"``, this is the maximum dimension
+    of the subspace before it is collapsed onto the current Ritz vectors, and defaults to
+    ``min(nrow, 10 * n)``.
 maxiter : int, default=nrow * n * 10
     Maximum number of iterations to perform.
 tol : float, default=1.0e-12
-    Convergence tolerance.
+    Convergence tolerance. The Davidson solver converges when the residual norm of every root
+    is below ``sqrt(tol)``.
+method : ('lanczos' | 'davidson'), default='lanczos'
+    Eigensolver to use. ``'lanczos'`` uses implicitly restarted Lanczos, and ``'davidson'`` uses
+    block Davidson-Liu with the diagonal of the operator as the preconditioner.
+subspace : ('double' | 'float' | 'disk'), default='double'
+    Storage of the Davidson subspace vectors. ``'float'`` halves the memory of the subspace by
+    storing it in single precision, which limits the residual norms to about ``1.0e-6`` times the
+    largest eigenvalue magnitude. ``'disk'`` streams the subspace from memory-mapped scratch files
+    in ``$TMPDIR`` (default ``/tmp``). Only the projected matrices and a few vectors are kept in
+    memory in either case.
 
 Returns
 -------
@@ -1068,7 +1541,8 @@ cs : np.ndarray
 
 )""",
               py::arg("n") = 1, py::arg("c0") = py::none(), py::arg("ncv") = -1,
-              py::arg("maxiter") = -1, py::arg("tol") = 1.0e-12);
+              py::arg("maxiter") = -1, py::arg("tol") = 1.0e-12, py::arg("method") = "lanczos",
+              py::arg("subspace") = "double");
 
 sparse_op.def("reserve", &SparseOp::reserve, R"""(
 Reserve space in memory for ``n`` nonzero elements in the sparse matrix operator.
@@ -1083,9 +1557,40 @@ n : int
 
 sparse_op.def("squeeze", &SparseOp::squeeze, "Free any unused memory allocated to this object.");
 
-sparse_op.def("data", &SparseOp::py_data, "Return CSR matrix data vector", py::keep_alive<0, 1>());
-sparse_op.def("indices", &SparseOp::py_indices, "Return CSR matrix indices vector", py::keep_alive<0, 1>());
-sparse_op.def("indptr", &SparseOp::py_indptr, "Return CSR matrix index pointer vector", py::keep_alive<0, 1>());
+sparse_op.def("data", &SparseOp::py_data, R"""(
+Return a read-only view of the CSR matrix data vector.
+
+While any view exists, update, refill, reserve and squeeze raise BufferError.
+
+)""");
+
+sparse_op.def("indices", &SparseOp::py_indices, R"""(
+Return a read-only view of the CSR matrix indices vector.
+
+The indices of a compact sparse matrix operator are decoded into a new array.
+
+)""");
+
+sparse_op.def("indptr", &SparseOp::py_indptr, R"""(
+Return a read-only view of the CSR matrix index pointer vector.
+
+While any view exists, update, refill, reserve and squeeze raise BufferError.
+
+)""");
+
+sparse_op.def("to_scipy_csr", &SparseOp::py_to_scipy_csr, R"""(
+Return the sparse matrix operator as a SciPy CSR matrix.
+
+The matrix shares memory with the operator, except for the indices of a compact operator, and the
+operator cannot be modified while the matrix exists. A symmetric operator stores only the lower
+triangle of the matrix, so it raises a ValueError instead.
+
+Returns
+-------
+matrix : scipy.sparse.csr_matrix
+    Sparse matrix.
+
+)""");
 
 /*
 Section: Free functions
@@ -1152,6 +1657,12 @@ Add determinants to a wave function by running an iteration of Heat-Bath CI [HCI
           inspired by heat-bath sampling." *Journal of chemical theory and computation*
           12.8 (2016): 3674-3680.
 
+The excitations are screened with heat-bath lists, which are built on the first call for a
+Hamiltonian and kept with it. The same-spin lists take up to 12 bytes for each pair of orbital
+pairs, about 3/8 of the memory of ``ham.two_mo``, and the opposite-spin lists of a FullCI wave
+function take 4 bytes for each nonzero integral, up to 1/2 of the memory of ``ham.two_mo``. The
+pair lists of a DOCI wave function take 12 bytes for each pair of orbitals.
+
 Parameters
 ----------
 ham : pyci.secondquant_op
@@ -1344,6 +1855,9 @@ m.def("compute_transition_rdms", &py_compute_transition_rdms_genci,
 m.def("compute_enpt2", &py_compute_enpt2<DOCIWfn>, R"""(
 Compute the second-order multi-reference Epstein-Nesbet (ENPT2) energy for a wave function.
 
+The excitations are screened with the same-spin and opposite-spin heat-bath lists of ``add_hci``,
+which are kept with the Hamiltonian; see ``add_hci`` for their memory cost.
+
 Parameters
 ----------
 ham : pyci.secondquant_op
@@ -1358,6 +1872,10 @@ eps : float, default=1.0e-5
     :math:`\epsilon` value for ENPT2 routine.
 nthread : int
     Number of threads to use.
+max_memory : int, default=0
+    Approximate bound in bytes on the memory used to store the external determinants, or ``0``
+    for no bound. If the external determinants do not fit, they are split by hash into ranges that
+    are computed in separate passes over the wave function.
 
 Returns
 -------
@@ -1366,13 +1884,122 @@ pt_energy : float
 
 )""",
       py::arg("ham"), py::arg("wfn"), py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-5,
-      py::arg("nthread") = -1);
+      py::arg("nthread") = -1, py::arg("max_memory") = 0);
 
 m.def("compute_enpt2", &py_compute_enpt2<FullCIWfn>, py::arg("ham"), py::arg("wfn"),
-      py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-5, py::arg("nthread") = -1);
+      py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-5, py::arg("nthread") = -1,
+      py::arg("max_memory") = 0);
 
 m.def("compute_enpt2", &py_compute_enpt2<GenCIWfn>, py::arg("ham"), py::arg("wfn"),
-      py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-5, py::arg("nthread") = -1);
+      py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-5, py::arg("nthread") = -1,
+      py::arg("max_memory") = 0);
+
+m.def("compute_enpt2_multistate", &py_compute_enpt2_multistate<DOCIWfn>, R"""(
+Compute the ENPT2 energies of several states of a wave function in a single pass.
+
+The external determinants are generated once for all of the states, and the diagonal element of
+each one is computed once. An excitation is kept if :math:`|H_{ai}| \max_k |c_{ki}| > \epsilon`.
+
+Parameters
+----------
+ham : pyci.secondquant_op
+    Hamiltonian.
+wfn : pyci.wavefunction
+    Wave function.
+coeffs : numpy.ndarray
+    Coefficient vectors of the states, with shape (nroot, ndet).
+energies : numpy.ndarray
+    Variational CI energies of the states, with shape (nroot,).
+eps : float, default=1.0e-5
+    :math:`\epsilon` value for ENPT2 routine.
+nthread : int
+    Number of threads to use.
+max_memory : int, default=0
+    Approximate bound in bytes on the memory used to store the external determinants; see
+    ``compute_enpt2``.
+
+Returns
+-------
+pt_energies : numpy.ndarray
+    ENPT2 energies of the states.
+
+)""",
+      py::arg("ham"), py::arg("wfn"), py::arg("coeffs"), py::arg("energies"),
+      py::arg("eps") = 1.0e-5, py::arg("nthread") = -1, py::arg("max_memory") = 0);
+
+m.def("compute_enpt2_multistate", &py_compute_enpt2_multistate<FullCIWfn>, py::arg("ham"),
+      py::arg("wfn"), py::arg("coeffs"), py::arg("energies"), py::arg("eps") = 1.0e-5,
+      py::arg("nthread") = -1, py::arg("max_memory") = 0);
+
+m.def("compute_enpt2_multistate", &py_compute_enpt2_multistate<GenCIWfn>, py::arg("ham"),
+      py::arg("wfn"), py::arg("coeffs"), py::arg("energies"), py::arg("eps") = 1.0e-5,
+      py::arg("nthread") = -1, py::arg("max_memory") = 0);
+
+m.def("compute_enpt2_semistochastic", &py_compute_enpt2_semistochastic<DOCIWfn>, R"""(
+Compute the ENPT2 energy for a wave function with the semistochastic method.
+
+The terms of the ENPT2 correction with :math:`|H_{ai} c_i| > \epsilon_d` are computed
+deterministically, as in ``compute_enpt2``, and the remaining terms with
+:math:`|H_{ai} c_i| > \epsilon` are estimated from batches of ``nsample`` determinants drawn from
+the wave function with probability :math:`|c_i| / \sum_j |c_j|`, following Sharma et al.,
+J. Chem. Theory Comput. 13, 1595 (2017). Batches are added until the standard error of their mean
+is below ``tol``, or ``max_batch`` batches have been computed.
+
+Each batch is drawn from its own random number generator seeded from ``seed``, and the batches are
+used in order, so that the result is the same for any number of threads.
+
+Parameters
+----------
+ham : pyci.secondquant_op
+    Hamiltonian.
+wfn : pyci.wavefunction
+    Wave function.
+coeffs : numpy.ndarray
+    Coefficient vector.
+energy : float
+    Variational CI energy for this wave function and Hamiltonian.
+eps : float, default=1.0e-8
+    :math:`\epsilon` value for the full ENPT2 correction.
+eps_d : float, default=1.0e-5
+    :math:`\epsilon_d` value for the deterministic part of the correction.
+nsample : int, default=200
+    Number of determinants drawn per batch.
+tol : float, default=1.0e-5
+    Target standard error of the energy.
+max_batch : int, default=10000
+    Maximum number of batches.
+seed : int, default=0
+    Seed of the random number generators.
+nthread : int
+    Number of threads to use.
+max_memory : int, default=0
+    Approximate bound in bytes on the memory used by the deterministic part; see
+    ``compute_enpt2``.
+
+Returns
+-------
+pt_energy : float
+    ENPT2 energy.
+error : float
+    Standard error of ``pt_energy``.
+
+)""",
+      py::arg("ham"), py::arg("wfn"), py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-8,
+      py::arg("eps_d") = 1.0e-5, py::arg("nsample") = 200, py::arg("tol") = 1.0e-5,
+      py::arg("max_batch") = 10000, py::arg("seed") = 0, py::arg("nthread") = -1,
+      py::arg("max_memory") = 0);
+
+m.def("compute_enpt2_semistochastic", &py_compute_enpt2_semistochastic<FullCIWfn>,
+      py::arg("ham"), py::arg("wfn"), py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-8,
+      py::arg("eps_d") = 1.0e-5, py::arg("nsample") = 200, py::arg("tol") = 1.0e-5,
+      py::arg("max_batch") = 10000, py::arg("seed") = 0, py::arg("nthread") = -1,
+      py::arg("max_memory") = 0);
+
+m.def("compute_enpt2_semistochastic", &py_compute_enpt2_semistochastic<GenCIWfn>,
+      py::arg("ham"), py::arg("wfn"), py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-8,
+      py::arg("eps_d") = 1.0e-5, py::arg("nsample") = 200, py::arg("tol") = 1.0e-5,
+      py::arg("max_batch") = 10000, py::arg("seed") = 0, py::arg("nthread") = -1,
+      py::arg("max_memory") = 0);
 
 /*
 Section: FanCI classes
@@ -21,7 +21,13 @@ namespace {
 
 long gcd(long, long);
 
-}
+template<long N>
+void fill_occs_fixed(const ulong *, long *);
+
+template<long N>
+void fill_virs_fixed(long, const ulong *, long *);
+
+} // namespace
 
 long g_number_threads{1L};
 
@@ -83,6 +89,17 @@ void fill_det(const long nocc, const long *occs, ulong *det) {
 }
 
 void fill_occs(const long nword, const ulong *det, long *occs) {
+    // dispatch the common determinant widths to fixed-width code
+    switch (nword) {
+    case 1:
+        return fill_occs_fixed<1>(det, occs);
+    case 2:
+        return fill_occs_fixed<2>(det, occs);
+    case 3:
+        return fill_occs_fixed<3>(det, occs);
+    case 4:
+        return fill_occs_fixed<4>(det, occs);
+    }
     long p, j = 0, offset = 0;
     ulong word;
     for (long i = 0; i < nword; ++i) {
@@ -97,6 +114,16 @@ void fill_occs(const long nword, const ulong *det, long *occs) {
 }
 
 void fill_virs(const long nword, long nbasis, const ulong *det, long *virs) {
+    switch (nword) {
+    case 1:
+        return fill_virs_fixed<1>(nbasis, det, virs);
+    case 2:
+        return fill_virs_fixed<2>(nbasis, det, virs);
+    case 3:
+        return fill_virs_fixed<3>(nbasis, det, virs);
+    case 4:
+        return fill_virs_fixed<4>(nbasis, det, virs);
+    }
     long p, j = 0, offset = 0;
     ulong word, mask;
     for (long i = 0; i < nword; ++i) {
@@ -293,6 +320,89 @@ void clearbit_det(const long i, ulong *det) {
     det[i / Size<ulong>()] &= ~(1UL << (i % Size<ulong>()));
 }
 
+bool testbit_det(const long i, const ulong *det) {
+    return (det[i / Size<ulong>()] >> (i % Size<ulong>())) & 1UL;
+}
+
+double diag_det(const SQuantOp &ham, const long nocc_up, const long *occs_up, const long nocc_dn,
+                const long *occs_dn) {
+    // one-electron terms, then same-spin Coulomb minus exchange and opposite-spin Coulomb terms
+    const long n1 = ham.nbasis;
+    const double *jmat = ham.coulomb, *kmat = ham.exchange;
+    long i, j, p, q;
+    double val = 0.0;
+    for (i = 0; i < nocc_up; ++i) {
+        p = n1 * occs_up[i];
+        val += ham.h[occs_up[i]];
+        for (j = i + 1; j < nocc_up; ++j) {
+            q = occs_up[j];
+            val += jmat[p + q] - kmat[p + q];
+        }
+        for (j = 0; j < nocc_dn; ++j)
+            val += jmat[p + occs_dn[j]];
+    }
+    for (i = 0; i < nocc_dn; ++i) {
+        p = n1 * occs_dn[i];
+        val += ham.h[occs_dn[i]];
+        for (j = i + 1; j < nocc_dn; ++j) {
+            q = occs_dn[j];
+            val += jmat[p + q] - kmat[p + q];
+        }
+    }
+    return val;
+}
+
+double diag_single_det(const SQuantOp &ham, const long nocc, const long *occs,
+                       const long nocc_other, const long *occs_other, const long i, const long a) {
+    // change in the diagonal element for the excitation i -> a among occs
+    const long n1 = ham.nbasis, ni = n1 * i, na = n1 * a;
+    const double *jmat = ham.coulomb, *kmat = ham.exchange;
+    double val = ham.h[a] - ham.h[i];
+    for (long k = 0, p; k < nocc; ++k) {
+        p = occs[k];
+        if (p != i)
+            val += jmat[na + p] - kmat[na + p] - jmat[ni + p] + kmat[ni + p];
+    }
+    for (long k = 0, p; k < nocc_other; ++k) {
+        p = occs_other[k];
+        val += jmat[na + p] - jmat[ni + p];
+    }
+    return val;
+}
+
+double diag_double_det(const SQuantOp &ham, const long nocc, const long *occs,
+                       const long nocc_other, const long *occs_other, const long i, const long j,
+                       const long a, const long b) {
+    // change in the diagonal element for the excitation i, j -> a, b among occs
+    const long n1 = ham.nbasis, ni = n1 * i, nj = n1 * j, na = n1 * a, nb = n1 * b;
+    const double *jmat = ham.coulomb, *kmat = ham.exchange;
+    double val = ham.h[a] + ham.h[b] - ham.h[i] - ham.h[j] + jmat[na + b] - kmat[na + b] -
+                 jmat[ni + j] + kmat[ni + j];
+    for (long k = 0, p; k < nocc; ++k) {
+        p = occs[k];
+        if (p != i && p != j)
+            val += jmat[na + p] + jmat[nb + p] - jmat[ni + p] - jmat[nj + p] - kmat[na + p] -
+                   kmat[nb + p] + kmat[ni + p] + kmat[nj + p];
+    }
+    for (long k = 0, p; k < nocc_other; ++k) {
+        p = occs_other[k];
+        val += jmat[na + p] + jmat[nb + p] - jmat[ni + p] - jmat[nj + p];
+    }
+    return val;
+}
+
+double diag_mixed_det(const SQuantOp &ham, const long nocc, const long *occs,
+                      const long nocc_other, const long *occs_other, const long i, const long a,
+                      const long j, const long b) {
+    // change in the diagonal element for the excitations i -> a among occs and j -> b among
+    // occs_other; the two single excitations are corrected for the pair terms that they share
+    const long n1 = ham.nbasis;
+    const double *jmat = ham.coulomb;
+    return diag_single_det(ham, nocc, occs, nocc_other, occs_other, i, a) +
+           diag_single_det(ham, nocc_other, occs_other, nocc, occs, j, b) + jmat[n1 * a + b] -
+           jmat[n1 * a + j] - jmat[n1 * i + b] + jmat[n1 * i + j];
+}
+
 long py_popcnt(const Array<ulong> det) {
     pybind11::buffer_info buf = det.request();
     return popcnt_det(buf.shape[0], reinterpret_cast<const ulong *>(buf.ptr));
@@ -320,6 +430,26 @@ long gcd(long x, long y) {
     return x;
 }
 
+template<long N>
+void fill_occs_fixed(const ulong *det, long *occs) {
+    // the word loop has a compile-time trip count, so it is unrolled
+    long j = 0;
+    for (long i = 0; i < N; ++i)
+        for (ulong word = det[i]; word; word &= word - 1)
+            occs[j++] = Ctz(word) + i * Size<ulong>();
+}
+
+template<long N>
+void fill_virs_fixed(long nbasis, const ulong *det, long *virs) {
+    long j = 0;
+    ulong mask;
+    for (long i = 0; i < N; ++i, nbasis -= Size<ulong>()) {
+        mask = (nbasis < Size<ulong>()) ? ((1UL << nbasis) - 1) : Max<ulong>();
+        for (ulong word = det[i] ^ mask; word; word &= word - 1)
+            virs[j++] = Ctz(word) + i * Size<ulong>();
+    }
+}
+
 } // namespace
 
 } // namespace pyci
@@ -0,0 +1,353 @@
+/* This file is part of PyCI.
+ *
+ * PyCI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * PyCI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PyCI. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <pyci.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace pyci {
+
+namespace {
+
+/* Davidson subspace vectors, held in memory or in a memory-mapped scratch file. */
+
+template<typename T>
+class Subspace {
+public:
+    Subspace(const long nrow_, const long maxvec, const bool disk)
+        : nrow(nrow_), nvec(0), nbyte(sizeof(T) * nrow_ * maxvec), ptr(nullptr) {
+        if (!disk) {
+            mem.resize(nrow * maxvec);
+            ptr = mem.data();
+            return;
+        }
+        // the scratch file is unlinked right away, so it is removed when it is unmapped
+        const char *dir = std::getenv("TMPDIR");
+        std::string path = std::string((dir != nullptr) ? dir : "/tmp") + "/pyci_XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd == -1)
+            throw std::runtime_error("cannot create scratch file for Davidson subspace");
+        unlink(path.c_str());
+        if (ftruncate(fd, nbyte) == 0)
+            ptr = static_cast<T *>(
+                mmap(nullptr, nbyte, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+        close(fd);
+        if (ptr == nullptr || ptr == MAP_FAILED)
+            throw std::runtime_error("cannot map scratch file for Davidson subspace");
+    }
+
+    Subspace(const Subspace &) = delete;
+
+    ~Subspace(void) {
+        if (mem.empty() && ptr != nullptr && ptr != MAP_FAILED)
+            munmap(ptr, nbyte);
+    }
+
+    long size(void) const {
+        return nvec;
+    }
+
+    const T *operator[](const long k) const {
+        return ptr + k * nrow;
+    }
+
+    T *operator[](const long k) {
+        return ptr + k * nrow;
+    }
+
+    void push_back(const double *v) {
+        std::copy(v, v + nrow, ptr + nvec++ * nrow);
+    }
+
+    void resize(const long n) {
+        nvec = n;
+    }
+
+private:
+    long nrow, nvec;
+    std::size_t nbyte;
+    T *ptr;
+    AlignedVector<T> mem;
+};
+
+template<typename T, typename U>
+double dot(const long n, const T *x, const U *y) {
+    double val = 0.0;
+    for (long i = 0; i < n; ++i)
+        val += static_cast<double>(x[i]) * y[i];
+    return val;
+}
+
+template<typename T>
+void axpy(const long n, const double a, const T *x, double *y) {
+    for (long i = 0; i < n; ++i)
+        y[i] += a * x[i];
+}
+
+/* Threaded versions of the vector kernels, over contiguous chunks of the rows. */
+
+long num_row_threads(const long nrow) {
+    long nthread = get_num_threads();
+    long chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    }
+    return nthread;
+}
+
+template<typename T, typename U>
+void dot_thread(const T *x, const U *y, const long start, const long end, double &val) {
+    val = dot(end - start, x + start, y + start);
+}
+
+template<typename T, typename U>
+double parallel_dot(const long n, const T *x, const U *y) {
+    long nthread = num_row_threads(n);
+    if (nthread == 1)
+        return dot(n, x, y);
+    Vector<double> v_val(nthread);
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&dot_thread<T, U>, x, y, end_chunk_idx(i, nthread, n),
+                               std::min(end_chunk_idx(i + 1, nthread, n), n),
+                               std::ref(v_val[i]));
+    for (auto &thread : v_threads)
+        thread.join();
+    return std::accumulate(v_val.begin(), v_val.end(), 0.0);
+}
+
+template<typename T>
+void axpy_thread(const double a, const T *x, double *y, const long start, const long end) {
+    axpy(end - start, a, x + start, y + start);
+}
+
+template<typename T>
+void parallel_axpy(const long n, const double a, const T *x, double *y) {
+    long nthread = num_row_threads(n);
+    if (nthread == 1)
+        return axpy(n, a, x, y);
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&axpy_thread<T>, a, x, y, end_chunk_idx(i, nthread, n),
+                               std::min(end_chunk_idx(i + 1, nthread, n), n));
+    for (auto &thread : v_threads)
+        thread.join();
+}
+
+void precondition_thread(const double theta, const double *diag, const double *r, double *v,
+                         const long start, const long end) {
+    for (long i = start; i < end; ++i) {
+        double denom = theta - diag[i];
+        if (std::abs(denom) < 1.0e-8)
+            denom = std::copysign(1.0e-8, denom);
+        v[i] = r[i] / denom;
+    }
+}
+
+void precondition(const long n, const double theta, const double *diag, const double *r,
+                  double *v) {
+    // apply the diagonal (Davidson) preconditioner to the residual r
+    long nthread = num_row_threads(n);
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&precondition_thread, theta, diag, r, v,
+                               end_chunk_idx(i, nthread, n),
+                               std::min(end_chunk_idx(i + 1, nthread, n), n));
+    for (auto &thread : v_threads)
+        thread.join();
+}
+
+template<typename T>
+bool add_basis_vector(Subspace<T> &basis, const long nrow, double *v) {
+    // orthonormalize v against the basis with two passes of modified Gram-Schmidt and append it,
+    // unless it is numerically linearly dependent on the basis
+    double norm = std::sqrt(parallel_dot(nrow, v, v));
+    for (int pass = 0; pass < 2; ++pass)
+        for (long k = 0; k < basis.size(); ++k)
+            parallel_axpy(nrow, -parallel_dot(nrow, basis[k], v), basis[k], v);
+    double vnorm = std::sqrt(parallel_dot(nrow, v, v));
+    if (norm == 0.0 || vnorm < 1.0e-8 * norm)
+        return false;
+    for (long i = 0; i < nrow; ++i)
+        v[i] /= vnorm;
+    basis.push_back(v);
+    return true;
+}
+
+template<typename T>
+void transform_subspace_thread(Subspace<T> &basis, const Eigen::MatrixXd &coeffs,
+                               const long rstart, const long rend) {
+    // transform rows [rstart, rend) one block of rows at a time
+    const long m = coeffs.rows(), n = coeffs.cols(), blksize = 4096;
+    AlignedVector<double> block(n * blksize);
+    for (long start = rstart, end; start < rend; start += blksize) {
+        end = std::min(start + blksize, rend);
+        std::fill(block.begin(), block.end(), 0.0);
+        for (long j = 0; j < m; ++j)
+            for (long k = 0; k < n; ++k)
+                axpy(end - start, coeffs(j, k), basis[j] + start, &block[k * blksize]);
+        for (long k = 0; k < n; ++k)
+            std::copy(&block[k * blksize], &block[k * blksize] + end - start, basis[k] + start);
+    }
+}
+
+template<typename T>
+void transform_subspace(Subspace<T> &basis, const long nrow, const Eigen::MatrixXd &coeffs) {
+    // replace the first coeffs.cols() vectors with the linear combinations given by the columns
+    // of coeffs, in place; each row depends only on the same row of the old vectors
+    long nthread = num_row_threads(nrow);
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&transform_subspace_thread<T>, std::ref(basis), std::cref(coeffs),
+                               end_chunk_idx(i, nthread, nrow),
+                               std::min(end_chunk_idx(i + 1, nthread, nrow), nrow));
+    for (auto &thread : v_threads)
+        thread.join();
+    basis.resize(coeffs.cols());
+}
+
+template<typename T>
+void davidson(const SparseOp &op, const long n, const double *coeffs, const long ncoeffs,
+              const long mmax, const long niter, const double tol, const bool disk, double *evals,
+              double *evecs) {
+    const long nrow = op.nrow;
+    // eigenvalues are computed from the projected matrix of the stored vectors, but a reduced
+    // precision sigma subspace puts a floor under the residual norms
+    const double restol = std::sqrt(tol), eps = 10 * std::numeric_limits<T>::epsilon();
+    Subspace<T> basis(nrow, mmax, disk), sigma(nrow, mmax, disk);
+    AlignedVector<double> diag(nrow), vec(nrow), ax(nrow);
+    AlignedVector<long> order(nrow);
+    Eigen::MatrixXd proj(mmax, mmax), ovlp(mmax, mmax);
+    op.diagonal(&diag[0]);
+    // start from the guess vectors, then from unit vectors for the lowest diagonal elements
+    for (long i = 0; i < ncoeffs && basis.size() < mmax; ++i) {
+        std::copy(coeffs + i * nrow, coeffs + (i + 1) * nrow, vec.begin());
+        add_basis_vector(basis, nrow, &vec[0]);
+    }
+    // only the lowest few diagonal elements are needed; each rejected unit vector lies in the span
+    // of the guesses and the accepted unit vectors, so at most ncoeffs of them are rejected
+    const long nlow = std::min(nrow, 2 * n + ncoeffs);
+    std::iota(order.begin(), order.end(), 0L);
+    std::partial_sort(order.begin(), order.begin() + nlow, order.end(),
+                      [&diag](long i, long j) { return diag[i] < diag[j]; });
+    for (long i = 0; i < nlow && basis.size() < n; ++i) {
+        std::fill(vec.begin(), vec.end(), 0.0);
+        vec[order[i]] = 1.0;
+        add_basis_vector(basis, nrow, &vec[0]);
+    }
+    for (long iter = 0; iter < niter; ++iter) {
+        // compute the products of the new basis vectors as stored and update the projected
+        // Hamiltonian and overlap matrices
+        for (long k = sigma.size(), j; k < basis.size(); ++k) {
+            std::copy(basis[k], basis[k] + nrow, vec.begin());
+            op.perform_op(&vec[0], &ax[0]);
+            for (j = 0; j <= k; ++j) {
+                proj(k, j) = proj(j, k) = parallel_dot(nrow, basis[j], &ax[0]);
+                ovlp(k, j) = ovlp(j, k) = parallel_dot(nrow, basis[j], &vec[0]);
+            }
+            sigma.push_back(&ax[0]);
+        }
+        const long m = basis.size();
+        Eigen::GeneralizedSelfAdjointEigenSolver<Eigen::MatrixXd> eigs(
+            proj.topLeftCorner(m, m), ovlp.topLeftCorner(m, m));
+        Eigen::VectorXd theta = eigs.eigenvalues().head(n);
+        Eigen::MatrixXd c = eigs.eigenvectors().leftCols(n);
+        double rtol = std::max(restol, eps * theta.cwiseAbs().maxCoeff());
+        // collapse the subspace onto the Ritz vectors when it has no room for n new vectors
+        if (m + n > mmax && m > n) {
+            transform_subspace(basis, nrow, c);
+            if (std::is_same<T, double>::value) {
+                transform_subspace(sigma, nrow, c);
+            } else {
+                // recompute the products of the rounded Ritz vectors
+                sigma.resize(0);
+                for (long k = 0; k < n; ++k) {
+                    std::copy(basis[k], basis[k] + nrow, vec.begin());
+                    op.perform_op(&vec[0], &ax[0]);
+                    sigma.push_back(&ax[0]);
+                }
+            }
+            for (long k = 0, j; k < n; ++k) {
+                for (j = 0; j <= k; ++j) {
+                    proj(k, j) = proj(j, k) = parallel_dot(nrow, basis[j], sigma[k]);
+                    ovlp(k, j) = ovlp(j, k) = parallel_dot(nrow, basis[j], basis[k]);
+                }
+            }
+            Eigen::GeneralizedSelfAdjointEigenSolver<Eigen::MatrixXd> ceigs(
+                proj.topLeftCorner(n, n), ovlp.topLeftCorner(n, n));
+            theta = ceigs.eigenvalues();
+            c = ceigs.eigenvectors();
+        }
+        // compute the Ritz vectors in the output array and add the preconditioned residuals of
+        // the unconverged roots to the subspace
+        std::fill(evecs, evecs + n * nrow, 0.0);
+        for (long j = 0; j < c.rows(); ++j)
+            for (long k = 0; k < n; ++k)
+                parallel_axpy(nrow, c(j, k), basis[j], evecs + k * nrow);
+        long nconv = 0, nbasis = basis.size();
+        for (long k = 0; k < n; ++k) {
+            std::fill(ax.begin(), ax.end(), 0.0);
+            for (long j = 0; j < c.rows(); ++j)
+                parallel_axpy(nrow, c(j, k), sigma[j], &ax[0]);
+            parallel_axpy(nrow, -theta[k], evecs + k * nrow, &ax[0]);
+            if (std::sqrt(parallel_dot(nrow, &ax[0], &ax[0])) < rtol) {
+                ++nconv;
+                continue;
+            }
+            precondition(nrow, theta[k], &diag[0], &ax[0], &vec[0]);
+            if (basis.size() < mmax)
+                add_basis_vector(basis, nrow, &vec[0]);
+        }
+        if (nconv == n || nbasis == nrow) {
+            for (long k = 0; k < n; ++k)
+                evals[k] = theta[k] + op.ecore;
+            return;
+        } else if (basis.size() == nbasis) {
+            break;
+        }
+    }
+    throw std::runtime_error("did not converge");
+}
+
+} // namespace
+
+void SparseOp::solve_davidson(const long n, const double *coeffs, const long ncoeffs,
+                              const long maxdim, const long maxiter, const double tol,
+                              const std::string &subspace, double *evals, double *evecs) const {
+    if (n < 1 || n > nrow) {
+        throw std::invalid_argument("cannot find n eigenpairs for sparse operator with <n rows");
+    } else if (nrow != ncol) {
+        throw pybind11::type_error("Can only solve sparse symmetric matrix operators");
+    }
+    long mmax = std::min(nrow, std::max((maxdim != -1) ? maxdim : n * 10, 2 * n));
+    long niter = (maxiter != -1) ? maxiter : n * nrow * 10;
+    if (subspace == "double")
+        davidson<double>(*this, n, coeffs, ncoeffs, mmax, niter, tol, false, evals, evecs);
+    else if (subspace == "float")
+        davidson<float>(*this, n, coeffs, ncoeffs, mmax, niter, tol, false, evals, evecs);
+    else if (subspace == "disk")
+        davidson<double>(*this, n, coeffs, ncoeffs, mmax, niter, tol, true, evals, evecs);
+    else
+        throw std::invalid_argument("subspace must be 'double', 'float', or 'disk'");
+}
+
+} // namespace pyci
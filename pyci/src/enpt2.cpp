@@ -17,66 +17,241 @@
 
 namespace pyci {
 
-typedef HashMap<Hash, std::pair<double, double>> PairHashMap;
-
 namespace {
 
-void compute_enpt2_thread_condense(PairHashMap &terms, PairHashMap &t_terms, const long ithread) {
-    if (!ithread)
-        terms.swap(t_terms);
-    else {
-        for (auto &keyval : t_terms) {
-            std::pair<double, double> *pair = &terms[keyval.first];
-            pair->first += keyval.second.first;
-            pair->second = keyval.second.second;
+/* ENPT2 terms (diagonal element, numerators) of the external determinants of one pass.
+ *
+ * Each external determinant keeps its diagonal element followed by one numerator per root in a
+ * block of the values of its shard, so that the diagonal element is computed once for all roots.
+ *
+ * A pass keeps the terms of the external determinants whose hash falls in [first, first + last].
+ * The threads fill the terms of one pass concurrently, each locking only the shard that a term
+ * belongs to. If the number of terms exceeds the budget, the range of the pass is halved and the
+ * terms outside of it are dropped, to be computed again in a later pass. */
+
+struct ENPT2Terms final {
+    struct Shard {
+        std::mutex mutex;
+        HashMap<Hash, long> index;
+        AlignedVector<double> values;
+    };
+
+    Vector<Shard> shards;
+    std::mutex mutex;
+    std::atomic<ulong> last;
+    std::atomic<long> size;
+    ulong first;
+    long ndet, nroot, maxsize;
+    const double *coeffs;
+
+    ENPT2Terms(const long n, const long nr, const double *c, const long max_memory)
+        : shards(PYCI_BUILDER_SHARDS), last(Max<ulong>()), size(0), first(0), ndet(n), nroot(nr),
+          maxsize(max_memory ? std::max(max_memory / term_size(nr), 1L) : Max<long>()),
+          coeffs(c) {
+    }
+
+    /* Approximate memory used per term, including the free space of the hash table and values. */
+    static long term_size(const long nroot) {
+        return 2 * (sizeof(HashMap<Hash, long>::value_type) + 1 + sizeof(double) * (nroot + 1));
+    }
+
+    double coeff(const long idet) const {
+        // the excitations of a determinant are screened by its largest coefficient over the roots
+        double c = 0.0;
+        for (long k = 0; k < nroot; ++k)
+            c = std::max(c, std::abs(coeffs[k * ndet + idet]));
+        return c;
+    }
+
+    bool contains(const Hash &rank) const {
+        return rank.second - first <= last.load(std::memory_order_relaxed);
+    }
+
+    void update(double *term, const long idet, const double val) const {
+        for (long k = 0; k < nroot; ++k)
+            term[k + 1] += val * coeffs[k * ndet + idet];
+    }
+
+    bool add(const Hash &rank, const long idet, const double val) {
+        Shard &shard = shards[rank.second % PYCI_BUILDER_SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(rank);
+        if (it == shard.index.end())
+            return false;
+        update(&shard.values[it->second], idet, val);
+        return true;
+    }
+
+    void insert(const Hash &rank, const long idet, const double val, const double diag) {
+        Shard &shard = shards[rank.second % PYCI_BUILDER_SHARDS];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            // the range of the pass may have shrunk since the caller checked it
+            if (!contains(rank))
+                return;
+            auto pair = shard.index.emplace(rank, shard.values.size());
+            if (!pair.second) {
+                update(&shard.values[pair.first->second], idet, val);
+                return;
+            }
+            shard.values.push_back(diag);
+            for (long k = 0; k < nroot; ++k)
+                shard.values.push_back(val * coeffs[k * ndet + idet]);
         }
-        PairHashMap().swap(t_terms);
+        if (++size > maxsize)
+            shrink();
     }
-}
 
-void compute_enpt2_thread_gather(const FullCIWfn &wfn, const double *one_mo, const double *two_mo,
-                                 std::pair<double, double> &term, const double val, const long n2,
-                                 const long n3, const long *occs_up) {
-    const long *occs_dn = occs_up + wfn.nocc_up;
-    // add enpt2 term to terms
-    term.first += val;
-    // check if diagonal element is already computed (i.e. not zero from initialization)
-    if (term.second != (double)0.0)
-        return;
-    // compute diagonal element
-    long i, j, k, l, ioffset, koffset;
-    double diag = 0.0;
-    for (i = 0; i < wfn.nocc_up; ++i) {
-        j = occs_up[i];
-        ioffset = n3 * j;
-        diag += one_mo[(wfn.nbasis + 1) * j];
-        for (k = i + 1; k < wfn.nocc_up; ++k) {
-            l = occs_up[k];
-            koffset = ioffset + n2 * l;
-            diag += two_mo[koffset + wfn.nbasis * j + l] - two_mo[koffset + wfn.nbasis * l + j];
+    void shrink(void) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (size <= maxsize)
+            return;
+        for (auto &shard : shards)
+            shard.mutex.lock();
+        // halve the range until the terms fit in the budget
+        while (size > maxsize && last) {
+            last = last / 2;
+            for (auto &shard : shards) {
+                HashMap<Hash, long> index;
+                AlignedVector<double> values;
+                for (const auto &keyval : shard.index) {
+                    if (contains(keyval.first)) {
+                        index.emplace(keyval.first, values.size());
+                        values.insert(values.end(), shard.values.begin() + keyval.second,
+                                      shard.values.begin() + keyval.second + nroot + 1);
+                    } else {
+                        --size;
+                    }
+                }
+                shard.index.swap(index);
+                shard.values.swap(values);
+            }
         }
-        for (k = 0; k < wfn.nocc_dn; ++k) {
-            l = occs_dn[k];
-            diag += two_mo[ioffset + n2 * l + wfn.nbasis * j + l];
+        for (auto &shard : shards)
+            shard.mutex.unlock();
+    }
+
+    bool next_pass(void) {
+        // move on to the next range of the same width, if any is left
+        if (last == Max<ulong>() - first)
+            return false;
+        first += last + 1;
+        last = std::min(last.load(), Max<ulong>() - first);
+        for (auto &shard : shards) {
+            HashMap<Hash, long>().swap(shard.index);
+            AlignedVector<double>().swap(shard.values);
         }
+        size = 0;
+        return true;
     }
-    for (i = 0; i < wfn.nocc_dn; ++i) {
-        j = occs_dn[i];
-        ioffset = n3 * j;
-        diag += one_mo[(wfn.nbasis + 1) * j];
-        for (k = i + 1; k < wfn.nocc_dn; ++k) {
-            l = occs_dn[k];
-            koffset = ioffset + n2 * l;
-            diag += two_mo[koffset + wfn.nbasis * j + l] - two_mo[koffset + wfn.nbasis * l + j];
+};
+
+/* ENPT2 terms of one batch of sampled determinants.
+ *
+ * For the stochastic estimator of Sharma et al., J. Chem. Theory Comput. 13, 1595 (2017), each
+ * external determinant keeps the sums over the sampled determinants of w * H * c / p and of
+ * (w * (n - 1) / p - w^2 / p^2) * (H * c)^2, both for all of its terms and for the terms that are
+ * above the deterministic threshold. */
+
+struct ENPT2SampleTerm {
+    double a, b, a_d, b_d, diag;
+};
+
+struct ENPT2SampleTerms final {
+    HashMap<Hash, ENPT2SampleTerm> terms;
+    const double *coeffs;
+    double eps_d, factor_a, factor_b;
+
+    ENPT2SampleTerms(const double *c, const double e)
+        : coeffs(c), eps_d(e), factor_a(0.0), factor_b(0.0) {
+    }
+
+    double coeff(const long idet) const {
+        return std::abs(coeffs[idet]);
+    }
+
+    bool contains(const Hash &) const {
+        return true;
+    }
+
+    bool add(const Hash &rank, const long idet, const double val) {
+        auto it = terms.find(rank);
+        if (it == terms.end())
+            return false;
+        update(it->second, val * coeffs[idet]);
+        return true;
+    }
+
+    void insert(const Hash &rank, const long idet, const double val, const double diag) {
+        ENPT2SampleTerm &term = terms[rank];
+        term.diag = diag;
+        update(term, val * coeffs[idet]);
+    }
+
+    void update(ENPT2SampleTerm &term, const double val) const {
+        term.a += factor_a * val;
+        term.b += factor_b * val * val;
+        if (std::abs(val) > eps_d) {
+            term.a_d += factor_a * val;
+            term.b_d += factor_b * val * val;
         }
     }
-    term.second = diag;
+};
+
+/* External determinant collected from a determinant of the wave function, with its phased matrix
+ * element and the excitation from which its diagonal element is computed if its term is new. */
+
+struct ENPT2Excitation {
+    enum : int { single_up, single_dn, mixed, double_up, double_dn };
+
+    int kind;
+    long ii, jj, kk, ll;
+    double val;
+};
+
+template<class Terms, class WfnType>
+void add_enpt2_thread_terms(const SQuantOp &ham, const WfnType &wfn, Terms &terms, const long idet,
+                            const double diag, const long nocc_up, const long *occs_up,
+                            const long nocc_dn, const long *occs_dn, DetBatch &batch,
+                            Vector<ENPT2Excitation> &excs) {
+    // look up the collected determinants in one batch, then add the terms of those not in wfn
+    double d = 0.0;
+    batch.lookup(wfn);
+    for (long n = 0; n < batch.size(); ++n) {
+        const ENPT2Excitation &e = excs[n];
+        if (batch.indices[n] != -1 || terms.add(batch.ranks[n], idet, e.val))
+            continue;
+        switch (e.kind) {
+        case ENPT2Excitation::single_up:
+            d = diag_single_det(ham, nocc_up, occs_up, nocc_dn, occs_dn, e.ii, e.jj);
+            break;
+        case ENPT2Excitation::single_dn:
+            d = diag_single_det(ham, nocc_dn, occs_dn, nocc_up, occs_up, e.ii, e.jj);
+            break;
+        case ENPT2Excitation::mixed:
+            d = diag_mixed_det(ham, nocc_up, occs_up, nocc_dn, occs_dn, e.ii, e.jj, e.kk, e.ll);
+            break;
+        case ENPT2Excitation::double_up:
+            d = diag_double_det(ham, nocc_up, occs_up, nocc_dn, occs_dn, e.ii, e.kk, e.jj, e.ll);
+            break;
+        case ENPT2Excitation::double_dn:
+            d = diag_double_det(ham, nocc_dn, occs_dn, nocc_up, occs_up, e.ii, e.kk, e.jj, e.ll);
+            break;
+        }
+        terms.insert(batch.ranks[n], idet, e.val, diag + d);
+    }
+    batch.clear();
+    excs.clear();
 }
 
-void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairHashMap &terms,
-                                const double *coeffs, const double eps, const long idet,
-                                ulong *det_up, long *occs_up, long *virs_up, long *t_up) {
-    long i, j, k, l, ii, jj, kk, ll, ioffset, koffset, sign_up;
+template<class Terms>
+void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, Terms &terms,
+                                const double eps, const long idet, ulong *det_up, long *occs_up,
+                                long *virs_up, DetBatch &batch, Vector<ENPT2Excitation> &excs) {
+    const HeatBath &same = ham.heat_bath(HeatBath::same_spin);
+    const HeatBath &opposite = ham.heat_bath(HeatBath::opposite_spin);
+    const double c = terms.coeff(idet);
+    long i, j, k, ii, jj, kk, ll, ioffset, koffset, key, t;
     Hash rank;
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
@@ -87,14 +262,13 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
     ulong *det_dn = det_up + wfn.nword;
     long *occs_dn = occs_up + wfn.nocc_up;
     long *virs_dn = virs_up + wfn.nvir_up;
-    long *t_dn = t_up + wfn.nocc_up;
     std::memcpy(det_up, rdet_up, sizeof(ulong) * wfn.nword2);
     fill_occs(wfn.nword, rdet_up, occs_up);
     fill_occs(wfn.nword, rdet_dn, occs_dn);
     fill_virs(wfn.nword, wfn.nbasis, rdet_up, virs_up);
     fill_virs(wfn.nword, wfn.nbasis, rdet_dn, virs_dn);
-    std::memcpy(t_up, occs_up, sizeof(long) * wfn.nocc_up);
-    std::memcpy(t_dn, occs_dn, sizeof(long) * wfn.nocc_dn);
+    // the diagonal elements of external determinants are updated from that of the reference
+    const double diag = diag_det(ham, wfn.nocc_up, occs_up, wfn.nocc_dn, occs_dn);
     // loop over spin-up occupied indices
     for (i = 0; i < wfn.nocc_up; ++i) {
         ii = occs_up[i];
@@ -103,9 +277,6 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
         for (j = 0; j < wfn.nvir_up; ++j) {
             jj = virs_up[j];
             // 1-0 excitation elements
-            excite_det(ii, jj, det_up);
-            fill_occs(wfn.nword, det_up, t_up);
-            sign_up = phase_single_det(wfn.nword, ii, jj, rdet_up);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc_up; ++k) {
                 kk = occs_up[k];
@@ -116,69 +287,74 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
                 kk = occs_dn[k];
                 val += ham.two_mo[ioffset + n2 * kk + n1 * jj + kk];
             }
-            val *= coeffs[idet];
-            // add determinant if |H*c| > eps and not already in wfn
-            if (std::abs(val) > eps) {
+            // collect determinant if |H*c| > eps
+            if (std::abs(val) * c > eps) {
+                excite_det(ii, jj, det_up);
                 rank = wfn.rank_det(det_up);
-                if (wfn.index_det_from_rank(rank) == -1) {
-                    val *= sign_up;
-                    compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank], val, n2,
-                                                n3, t_up);
+                if (terms.contains(rank)) {
+                    batch.push(det_up, rank);
+                    excs.push_back({ENPT2Excitation::single_up, ii, jj, 0, 0,
+                                    val * phase_single_det(wfn.nword, ii, jj, rdet_up)});
                 }
+                excite_det(jj, ii, det_up);
             }
-            // loop over spin-down occupied indices
-            for (k = 0; k < wfn.nocc_dn; ++k) {
-                kk = occs_dn[k];
-                koffset = ioffset + n2 * kk;
-                // loop over spin-down virtual indices
-                for (l = 0; l < wfn.nvir_dn; ++l) {
-                    ll = virs_dn[l];
-                    // 1-1 excitation elements
-                    excite_det(kk, ll, det_dn);
-                    val = ham.two_mo[koffset + n1 * jj + ll] * coeffs[idet];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1) {
-                            val *= sign_up * phase_single_det(wfn.nword, kk, ll, rdet_dn);
-                            fill_occs(wfn.nword, det_dn, t_dn);
-                            compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank],
-                                                        val, n2, n3, t_up);
-                        }
-                    }
-                    excite_det(ll, kk, det_dn);
+        }
+        // loop over spin-down occupied indices
+        for (k = 0; k < wfn.nocc_dn; ++k) {
+            kk = occs_dn[k];
+            key = n1 * ii + kk;
+            koffset = ioffset + n2 * kk;
+            // 1-1 excitation elements, in order of decreasing |H|, until |H*c| <= eps
+            for (t = opposite.ptr[key];
+                 t < opposite.ptr[key + 1] &&
+                 std::abs(ham.two_mo[koffset + opposite.targets[t]]) * c > eps;
+                 ++t) {
+                jj = opposite.targets[t] / n1;
+                ll = opposite.targets[t] % n1;
+                if (testbit_det(jj, rdet_up) || testbit_det(ll, rdet_dn))
+                    continue;
+                // collect determinant
+                excite_det(ii, jj, det_up);
+                excite_det(kk, ll, det_dn);
+                rank = wfn.rank_det(det_up);
+                if (terms.contains(rank)) {
+                    batch.push(det_up, rank);
+                    excs.push_back({ENPT2Excitation::mixed, ii, jj, kk, ll,
+                                    ham.two_mo[koffset + n1 * jj + ll] *
+                                        phase_single_det(wfn.nword, ii, jj, rdet_up) *
+                                        phase_single_det(wfn.nword, kk, ll, rdet_dn)});
                 }
+                excite_det(ll, kk, det_dn);
+                excite_det(jj, ii, det_up);
             }
-            std::memcpy(t_dn, occs_dn, sizeof(long) * wfn.nocc_dn);
-            // loop over spin-up occupied indices
-            for (k = i + 1; k < wfn.nocc_up; ++k) {
-                kk = occs_up[k];
-                koffset = ioffset + n2 * kk;
-                // loop over spin-up virtual indices
-                for (l = j + 1; l < wfn.nvir_up; ++l) {
-                    ll = virs_up[l];
-                    // 2-0 excitation elements
-                    excite_det(kk, ll, det_up);
-                    val =
-                        (ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj]) *
-                        coeffs[idet];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1) {
-                            val *= phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_up);
-                            fill_occs(wfn.nword, det_up, t_up);
-                            compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank],
-                                                        val, n2, n3, t_up);
-                        }
-                    }
-                    excite_det(ll, kk, det_up);
+        }
+        // loop over spin-up occupied indices
+        for (k = i + 1; k < wfn.nocc_up; ++k) {
+            kk = occs_up[k];
+            key = n1 * ii + kk;
+            koffset = ioffset + n2 * kk;
+            // 2-0 excitation elements, in order of decreasing |H|, until |H*c| <= eps
+            for (t = same.ptr[key]; t < same.ptr[key + 1] && same.values[t] * c > eps; ++t) {
+                jj = same.targets[t] / n1;
+                ll = same.targets[t] % n1;
+                if (testbit_det(jj, rdet_up) || testbit_det(ll, rdet_up))
+                    continue;
+                // collect determinant
+                excite_det(ii, jj, det_up);
+                excite_det(kk, ll, det_up);
+                rank = wfn.rank_det(det_up);
+                if (terms.contains(rank)) {
+                    batch.push(det_up, rank);
+                    excs.push_back(
+                        {ENPT2Excitation::double_up, ii, jj, kk, ll,
+                         (ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj]) *
+                             phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_up)});
                 }
+                excite_det(ll, kk, det_up);
+                excite_det(jj, ii, det_up);
             }
-            excite_det(jj, ii, det_up);
         }
     }
-    std::memcpy(t_up, occs_up, sizeof(long) * wfn.nocc_up);
     // loop over spin-down occupied indices
     for (i = 0; i < wfn.nocc_dn; ++i) {
         ii = occs_dn[i];
@@ -187,7 +363,6 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
         for (j = 0; j < wfn.nvir_dn; ++j) {
             jj = virs_dn[j];
             // 0-1 excitation elements
-            excite_det(ii, jj, det_dn);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc_up; ++k) {
                 kk = occs_up[k];
@@ -198,73 +373,56 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
                 koffset = ioffset + n2 * kk;
                 val += ham.two_mo[koffset + n1 * jj + kk] - ham.two_mo[koffset + n1 * kk + jj];
             }
-            val *= coeffs[idet];
-            // add determinant if |H*c| > eps and not already in wfn
-            if (std::abs(val) > eps) {
+            // collect determinant if |H*c| > eps
+            if (std::abs(val) * c > eps) {
+                excite_det(ii, jj, det_dn);
                 rank = wfn.rank_det(det_up);
-                if (wfn.index_det_from_rank(rank) == -1) {
-                    val *= phase_single_det(wfn.nword, ii, jj, rdet_dn);
-                    fill_occs(wfn.nword, det_dn, t_dn);
-                    compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank], val, n2,
-                                                n3, t_up);
+                if (terms.contains(rank)) {
+                    batch.push(det_up, rank);
+                    excs.push_back({ENPT2Excitation::single_dn, ii, jj, 0, 0,
+                                    val * phase_single_det(wfn.nword, ii, jj, rdet_dn)});
                 }
+                excite_det(jj, ii, det_dn);
             }
-            // loop over spin-down occupied indices
-            for (k = i + 1; k < wfn.nocc_dn; ++k) {
-                kk = occs_dn[k];
-                koffset = ioffset + n2 * kk;
-                // loop over spin-down virtual indices
-                for (l = j + 1; l < wfn.nvir_dn; ++l) {
-                    ll = virs_dn[l];
-                    // 0-2 excitation elements
-                    excite_det(kk, ll, det_dn);
-                    val =
-                        (ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj]) *
-                        coeffs[idet];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1) {
-                            val *= phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_dn);
-                            fill_occs(wfn.nword, det_dn, t_dn);
-                            compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank],
-                                                        val, n2, n3, t_up);
-                        }
-                    }
-                    excite_det(ll, kk, det_dn);
+        }
+        // loop over spin-down occupied indices
+        for (k = i + 1; k < wfn.nocc_dn; ++k) {
+            kk = occs_dn[k];
+            key = n1 * ii + kk;
+            koffset = ioffset + n2 * kk;
+            // 0-2 excitation elements, in order of decreasing |H|, until |H*c| <= eps
+            for (t = same.ptr[key]; t < same.ptr[key + 1] && same.values[t] * c > eps; ++t) {
+                jj = same.targets[t] / n1;
+                ll = same.targets[t] % n1;
+                if (testbit_det(jj, rdet_dn) || testbit_det(ll, rdet_dn))
+                    continue;
+                // collect determinant
+                excite_det(ii, jj, det_dn);
+                excite_det(kk, ll, det_dn);
+                rank = wfn.rank_det(det_up);
+                if (terms.contains(rank)) {
+                    batch.push(det_up, rank);
+                    excs.push_back(
+                        {ENPT2Excitation::double_dn, ii, jj, kk, ll,
+                         (ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj]) *
+                             phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_dn)});
                 }
+                excite_det(ll, kk, det_dn);
+                excite_det(jj, ii, det_dn);
             }
-            excite_det(jj, ii, det_dn);
         }
     }
+    // add the terms of the collected determinants that are not already in wfn
+    add_enpt2_thread_terms(ham, wfn, terms, idet, diag, wfn.nocc_up, occs_up, wfn.nocc_dn, occs_dn,
+                           batch, excs);
 }
 
-void compute_enpt2_thread_gather(const GenCIWfn &wfn, const double *one_mo, const double *two_mo,
-                                 std::pair<double, double> &term, const double val, const long n2,
-                                 const long n3, const long *occs) {
-    // add enpt2 term to terms
-    term.first += val;
-    // check if diagonal element is already computed (i.e. not zero from initialization)
-    if (term.second != (double)0.0)
-        return;
-    // compute diagonal element
-    double diag = 0.0;
-    for (long i=0, j, k, l, ioffset, koffset; i < wfn.nocc; ++i) {
-        j = occs[i];
-        ioffset = n3 * j;
-        diag += one_mo[(wfn.nbasis + 1) * j];
-        for (k = i + 1; k < wfn.nocc; ++k) {
-            l = occs[k];
-            koffset = ioffset + n2 * l;
-            diag += two_mo[koffset + wfn.nbasis * j + l] - two_mo[koffset + wfn.nbasis * l + j];
-        }
-    }
-    term.second = diag;
-}
-
-void compute_enpt2_thread_terms(const SQuantOp &ham, const GenCIWfn &wfn, PairHashMap &terms,
-                                const double *coeffs, const double eps, const long idet, ulong *det,
-                                long *occs, long *virs, long *tmps) {
+template<class Terms>
+void compute_enpt2_thread_terms(const SQuantOp &ham, const GenCIWfn &wfn, Terms &terms,
+                                const double eps, const long idet, ulong *det, long *occs,
+                                long *virs, DetBatch &batch, Vector<ENPT2Excitation> &excs) {
+    const HeatBath &same = ham.heat_bath(HeatBath::same_spin);
+    const double c = terms.coeff(idet);
     Hash rank;
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
@@ -274,81 +432,134 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const GenCIWfn &wfn, PairHa
     std::memcpy(det, rdet, sizeof(ulong) * wfn.nword);
     fill_occs(wfn.nword, rdet, occs);
     fill_virs(wfn.nword, wfn.nbasis, rdet, virs);
-    std::memcpy(tmps, occs, sizeof(long) * wfn.nocc);
+    // the diagonal elements of external determinants are updated from that of the reference
+    const double diag = diag_det(ham, wfn.nocc, occs, 0, nullptr);
     // loop over occupied indices
-    for (long i = 0, j, k, l, ii, jj, kk, ll, ioffset, koffset; i < wfn.nocc; ++i) {
+    for (long i = 0, j, k, ii, jj, kk, ll, ioffset, koffset, key, t; i < wfn.nocc; ++i) {
         ii = occs[i];
         ioffset = n3 * ii;
         // loop over virtual indices
-        for (j = 0; j < wfn.nvir; ++j) {
+        for (j = 0; j < wfn.nvir_up; ++j) {
             jj = virs[j];
             // single excitation elements
-            excite_det(ii, jj, det);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc; ++k) {
                 kk = occs[k];
                 koffset = ioffset + n2 * kk;
                 val += ham.two_mo[koffset + n1 * jj + kk] - ham.two_mo[koffset + n1 * kk + jj];
             }
-            val *= coeffs[idet];
-            // add determinant if |H*c| > eps and not already in wfn
-            if (std::abs(val) > eps) {
+            // collect determinant if |H*c| > eps
+            if (std::abs(val) * c > eps) {
+                excite_det(ii, jj, det);
                 rank = wfn.rank_det(det);
-                if (wfn.index_det_from_rank(rank) == -1) {
-                    val *= phase_single_det(wfn.nword, ii, jj, rdet);
-                    fill_occs(wfn.nword, det, tmps);
-                    compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank], val, n2,
-                                                n3, tmps);
+                if (terms.contains(rank)) {
+                    batch.push(det, rank);
+                    excs.push_back({ENPT2Excitation::single_up, ii, jj, 0, 0,
+                                    val * phase_single_det(wfn.nword, ii, jj, rdet)});
                 }
+                excite_det(jj, ii, det);
             }
-            // loop over occupied indices
-            for (k = i + 1; k < wfn.nocc; ++k) {
-                kk = occs[k];
-                koffset = ioffset + n2 * kk;
-                // loop over virtual indices
-                for (l = j + 1; l < wfn.nvir; ++l) {
-                    ll = virs[l];
-                    // double excitation elements
-                    excite_det(kk, ll, det);
-                    val =
-                        (ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj]) *
-                        coeffs[idet];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val) > eps) {
-                        rank = wfn.rank_det(det);
-                        if (wfn.index_det_from_rank(rank) == -1) {
-                            val *= phase_double_det(wfn.nword, ii, kk, jj, ll, rdet);
-                            fill_occs(wfn.nword, det, tmps);
-                            compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank],
-                                                        val, n2, n3, tmps);
-                        }
-                    }
-                    excite_det(ll, kk, det);
+        }
+        // loop over occupied indices
+        for (k = i + 1; k < wfn.nocc; ++k) {
+            kk = occs[k];
+            key = n1 * ii + kk;
+            koffset = ioffset + n2 * kk;
+            // double excitation elements, in order of decreasing |H|, until |H*c| <= eps
+            for (t = same.ptr[key]; t < same.ptr[key + 1] && same.values[t] * c > eps; ++t) {
+                jj = same.targets[t] / n1;
+                ll = same.targets[t] % n1;
+                if (testbit_det(jj, rdet) || testbit_det(ll, rdet))
+                    continue;
+                // collect determinant
+                excite_det(ii, jj, det);
+                excite_det(kk, ll, det);
+                rank = wfn.rank_det(det);
+                if (terms.contains(rank)) {
+                    batch.push(det, rank);
+                    excs.push_back(
+                        {ENPT2Excitation::double_up, ii, jj, kk, ll,
+                         (ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj]) *
+                             phase_double_det(wfn.nword, ii, kk, jj, ll, rdet)});
                 }
+                excite_det(ll, kk, det);
+                excite_det(jj, ii, det);
             }
-            excite_det(jj, ii, det);
         }
     }
+    // add the terms of the collected determinants that are not already in wfn
+    add_enpt2_thread_terms(ham, wfn, terms, idet, diag, wfn.nocc, occs, 0, nullptr, batch, excs);
 }
 
 template<class WfnType>
-void compute_enpt2_thread(const SQuantOp &ham, const WfnType &wfn, PairHashMap &terms,
-                          const double *coeffs, const double eps, const long start,
-                          const long end) {
+void compute_enpt2_thread(const SQuantOp &ham, const WfnType &wfn, ENPT2Terms &terms,
+                          const double eps, const long start, const long end) {
     AlignedVector<ulong> det(wfn.nword2);
     AlignedVector<long> occs(wfn.nocc);
     AlignedVector<long> virs(wfn.nvir);
-    AlignedVector<long> tmps(wfn.nocc);
+    DetBatch batch(std::is_base_of<TwoSpinWfn, WfnType>::value ? wfn.nword2 : wfn.nword);
+    Vector<ENPT2Excitation> excs;
     for (long i = start; i < end; ++i)
-        compute_enpt2_thread_terms(ham, wfn, terms, coeffs, eps, i, &det[0], &occs[0], &virs[0],
-                                   &tmps[0]);
+        compute_enpt2_thread_terms(ham, wfn, terms, eps, i, &det[0], &occs[0], &virs[0], batch,
+                                   excs);
+}
+
+template<class WfnType>
+void compute_enpt2_thread_batch(const SQuantOp &ham, const WfnType &wfn, const double *coeffs,
+                                const double *cumulative, const double e, const double eps,
+                                const double eps_d, const long nsample, const long seed,
+                                const long batch, double *result) {
+    // draw the samples of this batch with probability |c| / sum(|c|)
+    std::seed_seq seq{seed, batch};
+    std::mt19937_64 rng(seq);
+    std::uniform_real_distribution<double> dist(0.0, cumulative[wfn.ndet - 1]);
+    Vector<long> samples(nsample);
+    for (auto &idet : samples)
+        idet = std::min(std::upper_bound(cumulative, cumulative + wfn.ndet, dist(rng)) - cumulative,
+                        wfn.ndet - 1);
+    std::sort(samples.begin(), samples.end());
+    // gather the terms of each distinct sampled determinant, weighted by its number of samples
+    ENPT2SampleTerms terms(coeffs, eps_d);
+    AlignedVector<ulong> det(wfn.nword2);
+    AlignedVector<long> occs(wfn.nocc);
+    AlignedVector<long> virs(wfn.nvir);
+    DetBatch lookups(std::is_base_of<TwoSpinWfn, WfnType>::value ? wfn.nword2 : wfn.nword);
+    Vector<ENPT2Excitation> excs;
+    double w, p;
+    for (long i = 0, j; i < nsample; i = j) {
+        for (j = i + 1; j < nsample && samples[j] == samples[i]; ++j)
+            ;
+        w = j - i;
+        p = std::abs(coeffs[samples[i]]) / cumulative[wfn.ndet - 1];
+        terms.factor_a = w / p;
+        terms.factor_b = w * (nsample - 1) / p - w * w / (p * p);
+        compute_enpt2_thread_terms(ham, wfn, terms, eps, samples[i], &det[0], &occs[0], &virs[0],
+                                   lookups, excs);
+    }
+    // estimate the difference between the corrections with eps and with eps_d
+    double correction = 0.0;
+    for (const auto &keyval : terms.terms) {
+        const ENPT2SampleTerm &term = keyval.second;
+        correction +=
+            (term.a * term.a + term.b - term.a_d * term.a_d - term.b_d) / (e - term.diag);
+    }
+    *result = correction / (nsample * (nsample - 1));
 }
 
 } // namespace
 
 template<class WfnType>
-double compute_enpt2(const SQuantOp &ham, const WfnType &wfn, const double *coeffs, const double energy,
-                     const double eps, long nthread) {
+void compute_enpt2_multistate(const SQuantOp &ham, const WfnType &wfn, const long nroot,
+                              const double *coeffs, const double *energies, double *pt_energies,
+                              const double eps, long nthread, const long max_memory) {
+    std::memcpy(pt_energies, energies, sizeof(double) * nroot);
+    // there are no external determinants to a complete determinant space
+    if (wfn.complete)
+        return;
+    // build the heat-bath lists before the threads read them
+    ham.heat_bath(HeatBath::same_spin);
+    if (std::is_same<WfnType, FullCIWfn>::value)
+        ham.heat_bath(HeatBath::opposite_spin);
     if (nthread == -1)
         nthread = get_num_threads();
     long chunksize = wfn.ndet / nthread + static_cast<bool>(wfn.ndet % nthread);
@@ -356,52 +567,219 @@ double compute_enpt2(const SQuantOp &ham, const WfnType &wfn, const double *coef
         nthread /= 2;
         chunksize = wfn.ndet / nthread + static_cast<bool>(wfn.ndet % nthread);
     }
-    PairHashMap terms;
-    Vector<PairHashMap> v_terms(nthread);
-    Vector<std::thread> v_threads;
-    v_threads.reserve(nthread);
-    for (long i = 0; i < nthread; ++i) {
-        long start = end_chunk_idx(i, nthread, wfn.ndet);
-        long end = end_chunk_idx(i + 1, nthread, wfn.ndet);
-        end = std::min(end, wfn.ndet);
-        v_threads.emplace_back(&compute_enpt2_thread<WfnType>, std::ref(ham), std::ref(wfn),
-                               std::ref(v_terms[i]), coeffs, eps, start, end);
-    }
-    for (auto &thread : v_threads) thread.join();
-    for (long n=0; n<nthread; n++) compute_enpt2_thread_condense(terms, v_terms[n], n);
-    // compute enpt2 correction
-    double e = energy - ham.ecore, correction = 0.0;
-    for (const auto &keyval : terms)
-        correction += keyval.second.first * keyval.second.first / (e - keyval.second.second);
-    return energy + correction;
+    ENPT2Terms terms(wfn.ndet, nroot, coeffs, max_memory);
+    Vector<double> e(nroot);
+    for (long k = 0; k < nroot; ++k)
+        e[k] = energies[k] - ham.ecore;
+    // each pass goes over the whole wave function and keeps one range of external determinants
+    do {
+        Vector<std::thread> v_threads;
+        v_threads.reserve(nthread);
+        for (long i = 0; i < nthread; ++i) {
+            long start = end_chunk_idx(i, nthread, wfn.ndet);
+            long end = end_chunk_idx(i + 1, nthread, wfn.ndet);
+            end = std::min(end, wfn.ndet);
+            v_threads.emplace_back(&compute_enpt2_thread<WfnType>, std::ref(ham), std::ref(wfn),
+                                   std::ref(terms), eps, start, end);
+        }
+        for (auto &thread : v_threads)
+            thread.join();
+        // compute enpt2 corrections
+        for (const auto &shard : terms.shards) {
+            for (std::size_t i = 0; i < shard.values.size(); i += nroot + 1) {
+                const double *term = &shard.values[i];
+                for (long k = 0; k < nroot; ++k)
+                    pt_energies[k] += term[k + 1] * term[k + 1] / (e[k] - term[0]);
+            }
+        }
+    } while (terms.next_pass());
 }
 
+template void compute_enpt2_multistate<FullCIWfn>(const SQuantOp &, const FullCIWfn &, const long,
+                                                  const double *, const double *, double *,
+                                                  const double, long, const long);
+
+template void compute_enpt2_multistate<GenCIWfn>(const SQuantOp &, const GenCIWfn &, const long,
+                                                 const double *, const double *, double *,
+                                                 const double, long, const long);
+
+template<>
+void compute_enpt2_multistate<DOCIWfn>(const SQuantOp &ham, const DOCIWfn &wfn, const long nroot,
+                                       const double *coeffs, const double *energies,
+                                       double *pt_energies, const double eps, long nthread,
+                                       const long max_memory) {
+    compute_enpt2_multistate<FullCIWfn>(ham, FullCIWfn(wfn), nroot, coeffs, energies, pt_energies,
+                                        eps, nthread, max_memory);
+}
+
+template<class WfnType>
+double compute_enpt2(const SQuantOp &ham, const WfnType &wfn, const double *coeffs, const double energy,
+                     const double eps, long nthread, const long max_memory) {
+    double pt_energy;
+    compute_enpt2_multistate<WfnType>(ham, wfn, 1, coeffs, &energy, &pt_energy, eps, nthread,
+                                      max_memory);
+    return pt_energy;
+}
+
+template double compute_enpt2<DOCIWfn>(const SQuantOp &, const DOCIWfn &, const double *,
+                                       const double, const double, long, const long);
+
 template double compute_enpt2<FullCIWfn>(const SQuantOp &, const FullCIWfn &, const double *,
-                                         const double, const double, long);
+                                         const double, const double, long, const long);
 
 template double compute_enpt2<GenCIWfn>(const SQuantOp &, const GenCIWfn &, const double *, const double,
-                                        const double, long);
+                                        const double, long, const long);
+
+template<class WfnType>
+std::pair<double, double> compute_enpt2_semistochastic(const SQuantOp &ham, const WfnType &wfn,
+                                                       const double *coeffs, const double energy,
+                                                       const double eps, const double eps_d,
+                                                       const long nsample, const double tol,
+                                                       const long max_batch, const long seed,
+                                                       long nthread, const long max_memory) {
+    // minimum number of batches before the error estimate is trusted
+    const long min_batch = 10;
+    if (nsample < 2)
+        throw std::invalid_argument("nsample must be >= 2");
+    else if (max_batch < 2)
+        throw std::invalid_argument("max_batch must be >= 2");
+    // compute the terms above eps_d deterministically
+    double e_d = compute_enpt2<WfnType>(ham, wfn, coeffs, energy, eps_d, nthread, max_memory);
+    if (wfn.complete || eps >= eps_d)
+        return std::make_pair(e_d, 0.0);
+    if (nthread == -1)
+        nthread = get_num_threads();
+    AlignedVector<double> cumulative(wfn.ndet);
+    double total = 0.0;
+    for (long i = 0; i < wfn.ndet; ++i) {
+        total += std::abs(coeffs[i]);
+        cumulative[i] = total;
+    }
+    // estimate the rest from batches of samples, computed nthread at a time, until the standard
+    // error of their mean is below tol; batch i is always drawn from the seed (seed, i), and the
+    // batches are taken in order, so the result does not depend on the number of threads
+    Vector<double> batches;
+    double mean = 0.0, m2 = 0.0, error = Max<double>();
+    long n = 0;
+    while (n < max_batch && (n < min_batch || error > tol)) {
+        long nbatch = std::min(nthread, max_batch - n);
+        batches.resize(nbatch);
+        Vector<std::thread> v_threads;
+        v_threads.reserve(nbatch);
+        for (long i = 0; i < nbatch; ++i)
+            v_threads.emplace_back(&compute_enpt2_thread_batch<WfnType>, std::ref(ham),
+                                   std::ref(wfn), coeffs, &cumulative[0], energy - ham.ecore, eps,
+                                   eps_d, nsample, seed, n + i, &batches[i]);
+        for (auto &thread : v_threads)
+            thread.join();
+        for (long i = 0; i < nbatch && (n < min_batch || error > tol); ++i) {
+            double delta = batches[i] - mean;
+            mean += delta / ++n;
+            m2 += delta * (batches[i] - mean);
+            if (n > 1)
+                error = std::sqrt(m2 / (n - 1) / n);
+        }
+    }
+    return std::make_pair(e_d + mean, error);
+}
+
+template std::pair<double, double>
+compute_enpt2_semistochastic<FullCIWfn>(const SQuantOp &, const FullCIWfn &, const double *,
+                                        const double, const double, const double, const long,
+                                        const double, const long, const long, long, const long);
+
+template std::pair<double, double>
+compute_enpt2_semistochastic<GenCIWfn>(const SQuantOp &, const GenCIWfn &, const double *,
+                                       const double, const double, const double, const long,
+                                       const double, const long, const long, long, const long);
 
 template<>
-double compute_enpt2<DOCIWfn>(const SQuantOp &ham, const DOCIWfn &wfn, const double *coeffs,
-                              const double energy, const double eps, long nthread) {
-    return compute_enpt2<FullCIWfn>(ham, FullCIWfn(wfn), coeffs, energy, eps, nthread);
+std::pair<double, double>
+compute_enpt2_semistochastic<DOCIWfn>(const SQuantOp &ham, const DOCIWfn &wfn,
+                                      const double *coeffs, const double energy, const double eps,
+                                      const double eps_d, const long nsample, const double tol,
+                                      const long max_batch, const long seed, long nthread,
+                                      const long max_memory) {
+    return compute_enpt2_semistochastic<FullCIWfn>(ham, FullCIWfn(wfn), coeffs, energy, eps,
+                                                   eps_d, nsample, tol, max_batch, seed, nthread,
+                                                   max_memory);
 }
 
 template<class WfnType>
 double py_compute_enpt2(const SQuantOp &ham, const WfnType &wfn, const Array<double> coeffs,
-                        const double energy, const double eps, const long nthread) {
+                        const double energy, const double eps, const long nthread,
+                        const long max_memory) {
     return compute_enpt2<WfnType>(ham, wfn, reinterpret_cast<const double *>(coeffs.request().ptr),
-                                  energy, eps, nthread);
+                                  energy, eps, nthread, max_memory);
 }
 
 template double py_compute_enpt2<DOCIWfn>(const SQuantOp &, const DOCIWfn &, const Array<double>,
-                                          const double, const double, const long);
+                                          const double, const double, const long, const long);
 
 template double py_compute_enpt2<FullCIWfn>(const SQuantOp &, const FullCIWfn &, const Array<double>,
-                                            const double, const double, const long);
+                                            const double, const double, const long, const long);
 
 template double py_compute_enpt2<GenCIWfn>(const SQuantOp &, const GenCIWfn &, const Array<double>,
-                                           const double, const double, const long);
+                                           const double, const double, const long, const long);
+
+template<class WfnType>
+Array<double> py_compute_enpt2_multistate(const SQuantOp &ham, const WfnType &wfn,
+                                          const Array<double> coeffs, const Array<double> energies,
+                                          const double eps, const long nthread,
+                                          const long max_memory) {
+    pybind11::buffer_info buf = coeffs.request();
+    if (buf.ndim < 1 || buf.ndim > 2 || buf.shape[buf.ndim - 1] != wfn.ndet)
+        throw std::invalid_argument("coeffs must have shape (ndet,) or (nroot, ndet)");
+    long nroot = (buf.ndim == 2) ? buf.shape[0] : 1;
+    pybind11::buffer_info ebuf = energies.request();
+    if (ebuf.size != nroot)
+        throw std::invalid_argument("energies must have shape (nroot,)");
+    Array<double> array(nroot);
+    compute_enpt2_multistate<WfnType>(ham, wfn, nroot, reinterpret_cast<const double *>(buf.ptr),
+                                      reinterpret_cast<const double *>(ebuf.ptr),
+                                      reinterpret_cast<double *>(array.request().ptr), eps, nthread,
+                                      max_memory);
+    return array;
+}
+
+template Array<double> py_compute_enpt2_multistate<DOCIWfn>(const SQuantOp &, const DOCIWfn &,
+                                                            const Array<double>,
+                                                            const Array<double>, const double,
+                                                            const long, const long);
+
+template Array<double> py_compute_enpt2_multistate<FullCIWfn>(const SQuantOp &, const FullCIWfn &,
+                                                              const Array<double>,
+                                                              const Array<double>, const double,
+                                                              const long, const long);
+
+template Array<double> py_compute_enpt2_multistate<GenCIWfn>(const SQuantOp &, const GenCIWfn &,
+                                                             const Array<double>,
+                                                             const Array<double>, const double,
+                                                             const long, const long);
+
+template<class WfnType>
+pybind11::tuple py_compute_enpt2_semistochastic(const SQuantOp &ham, const WfnType &wfn,
+                                                const Array<double> coeffs, const double energy,
+                                                const double eps, const double eps_d,
+                                                const long nsample, const double tol,
+                                                const long max_batch, const long seed,
+                                                const long nthread, const long max_memory) {
+    std::pair<double, double> result = compute_enpt2_semistochastic<WfnType>(
+        ham, wfn, reinterpret_cast<const double *>(coeffs.request().ptr), energy, eps, eps_d,
+        nsample, tol, max_batch, seed, nthread, max_memory);
+    return pybind11::make_tuple(result.first, result.second);
+}
+
+template pybind11::tuple py_compute_enpt2_semistochastic<DOCIWfn>(
+    const SQuantOp &, const DOCIWfn &, const Array<double>, const double, const double,
+    const double, const long, const double, const long, const long, const long, const long);
+
+template pybind11::tuple py_compute_enpt2_semistochastic<FullCIWfn>(
+    const SQuantOp &, const FullCIWfn &, const Array<double>, const double, const double,
+    const double, const long, const double, const long, const long, const long, const long);
+
+template pybind11::tuple py_compute_enpt2_semistochastic<GenCIWfn>(
+    const SQuantOp &, const GenCIWfn &, const Array<double>, const double, const double,
+    const double, const long, const double, const long, const long, const long, const long);
 
 } // namespace pyci
@@ -0,0 +1,330 @@
+/* This file is part of PyCI.
+ *
+ * PyCI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * PyCI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PyCI. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <pyci.h>
+
+namespace pyci {
+
+namespace {
+
+long index_string(const long nword, const ulong *str, HashMap<Hash, long> &dict,
+                  AlignedVector<ulong> &strs) {
+    auto result = dict.emplace(spookyhash(nword, str), dict.size());
+    if (result.second)
+        strs.insert(strs.end(), str, str + nword);
+    return result.first->second;
+}
+
+long find_string(const long nword, const ulong *str, const HashMap<Hash, long> &dict) {
+    const auto &search = dict.find(spookyhash(nword, str));
+    return (search == dict.end()) ? -1 : search->second;
+}
+
+void group_dets(const long n, const long nstr, const long nstr_other, const long *self,
+                const long *other, AlignedVector<long> &row_ptr, AlignedVector<long> &row_str,
+                AlignedVector<long> &row_det) {
+    // counting sort by the other string, then stable counting sort by this string, so that
+    // each row of determinants sharing this string is sorted by the other string
+    AlignedVector<long> ptr(nstr_other + 1, 0), order(n);
+    for (long idet = 0; idet < n; ++idet)
+        ++ptr[other[idet] + 1];
+    std::partial_sum(ptr.begin(), ptr.end(), ptr.begin());
+    for (long idet = 0; idet < n; ++idet)
+        order[ptr[other[idet]]++] = idet;
+    row_ptr.assign(nstr + 1, 0);
+    for (long idet = 0; idet < n; ++idet)
+        ++row_ptr[self[idet] + 1];
+    std::partial_sum(row_ptr.begin(), row_ptr.end(), row_ptr.begin());
+    ptr.assign(row_ptr.begin(), row_ptr.end() - 1);
+    row_str.resize(n);
+    row_det.resize(n);
+    for (long idet : order) {
+        long p = ptr[self[idet]]++;
+        row_str[p] = other[idet];
+        row_det[p] = idet;
+    }
+}
+
+void merge_rows(const long *str1, const long *det1, const long *end1, const long *str2,
+                const long *det2, const long *end2, const double val, const double *x,
+                double *y) {
+    // walk two rows sorted by the other string and couple their common determinants
+    while (str1 != end1 && str2 != end2) {
+        if (*str1 < *str2) {
+            ++str1;
+            ++det1;
+        } else if (*str2 < *str1) {
+            ++str2;
+            ++det2;
+        } else {
+            y[*det1++] += val * x[*det2++];
+            ++str1;
+            ++str2;
+        }
+    }
+}
+
+long sigma_num_threads(const long n) {
+    long nthread = get_num_threads();
+    long chunksize = n / nthread + static_cast<bool>(n % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = n / nthread + static_cast<bool>(n % nthread);
+    }
+    return nthread;
+}
+
+} // namespace
+
+FullCISigma::FullCISigma(void)
+    : nbasis(0), ndet(0), one_mo(nullptr), two_mo(nullptr), up(), dn() {
+}
+
+FullCISigma::FullCISigma(const SQuantOp &ham, const FullCIWfn &wfn, const long n)
+    : nbasis(wfn.nbasis), ndet(n), one_mo(ham.one_mo), two_mo(ham.two_mo), up(), dn() {
+    AlignedVector<long> str_up(n), str_dn(n);
+    AlignedVector<ulong> strs_up, strs_dn;
+    HashMap<Hash, long> dict_up, dict_dn;
+    // find the unique spin-up and spin-down strings
+    for (long idet = 0; idet < n; ++idet) {
+        const ulong *rdet = wfn.det_ptr(idet);
+        str_up[idet] = index_string(wfn.nword, rdet, dict_up, strs_up);
+        str_dn[idet] = index_string(wfn.nword, rdet + wfn.nword, dict_dn, strs_dn);
+    }
+    up.nocc = wfn.nocc_up;
+    dn.nocc = wfn.nocc_dn;
+    init_strings(up, wfn.nword, wfn.nvir_up, strs_up, dict_up);
+    init_strings(dn, wfn.nword, wfn.nvir_dn, strs_dn, dict_dn);
+    // group the determinants by spin-up string and by spin-down string
+    group_dets(n, up.nstr, dn.nstr, str_up.data(), str_dn.data(), up.row_ptr, up.row_str,
+               up.row_det);
+    group_dets(n, dn.nstr, up.nstr, str_dn.data(), str_up.data(), dn.row_ptr, dn.row_str,
+               dn.row_det);
+    // compute diagonal matrix elements
+    diag.resize(n);
+    for (long idet = 0; idet < n; ++idet) {
+        const long *occs_up = up.occs.data() + str_up[idet] * up.nocc;
+        const long *occs_dn = dn.occs.data() + str_dn[idet] * dn.nocc;
+        diag[idet] = diag_det(ham, up.nocc, occs_up, dn.nocc, occs_dn);
+    }
+}
+
+void FullCISigma::init_strings(StringList &list, const long nword, const long nvir,
+                               const AlignedVector<ulong> &strs, const HashMap<Hash, long> &dict) {
+    long n1 = nbasis;
+    long n2 = n1 * n1;
+    long n3 = n1 * n2;
+    long jstr;
+    double val;
+    AlignedVector<ulong> str(nword);
+    AlignedVector<long> virs(nvir);
+    list.nstr = dict.size();
+    list.occs.resize(list.nstr * list.nocc);
+    list.single_ptr.assign(1, 0);
+    list.double_ptr.assign(1, 0);
+    for (long istr = 0; istr < list.nstr; ++istr) {
+        const ulong *rstr = &strs[istr * nword];
+        const long *occs = list.occs.data() + istr * list.nocc;
+        std::memcpy(str.data(), rstr, sizeof(ulong) * nword);
+        fill_occs(nword, rstr, list.occs.data() + istr * list.nocc);
+        fill_virs(nword, nbasis, rstr, virs.data());
+        // loop over occupied indices
+        for (long i = 0, j, k, l, ii, jj, kk, ll, ioffset, koffset; i < list.nocc; ++i) {
+            ii = occs[i];
+            ioffset = n3 * ii;
+            // loop over virtual indices
+            for (j = 0; j < nvir; ++j) {
+                jj = virs[j];
+                // single excitations within the string space
+                excite_det(ii, jj, str.data());
+                jstr = find_string(nword, str.data(), dict);
+                if (jstr != -1) {
+                    // same-spin part of the single excitation matrix element
+                    val = one_mo[n1 * ii + jj];
+                    for (k = 0; k < list.nocc; ++k) {
+                        kk = occs[k];
+                        koffset = ioffset + n2 * kk;
+                        val += two_mo[koffset + n1 * jj + kk] - two_mo[koffset + n1 * kk + jj];
+                    }
+                    list.single_str.push_back(jstr);
+                    list.single_orb.push_back(n1 * ii + jj);
+                    list.single_sign.push_back(phase_single_det(nword, ii, jj, rstr));
+                    list.single_val.push_back(val);
+                }
+                // loop over occupied indices
+                for (k = i + 1; k < list.nocc; ++k) {
+                    kk = occs[k];
+                    koffset = ioffset + n2 * kk;
+                    // loop over virtual indices
+                    for (l = j + 1; l < nvir; ++l) {
+                        ll = virs[l];
+                        // double excitations within the string space
+                        excite_det(kk, ll, str.data());
+                        jstr = find_string(nword, str.data(), dict);
+                        if (jstr != -1) {
+                            list.double_str.push_back(jstr);
+                            list.double_val.push_back(
+                                phase_double_det(nword, ii, kk, jj, ll, rstr) *
+                                (two_mo[koffset + n1 * jj + ll] - two_mo[koffset + n1 * ll + jj]));
+                        }
+                        excite_det(ll, kk, str.data());
+                    }
+                }
+                excite_det(jj, ii, str.data());
+            }
+        }
+        list.single_ptr.push_back(list.single_str.size());
+        list.double_ptr.push_back(list.double_str.size());
+    }
+}
+
+void FullCISigma::diagonal(double *d) const {
+    std::memcpy(d, diag.data(), sizeof(double) * ndet);
+}
+
+void FullCISigma::perform_op(const double *x, double *y) const {
+    // the spin-up pass writes each row of the spin-up grouping and the spin-down pass adds to each
+    // row of the spin-down grouping, so the threads of either pass never write to the same element
+    long nthread = sigma_num_threads(ndet);
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&FullCISigma::perform_op_up_thread, this, x, y,
+                               std::lower_bound(up.row_ptr.begin(), up.row_ptr.end(),
+                                                end_chunk_idx(i, nthread, ndet)) -
+                                   up.row_ptr.begin(),
+                               std::lower_bound(up.row_ptr.begin(), up.row_ptr.end(),
+                                                end_chunk_idx(i + 1, nthread, ndet)) -
+                                   up.row_ptr.begin());
+    for (auto &thread : v_threads)
+        thread.join();
+    v_threads.clear();
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&FullCISigma::perform_op_dn_thread, this, x, y,
+                               std::lower_bound(dn.row_ptr.begin(), dn.row_ptr.end(),
+                                                end_chunk_idx(i, nthread, ndet)) -
+                                   dn.row_ptr.begin(),
+                               std::lower_bound(dn.row_ptr.begin(), dn.row_ptr.end(),
+                                                end_chunk_idx(i + 1, nthread, ndet)) -
+                                   dn.row_ptr.begin());
+    for (auto &thread : v_threads)
+        thread.join();
+}
+
+void FullCISigma::perform_op_up_thread(const double *x, double *y, const long start,
+                                       const long end) const {
+    long n1 = nbasis;
+    long n2 = n1 * n1;
+    long n3 = n1 * n2;
+    AlignedVector<long> pos(dn.nstr, -1);
+    AlignedVector<double> coul(n1);
+    for (long istr = start; istr < std::min(end, up.nstr); ++istr) {
+        const long *str1 = &up.row_str[up.row_ptr[istr]];
+        const long *det1 = &up.row_det[up.row_ptr[istr]];
+        const long *end1 = up.row_str.data() + up.row_ptr[istr + 1];
+        // diagonal elements
+        for (long p = up.row_ptr[istr]; p < up.row_ptr[istr + 1]; ++p)
+            y[up.row_det[p]] = diag[up.row_det[p]] * x[up.row_det[p]];
+        // 1-0 and 1-1 excitation elements
+        for (long e = up.single_ptr[istr]; e < up.single_ptr[istr + 1]; ++e) {
+            long jstr = up.single_str[e];
+            long ii = up.single_orb[e] / n1, jj = up.single_orb[e] % n1;
+            long ioffset = n3 * ii + n1 * jj;
+            double sign_up = up.single_sign[e];
+            for (long kk = 0; kk < n1; ++kk)
+                coul[kk] = two_mo[ioffset + (n2 + 1) * kk];
+            for (long q = up.row_ptr[jstr]; q < up.row_ptr[jstr + 1]; ++q)
+                pos[up.row_str[q]] = up.row_det[q];
+            for (const long *s = str1, *d = det1; s != end1; ++s, ++d) {
+                const long *occs_dn = dn.occs.data() + *s * dn.nocc;
+                long jdet = pos[*s];
+                double val = 0.0;
+                if (jdet != -1) {
+                    double val1 = up.single_val[e];
+                    for (long k = 0; k < dn.nocc; ++k)
+                        val1 += coul[occs_dn[k]];
+                    val += val1 * x[jdet];
+                }
+                for (long f = dn.single_ptr[*s]; f < dn.single_ptr[*s + 1]; ++f) {
+                    jdet = pos[dn.single_str[f]];
+                    if (jdet != -1) {
+                        long kk = dn.single_orb[f] / n1, ll = dn.single_orb[f] % n1;
+                        val += dn.single_sign[f] * two_mo[ioffset + n2 * kk + ll] * x[jdet];
+                    }
+                }
+                y[*d] += sign_up * val;
+            }
+            for (long q = up.row_ptr[jstr]; q < up.row_ptr[jstr + 1]; ++q)
+                pos[up.row_str[q]] = -1;
+        }
+        // 2-0 excitation elements
+        for (long e = up.double_ptr[istr]; e < up.double_ptr[istr + 1]; ++e) {
+            long jstr = up.double_str[e];
+            merge_rows(str1, det1, end1, &up.row_str[up.row_ptr[jstr]],
+                       &up.row_det[up.row_ptr[jstr]], up.row_str.data() + up.row_ptr[jstr + 1],
+                       up.double_val[e], x, y);
+        }
+    }
+}
+
+void FullCISigma::perform_op_dn_thread(const double *x, double *y, const long start,
+                                       const long end) const {
+    long n1 = nbasis;
+    long n2 = n1 * n1;
+    long n3 = n1 * n2;
+    AlignedVector<double> coul(n1);
+    for (long istr = start; istr < std::min(end, dn.nstr); ++istr) {
+        const long *str1 = &dn.row_str[dn.row_ptr[istr]];
+        const long *det1 = &dn.row_det[dn.row_ptr[istr]];
+        const long *end1 = dn.row_str.data() + dn.row_ptr[istr + 1];
+        // 0-1 excitation elements
+        for (long e = dn.single_ptr[istr]; e < dn.single_ptr[istr + 1]; ++e) {
+            long jstr = dn.single_str[e];
+            long ii = dn.single_orb[e] / n1, jj = dn.single_orb[e] % n1;
+            long ioffset = n3 * ii + n1 * jj;
+            for (long kk = 0; kk < n1; ++kk)
+                coul[kk] = two_mo[ioffset + (n2 + 1) * kk];
+            const long *s1 = str1, *d1 = det1;
+            const long *s2 = &dn.row_str[dn.row_ptr[jstr]], *d2 = &dn.row_det[dn.row_ptr[jstr]];
+            const long *end2 = dn.row_str.data() + dn.row_ptr[jstr + 1];
+            while (s1 != end1 && s2 != end2) {
+                if (*s1 < *s2) {
+                    ++s1;
+                    ++d1;
+                } else if (*s2 < *s1) {
+                    ++s2;
+                    ++d2;
+                } else {
+                    const long *occs_up = up.occs.data() + *s1 * up.nocc;
+                    double val = dn.single_val[e];
+                    for (long k = 0; k < up.nocc; ++k)
+                        val += coul[occs_up[k]];
+                    y[*d1++] += dn.single_sign[e] * val * x[*d2++];
+                    ++s1;
+                    ++s2;
+                }
+            }
+        }
+        // 0-2 excitation elements
+        for (long e = dn.double_ptr[istr]; e < dn.double_ptr[istr + 1]; ++e) {
+            long jstr = dn.double_str[e];
+            merge_rows(str1, det1, end1, &dn.row_str[dn.row_ptr[jstr]],
+                       &dn.row_det[dn.row_ptr[jstr]], dn.row_str.data() + dn.row_ptr[jstr + 1],
+                       dn.double_val[e], x, y);
+        }
+    }
+}
+
+} // namespace pyci
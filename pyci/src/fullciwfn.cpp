@@ -26,12 +26,11 @@ FullCIWfn::FullCIWfn(FullCIWfn &&wfn) noexcept : TwoSpinWfn(wfn) {
 FullCIWfn::FullCIWfn(const DOCIWfn &wfn) : TwoSpinWfn(wfn.nbasis, wfn.nocc_up, wfn.nocc_dn) {
     ndet = wfn.ndet;
     dets.resize(wfn.ndet * nword2);
-    dict.clear();
     for (long i = 0; i < wfn.ndet; ++i) {
         std::memcpy(&dets[i * wfn.nword2], wfn.det_ptr(i), sizeof(ulong) * wfn.nword);
         std::memcpy(&dets[i * wfn.nword2 + wfn.nword], wfn.det_ptr(i), sizeof(ulong) * wfn.nword);
-        dict[rank_det(&dets[i * wfn.nword2])] = i;
     }
+    build_dict(2);
 }
 
 FullCIWfn::FullCIWfn(const std::string &filename) : TwoSpinWfn(filename) {
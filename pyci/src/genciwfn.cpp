@@ -28,19 +28,19 @@ GenCIWfn::GenCIWfn(const DOCIWfn &wfn) : GenCIWfn(FullCIWfn(wfn)) {
 
 GenCIWfn::GenCIWfn(const FullCIWfn &wfn) : OneSpinWfn(wfn.nbasis * 2, wfn.nocc, 0) {
     ndet = wfn.ndet;
-    dets.resize(wfn.ndet * wfn.nword2);
+    dets.resize(wfn.ndet * nword);
     AlignedVector<long> occs(wfn.nocc);
     long *occs_up = &occs[0], *occs_dn = &occs[wfn.nocc_up];
     long j, k = 0;
     for (long i = 0; i < wfn.ndet; ++i) {
         fill_occs(wfn.nword, wfn.det_ptr(i), occs_up);
-        fill_occs(wfn.nword, wfn.det_ptr(i), occs_dn);
+        fill_occs(wfn.nword, wfn.det_ptr(i) + wfn.nword, occs_dn);
         for (j = 0; j < wfn.nocc_dn; ++j)
             occs_dn[j] += wfn.nbasis;
         fill_det(wfn.nocc, occs_up, &dets[k]);
-        dict[rank_det(&dets[k])] = i;
-        k += wfn.nword2;
+        k += nword;
     }
+    build_dict(1);
 }
 
 GenCIWfn::GenCIWfn(const std::string &filename) : OneSpinWfn(filename) {
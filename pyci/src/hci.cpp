@@ -19,35 +19,36 @@ namespace pyci {
 
 namespace {
 
-void hci_thread_add_dets(const SQuantOp &ham, const DOCIWfn &wfn, DOCIWfn &t_wfn, const double *coeffs,
-                         const double eps, const long idet, ulong *det, long *occs, long *virs) {
-    Hash rank;
+void hci_thread_add_dets(const SQuantOp &ham, const DOCIWfn &wfn, DetBatch &batch,
+                         const double *coeffs, const double eps, const long idet, ulong *det,
+                         long *occs, long *) {
+    const HeatBath &pairs = ham.heat_bath(HeatBath::pair);
+    const double c = std::abs(coeffs[idet]);
     // fill working vectors
     wfn.copy_det(idet, det);
     fill_occs(wfn.nword, det, occs);
-    fill_virs(wfn.nword, wfn.nbasis, det, virs);
-    // single/"pair"-excited elements elements
-    for (long i = 0, k; i < wfn.nocc_up; ++i) {
+    // pair-excited elements, in order of decreasing |H|, until |H*c| <= eps
+    for (long i = 0, k, l, t; i < wfn.nocc_up; ++i) {
         k = occs[i];
-        for (long j = 0, l; j < wfn.nvir_up; ++j) {
-            l = virs[j];
+        for (t = pairs.ptr[k]; t < pairs.ptr[k + 1] && pairs.values[t] * c > eps; ++t) {
+            l = pairs.targets[t];
+            if (testbit_det(l, det))
+                continue;
+            // look up determinant with the others of this batch
             excite_det(k, l, det);
-            // add determinant if |H*c| > eps and not already in wfn
-            if (std::abs(ham.v[k * wfn.nbasis + l] * coeffs[idet]) > eps) {
-                rank = wfn.rank_det(det);
-                if (wfn.index_det_from_rank(rank) == -1)
-                    t_wfn.add_det_with_rank(det, rank);
-            }
+            batch.push(det, wfn.rank_det(det));
             excite_det(l, k, det);
         }
     }
 }
 
-void hci_thread_add_dets(const SQuantOp &ham, const FullCIWfn &wfn, FullCIWfn &t_wfn,
+void hci_thread_add_dets(const SQuantOp &ham, const FullCIWfn &wfn, DetBatch &batch,
                          const double *coeffs, const double eps, const long idet, ulong *det_up,
                          long *occs_up, long *virs_up) {
-    long i, j, k, l, ii, jj, kk, ll, ioffset, koffset;
-    Hash rank;
+    const HeatBath &same = ham.heat_bath(HeatBath::same_spin);
+    const HeatBath &opposite = ham.heat_bath(HeatBath::opposite_spin);
+    const double c = std::abs(coeffs[idet]);
+    long i, j, k, ii, jj, kk, ll, ioffset, koffset, key, t;
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
     long n3 = n1 * n2;
@@ -70,7 +71,6 @@ void hci_thread_add_dets(const SQuantOp &ham, const FullCIWfn &wfn, FullCIWfn &t
         for (j = 0; j < wfn.nvir_up; ++j) {
             jj = virs_up[j];
             // 1-0 excitation elements
-            excite_det(ii, jj, det_up);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc_up; ++k) {
                 kk = occs_up[k];
@@ -81,51 +81,52 @@ void hci_thread_add_dets(const SQuantOp &ham, const FullCIWfn &wfn, FullCIWfn &t
                 kk = occs_dn[k];
                 val += ham.two_mo[ioffset + n2 * kk + n1 * jj + kk];
             }
-            // add determinant if |H*c| > eps and not already in wfn
+            // look up determinant if |H*c| > eps
             if (std::abs(val * coeffs[idet]) > eps) {
-                rank = wfn.rank_det(det_up);
-                if (wfn.index_det_from_rank(rank) == -1)
-                    t_wfn.add_det_with_rank(det_up, rank);
+                excite_det(ii, jj, det_up);
+                batch.push(det_up, wfn.rank_det(det_up));
+                excite_det(jj, ii, det_up);
             }
-            // loop over spin-down occupied indices
-            for (k = 0; k < wfn.nocc_dn; ++k) {
-                kk = occs_dn[k];
-                koffset = ioffset + n2 * kk;
-                // loop over spin-down virtual indices
-                for (l = 0; l < wfn.nvir_dn; ++l) {
-                    ll = virs_dn[l];
-                    // 1-1 excitation elements
-                    excite_det(kk, ll, det_dn);
-                    val = ham.two_mo[koffset + n1 * jj + ll];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val * coeffs[idet]) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1)
-                            t_wfn.add_det_with_rank(det_up, rank);
-                    }
-                    excite_det(ll, kk, det_dn);
-                }
+        }
+        // loop over spin-down occupied indices
+        for (k = 0; k < wfn.nocc_dn; ++k) {
+            kk = occs_dn[k];
+            key = n1 * ii + kk;
+            koffset = ioffset + n2 * kk;
+            // 1-1 excitation elements, in order of decreasing |H|, until |H*c| <= eps
+            for (t = opposite.ptr[key];
+                 t < opposite.ptr[key + 1] &&
+                 std::abs(ham.two_mo[koffset + opposite.targets[t]]) * c > eps;
+                 ++t) {
+                jj = opposite.targets[t] / n1;
+                ll = opposite.targets[t] % n1;
+                if (testbit_det(jj, rdet_up) || testbit_det(ll, rdet_dn))
+                    continue;
+                // look up determinant with the others of this batch
+                excite_det(ii, jj, det_up);
+                excite_det(kk, ll, det_dn);
+                batch.push(det_up, wfn.rank_det(det_up));
+                excite_det(ll, kk, det_dn);
+                excite_det(jj, ii, det_up);
             }
-            // loop over spin-up occupied indices
-            for (k = i + 1; k < wfn.nocc_up; ++k) {
-                kk = occs_up[k];
-                koffset = ioffset + n2 * kk;
-                // loop over spin-up virtual indices
-                for (l = j + 1; l < wfn.nvir_up; ++l) {
-                    ll = virs_up[l];
-                    // 2-0 excitation elements
-                    excite_det(kk, ll, det_up);
-                    val = ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val * coeffs[idet]) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1)
-                            t_wfn.add_det_with_rank(det_up, rank);
-                    }
-                    excite_det(ll, kk, det_up);
-                }
+        }
+        // loop over spin-up occupied indices
+        for (k = i + 1; k < wfn.nocc_up; ++k) {
+            kk = occs_up[k];
+            key = n1 * ii + kk;
+            // 2-0 excitation elements, in order of decreasing |H|, until |H*c| <= eps
+            for (t = same.ptr[key]; t < same.ptr[key + 1] && same.values[t] * c > eps; ++t) {
+                jj = same.targets[t] / n1;
+                ll = same.targets[t] % n1;
+                if (testbit_det(jj, rdet_up) || testbit_det(ll, rdet_up))
+                    continue;
+                // look up determinant with the others of this batch
+                excite_det(ii, jj, det_up);
+                excite_det(kk, ll, det_up);
+                batch.push(det_up, wfn.rank_det(det_up));
+                excite_det(ll, kk, det_up);
+                excite_det(jj, ii, det_up);
             }
-            excite_det(jj, ii, det_up);
         }
     }
     // loop over spin-down occupied indices
@@ -136,7 +137,6 @@ void hci_thread_add_dets(const SQuantOp &ham, const FullCIWfn &wfn, FullCIWfn &t
         for (j = 0; j < wfn.nvir_dn; ++j) {
             jj = virs_dn[j];
             // 0-1 excitation elements
-            excite_det(ii, jj, det_dn);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc_up; ++k) {
                 kk = occs_up[k];
@@ -147,39 +147,39 @@ void hci_thread_add_dets(const SQuantOp &ham, const FullCIWfn &wfn, FullCIWfn &t
                 koffset = ioffset + n2 * kk;
                 val += ham.two_mo[koffset + n1 * jj + kk] - ham.two_mo[koffset + n1 * kk + jj];
             }
-            // add determinant if |H*c| > eps and not already in wfn
+            // look up determinant if |H*c| > eps
             if (std::abs(val * coeffs[idet]) > eps) {
-                rank = wfn.rank_det(det_up);
-                if (wfn.index_det_from_rank(rank) == -1)
-                    t_wfn.add_det_with_rank(det_up, rank);
+                excite_det(ii, jj, det_dn);
+                batch.push(det_up, wfn.rank_det(det_up));
+                excite_det(jj, ii, det_dn);
             }
-            // loop over spin-down occupied indices
-            for (k = i + 1; k < wfn.nocc_dn; ++k) {
-                kk = occs_dn[k];
-                koffset = ioffset + n2 * kk;
-                // loop over spin-down virtual indices
-                for (l = j + 1; l < wfn.nvir_dn; ++l) {
-                    ll = virs_dn[l];
-                    // 0-2 excitation elements
-                    excite_det(kk, ll, det_dn);
-                    val = ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val * coeffs[idet]) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1)
-                            t_wfn.add_det_with_rank(det_up, rank);
-                    }
-                    excite_det(ll, kk, det_dn);
-                }
+        }
+        // loop over spin-down occupied indices
+        for (k = i + 1; k < wfn.nocc_dn; ++k) {
+            kk = occs_dn[k];
+            key = n1 * ii + kk;
+            // 0-2 excitation elements, in order of decreasing |H|, until |H*c| <= eps
+            for (t = same.ptr[key]; t < same.ptr[key + 1] && same.values[t] * c > eps; ++t) {
+                jj = same.targets[t] / n1;
+                ll = same.targets[t] % n1;
+                if (testbit_det(jj, rdet_dn) || testbit_det(ll, rdet_dn))
+                    continue;
+                // look up determinant with the others of this batch
+                excite_det(ii, jj, det_dn);
+                excite_det(kk, ll, det_dn);
+                batch.push(det_up, wfn.rank_det(det_up));
+                excite_det(ll, kk, det_dn);
+                excite_det(jj, ii, det_dn);
             }
-            excite_det(jj, ii, det_dn);
         }
     }
 }
 
-void hci_thread_add_dets(const SQuantOp &ham, const GenCIWfn &wfn, GenCIWfn &t_wfn, const double *coeffs,
-                         const double eps, const long idet, ulong *det, long *occs, long *virs) {
-    Hash rank;
+void hci_thread_add_dets(const SQuantOp &ham, const GenCIWfn &wfn, DetBatch &batch,
+                         const double *coeffs, const double eps, const long idet, ulong *det,
+                         long *occs, long *virs) {
+    const HeatBath &same = ham.heat_bath(HeatBath::same_spin);
+    const double c = std::abs(coeffs[idet]);
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
     long n3 = n1 * n2;
@@ -188,58 +188,63 @@ void hci_thread_add_dets(const SQuantOp &ham, const GenCIWfn &wfn, GenCIWfn &t_w
     fill_occs(wfn.nword, det, occs);
     fill_virs(wfn.nword, wfn.nbasis, det, virs);
     // loop over occupied indices
-    for (long i = 0, ii, ioffset, koffset; i < wfn.nocc; ++i) {
+    for (long i = 0, ii, ioffset, koffset, key, t; i < wfn.nocc; ++i) {
         ii = occs[i];
         ioffset = n3 * ii;
         // loop over virtual indices
-        for (long j = 0, jj, k, kk; j < wfn.nvir; ++j) {
+        for (long j = 0, jj, k, kk; j < wfn.nvir_up; ++j) {
             jj = virs[j];
             // single excitation elements
-            excite_det(ii, jj, det);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc; ++k) {
                 kk = occs[k];
                 koffset = ioffset + n2 * kk;
                 val += ham.two_mo[koffset + n1 * jj + kk] - ham.two_mo[koffset + n1 * kk + jj];
             }
-            // add determinant if |H*c| > eps and not already in wfn
+            // look up determinant if |H*c| > eps
             if (std::abs(val * coeffs[idet]) > eps) {
-                rank = wfn.rank_det(det);
-                if (wfn.index_det_from_rank(rank) == -1)
-                    t_wfn.add_det_with_rank(det, rank);
+                excite_det(ii, jj, det);
+                batch.push(det, wfn.rank_det(det));
+                excite_det(jj, ii, det);
             }
-            // loop over occupied indices
-            for (k = i + 1; k < wfn.nocc; ++k) {
-                kk = occs[k];
-                koffset = ioffset + n2 * kk;
-                // loop over virtual indices
-                for (long l = j + 1, ll; l < wfn.nvir; ++l) {
-                    ll = virs[l];
-                    // double excitation elements
-                    excite_det(kk, ll, det);
-                    val = ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val * coeffs[idet]) > eps) {
-                        rank = wfn.rank_det(det);
-                        if (wfn.index_det_from_rank(rank) == -1)
-                            t_wfn.add_det_with_rank(det, rank);
-                    }
-                    excite_det(ll, kk, det);
-                }
+        }
+        // loop over occupied indices
+        for (long k = i + 1, kk, jj, ll; k < wfn.nocc; ++k) {
+            kk = occs[k];
+            key = n1 * ii + kk;
+            // double excitation elements, in order of decreasing |H|, until |H*c| <= eps
+            for (t = same.ptr[key]; t < same.ptr[key + 1] && same.values[t] * c > eps; ++t) {
+                jj = same.targets[t] / n1;
+                ll = same.targets[t] % n1;
+                if (testbit_det(jj, det) || testbit_det(ll, det))
+                    continue;
+                // look up determinant with the others of this batch
+                excite_det(ii, jj, det);
+                excite_det(kk, ll, det);
+                batch.push(det, wfn.rank_det(det));
+                excite_det(ll, kk, det);
+                excite_det(jj, ii, det);
             }
-            excite_det(jj, ii, det);
         }
     }
 }
 
 template<class WfnType>
-void hci_thread(const SQuantOp &ham, const WfnType &wfn, WfnType &t_wfn, const double *coeffs,
-                const double eps, const long start, const long end) {
+void hci_thread(const SQuantOp &ham, const WfnType &wfn, WfnBuilder &builder,
+                const double *coeffs, const double eps, const long start, const long end) {
     AlignedVector<ulong> det(wfn.nword2);
     AlignedVector<long> occs(wfn.nocc);
     AlignedVector<long> virs(wfn.nvir);
-    for (long i = start; i < end; ++i)
-        hci_thread_add_dets(ham, wfn, t_wfn, coeffs, eps, i, &det[0], &occs[0], &virs[0]);
+    DetBatch batch(std::is_base_of<TwoSpinWfn, WfnType>::value ? wfn.nword2 : wfn.nword);
+    for (long i = start; i < end; ++i) {
+        // collect the excitations of a determinant, then add those that are not already in wfn
+        hci_thread_add_dets(ham, wfn, batch, coeffs, eps, i, &det[0], &occs[0], &virs[0]);
+        batch.lookup(wfn);
+        for (long j = 0; j < batch.size(); ++j)
+            if (batch.indices[j] == -1)
+                builder.add_det_with_rank(batch.det_ptr(j), batch.ranks[j]);
+        batch.clear();
+    }
 };
 
 } // namespace
@@ -247,6 +252,19 @@ void hci_thread(const SQuantOp &ham, const WfnType &wfn, WfnType &t_wfn, const d
 template<class WfnType>
 long add_hci(const SQuantOp &ham, WfnType &wfn, const double *coeffs, const double eps, long nthread) {
     long ndet_old = wfn.ndet;
+    // a complete determinant space has nothing to add
+    if (wfn.complete)
+        return 0;
+    else if (wfn.frozen)
+        throw std::runtime_error("cannot add determinants to a frozen wave function");
+    // build the heat-bath lists before the threads read them
+    if (std::is_same<WfnType, DOCIWfn>::value) {
+        ham.heat_bath(HeatBath::pair);
+    } else {
+        ham.heat_bath(HeatBath::same_spin);
+        if (std::is_same<WfnType, FullCIWfn>::value)
+            ham.heat_bath(HeatBath::opposite_spin);
+    }
     if (nthread == -1)
         nthread = get_num_threads();
     long chunksize = ndet_old / nthread + static_cast<bool>(ndet_old % nthread);
@@ -255,20 +273,19 @@ long add_hci(const SQuantOp &ham, WfnType &wfn, const double *coeffs, const doub
         nthread /= 2;
         chunksize = ndet_old / nthread + static_cast<bool>(ndet_old % nthread);
     }
+    // all threads add to one sharded builder, which is then compacted onto the wave function
+    WfnBuilder builder(std::is_base_of<TwoSpinWfn, WfnType>::value ? wfn.nword2 : wfn.nword);
     Vector<std::thread> v_threads;
-    Vector<WfnType> v_wfns;
     v_threads.reserve(nthread);
-    v_wfns.reserve(nthread);
     for (long i = 0; i < nthread; ++i) {
         long start = end_chunk_idx(i, nthread, ndet_old);
         long end = end_chunk_idx(i + 1, nthread, ndet_old);
         end = std::min(end, ndet_old);
-        v_wfns.emplace_back(wfn.nbasis, wfn.nocc_up, wfn.nocc_dn);
         v_threads.emplace_back(&hci_thread<WfnType>, std::ref(ham), std::ref(wfn),
-                               std::ref(v_wfns.back()), coeffs, eps, start, end);
+                               std::ref(builder), coeffs, eps, start, end);
     }
     for (auto &thread : v_threads) thread.join();
-    for (auto &wf : v_wfns) wfn.add_dets_from_wfn(wf);
+    wfn.add_dets_from_builder(builder);
 
     return wfn.ndet - ndet_old;
 }
@@ -44,9 +44,7 @@ OneSpinWfn::OneSpinWfn(const std::string &filename) {
         throw std::ios_base::failure("error in file");
     Wfn::init(nb, nu, nd);
     ndet = n;
-    dict.reserve(n);
-    for (long i = 0; i < ndet; ++i)
-        dict[rank_det(&dets[nword * i])] = i;
+    build_dict(1);
 }
 
 OneSpinWfn::OneSpinWfn(const long nb, const long nu, const long nd) : Wfn(nb, nu, nd) {
@@ -57,8 +55,7 @@ OneSpinWfn::OneSpinWfn(const long nb, const long nu, const long nd, const long n
     ndet = n;
     dets.resize(n * nword);
     std::memcpy(&dets[0], ptr, sizeof(ulong) * n * nword);
-    for (long i = 0; i < n; ++i)
-        dict[rank_det(ptr + i * nword)] = i;
+    build_dict(1);
 }
 
 OneSpinWfn::OneSpinWfn(const long nb, const long nu, const long nd, const long n, const long *ptr)
@@ -71,8 +68,7 @@ OneSpinWfn::OneSpinWfn(const long nb, const long nu, const long nd, const long n
         j += nu;
         k += nword;
     }
-    for (long i = 0; i < n; ++i)
-        dict[rank_det(&dets[i * nword])] = i;
+    build_dict(1);
 }
 
 OneSpinWfn::OneSpinWfn(const long nb, const long nu, const long nd, const Array<ulong> array)
@@ -121,15 +117,67 @@ void OneSpinWfn::to_occ_array(const long low, const long high, long *ptr) const
 }
 
 long OneSpinWfn::index_det(const ulong *det) const {
+    if (complete)
+        return rank_string(det, nocc_up);
+    else if (frozen)
+        return search_det(det, 1);
+    else if (lean)
+        return find_slot(det, rank_det(det).first, 1);
     const auto &search = dict.find(rank_det(det));
     return (search == dict.end()) ? -1 : search->second;
 }
 
 long OneSpinWfn::index_det_from_rank(const Hash rank) const {
+    if (complete || frozen || lean)
+        throw std::runtime_error("cannot index a complete, frozen, or lean wave function by hash");
     const auto &search = dict.find(rank);
     return (search == dict.end()) ? -1 : search->second;
 }
 
+long OneSpinWfn::index_det_with_rank(const ulong *det, const Hash rank) const {
+    if (complete || frozen)
+        return index_det(det);
+    else if (lean)
+        return find_slot(det, rank.first, 1);
+    const auto &search = dict.find(rank);
+    return (search == dict.end()) ? -1 : search->second;
+}
+
+void OneSpinWfn::index_dets(const ulong *ptr, const long n, long *out) const {
+    // hash a batch of determinants and prefetch their buckets before resolving the lookups, so
+    // that the cache misses of the batch overlap
+    if (complete || frozen) {
+        for (long i = 0; i < n; ++i)
+            out[i] = index_det(ptr + i * nword);
+        return;
+    }
+    Hash ranks[PYCI_INDEX_BATCH];
+    for (long start = 0, end, i; start < n; start = end) {
+        end = std::min(start + PYCI_INDEX_BATCH, n);
+        for (i = start; i < end; ++i)
+            ranks[i - start] = rank_det(ptr + i * nword);
+        index_dets_with_rank(ptr + start * nword, ranks, end - start, out + start);
+    }
+}
+
+void OneSpinWfn::index_dets_with_rank(const ulong *ptr, const Hash *ranks, const long n,
+                                      long *out) const {
+    // keep the buckets of the next PYCI_INDEX_BATCH determinants in flight while resolving each
+    // lookup
+    if (complete || frozen) {
+        for (long i = 0; i < n; ++i)
+            out[i] = index_det(ptr + i * nword);
+        return;
+    }
+    for (long i = 0; i < n && i < PYCI_INDEX_BATCH; ++i)
+        prefetch_rank(ranks[i]);
+    for (long i = 0; i < n; ++i) {
+        if (i + PYCI_INDEX_BATCH < n)
+            prefetch_rank(ranks[i + PYCI_INDEX_BATCH]);
+        out[i] = index_det_with_rank(ptr + i * nword, ranks[i]);
+    }
+}
+
 void OneSpinWfn::copy_det(const long i, ulong *det) const {
     std::memcpy(det, &dets[i * nword], sizeof(ulong) * nword);
 }
@@ -139,7 +187,15 @@ Hash OneSpinWfn::rank_det(const ulong *det) const {
 }
 
 long OneSpinWfn::add_det(const ulong *det) {
-    if (dict.insert(std::make_pair(rank_det(det), ndet)).second) {
+    // a complete determinant space already contains every determinant
+    if (complete)
+        return -1;
+    else if (frozen)
+        throw std::runtime_error("cannot add determinants to a frozen wave function");
+    check_views();
+    if (lean)
+        return insert_slot(det, rank_det(det).first, 1);
+    else if (dict.insert(std::make_pair(rank_det(det), ndet)).second) {
         dets.resize(dets.size() + nword);
         std::memcpy(&dets[nword * ndet], det, sizeof(ulong) * nword);
         return ndet++;
@@ -148,7 +204,14 @@ long OneSpinWfn::add_det(const ulong *det) {
 }
 
 long OneSpinWfn::add_det_with_rank(const ulong *det, const Hash rank) {
-    if (dict.insert(std::make_pair(rank, ndet)).second) {
+    if (complete)
+        return -1;
+    else if (frozen)
+        throw std::runtime_error("cannot add determinants to a frozen wave function");
+    check_views();
+    if (lean)
+        return insert_slot(det, rank.first, 1);
+    else if (dict.insert(std::make_pair(rank, ndet)).second) {
         dets.resize(dets.size() + nword);
         std::memcpy(&dets[nword * ndet], det, sizeof(ulong) * nword);
         return ndet++;
@@ -186,7 +249,12 @@ void onespinwfn_add_all_dets_thread(const long nword, const long nbasis, const l
 
 } // namespace
 
-void OneSpinWfn::add_all_dets(long nthread) {
+void OneSpinWfn::add_all_dets(long nthread, const std::string &index) {
+    if (frozen)
+        throw std::runtime_error("cannot add determinants to a frozen wave function");
+    else if (index != "hash" && index != "rank")
+        throw std::invalid_argument("index must be 'hash' or 'rank'");
+    check_views();
     if (maxrank_up == Max<long>())
         throw std::domain_error("cannot generate > 2 ** 63 determinants");
     if (nthread == -1)
@@ -196,11 +264,14 @@ void OneSpinWfn::add_all_dets(long nthread) {
         nthread /= 2;
         chunksize = maxrank_up / nthread + static_cast<bool>(maxrank_up % nthread);
     }
+    // the determinants already present are moved to their colex rank
+    if (ndet)
+        ++generation;
     ndet = maxrank_up;
     std::fill(dets.begin(), dets.end(), 0UL);
     dets.resize(ndet * nword);
-    dict.clear();
-    dict.reserve(ndet);
+    if (index == "rank")
+        init_complete();
     Vector<std::thread> v_threads;
     v_threads.reserve(nthread);
     for (long i = 0; i < nthread; ++i) {
@@ -212,8 +283,8 @@ void OneSpinWfn::add_all_dets(long nthread) {
     }
     for (auto &thread : v_threads)
         thread.join();
-    for (long i = 0; i < ndet; ++i)
-        dict[rank_det(&dets[i * nword])] = i;
+    if (index == "hash")
+        rebuild_index(1);
 }
 
 void OneSpinWfn::add_excited_dets(const ulong *rdet, const long e) {
@@ -244,13 +315,68 @@ void OneSpinWfn::add_excited_dets(const ulong *rdet, const long e) {
 }
 
 void OneSpinWfn::add_dets_from_wfn(const OneSpinWfn &wfn) {
+    if (wfn.complete || wfn.frozen || wfn.lean) {
+        for (long i = 0; i < wfn.ndet; ++i)
+            add_det(wfn.det_ptr(i));
+        return;
+    }
     for (const auto &keyval : wfn.dict)
         add_det_with_rank(&wfn.dets[keyval.second * nword], keyval.first);
 }
 
+void OneSpinWfn::add_dets(const ulong *ptr, const long n, long *out) {
+    // hash the determinants in parallel, then add them in order; each output is the index of the
+    // determinant in the wave function, whether it was added or already present
+    AlignedVector<Hash> ranks(n);
+    hash_dets(ptr, n, 1, ranks.data());
+    for (long i = 0; i < n; ++i) {
+        if (i + PYCI_INDEX_BATCH < n && !(complete || frozen))
+            prefetch_rank(ranks[i + PYCI_INDEX_BATCH]);
+        out[i] = add_det_with_rank(ptr + i * nword, ranks[i]);
+        if (out[i] == -1)
+            out[i] = index_det_with_rank(ptr + i * nword, ranks[i]);
+    }
+}
+
+void OneSpinWfn::remove_dets(const long *indices, const long n, long *map) {
+    std::fill(map, map + ndet, 0L);
+    for (long i = 0; i < n; ++i) {
+        if (indices[i] < 0 || indices[i] >= ndet)
+            throw std::invalid_argument("determinant index out of range");
+        map[indices[i]] = -1;
+    }
+    compact_dets(1, map);
+}
+
+void OneSpinWfn::prune(const double *coeffs, const long nvec, const double threshold, long *map) {
+    // keep the determinants with a coefficient of magnitude >= threshold in any vector
+    for (long i = 0, k; i < ndet; ++i) {
+        map[i] = -1;
+        for (k = 0; k < nvec; ++k) {
+            if (std::abs(coeffs[k * ndet + i]) >= threshold) {
+                map[i] = i;
+                break;
+            }
+        }
+    }
+    compact_dets(1, map);
+}
+
+void OneSpinWfn::freeze(long *perm) {
+    freeze_dets(1, perm);
+}
+
+void OneSpinWfn::lean_index(void) {
+    init_lean(1);
+}
+
 void OneSpinWfn::reserve(const long n) {
+    check_views();
     dets.reserve(n * nword);
-    dict.reserve(n);
+    if (lean)
+        reserve_slots(1, n);
+    else if (!(complete || frozen))
+        dict.reserve(n);
 }
 
 Array<ulong> OneSpinWfn::py_getitem(const long index) const {
@@ -271,6 +397,11 @@ Array<ulong> OneSpinWfn::py_to_det_array(long start, long end) const {
     return array;
 }
 
+Array<ulong> OneSpinWfn::py_det_view(const pybind11::object &self) {
+    OneSpinWfn *wfn = self.cast<OneSpinWfn *>();
+    return view_array<ulong>(self, wfn->nview, {wfn->ndet, wfn->nword}, wfn->dets.data());
+}
+
 Array<long> OneSpinWfn::py_to_occ_array(long start, long end) const {
     if (start == -1) {
         start = 0;
@@ -289,6 +420,65 @@ long OneSpinWfn::py_index_det(const Array<ulong> det) const {
     return index_det(reinterpret_cast<const ulong *>(det.request().ptr));
 }
 
+Array<long> OneSpinWfn::py_freeze(void) {
+    Array<long> array(ndet);
+    freeze(reinterpret_cast<long *>(array.request().ptr));
+    return array;
+}
+
+Array<long> OneSpinWfn::py_remove_dets(const Array<long> array) {
+    pybind11::buffer_info buf = array.request();
+    Array<long> map(ndet);
+    remove_dets(reinterpret_cast<const long *>(buf.ptr), buf.size,
+                reinterpret_cast<long *>(map.request().ptr));
+    return map;
+}
+
+Array<long> OneSpinWfn::py_prune(const Array<double> coeffs, const double threshold) {
+    pybind11::buffer_info buf = coeffs.request();
+    if (buf.ndim < 1 || buf.ndim > 2 || buf.shape[buf.ndim - 1] != ndet)
+        throw std::invalid_argument("coeffs must have shape (ndet,) or (nvec, ndet)");
+    Array<long> map(ndet);
+    prune(reinterpret_cast<const double *>(buf.ptr), (buf.ndim == 2) ? buf.shape[0] : 1,
+          threshold, reinterpret_cast<long *>(map.request().ptr));
+    return map;
+}
+
+Array<long> OneSpinWfn::py_index_dets(const Array<ulong> array) const {
+    pybind11::buffer_info buf = array.request();
+    if (buf.ndim != 2 || buf.shape[1] != nword)
+        throw std::invalid_argument("dets must have shape (n, nword)");
+    Array<long> indices(buf.shape[0]);
+    index_dets(reinterpret_cast<const ulong *>(buf.ptr), buf.shape[0],
+               reinterpret_cast<long *>(indices.request().ptr));
+    return indices;
+}
+
+Array<long> OneSpinWfn::py_add_dets(const Array<ulong> array) {
+    pybind11::buffer_info buf = array.request();
+    if (buf.ndim != 2 || buf.shape[1] != nword)
+        throw std::invalid_argument("dets must have shape (n, nword)");
+    Array<long> indices(buf.shape[0]);
+    add_dets(reinterpret_cast<const ulong *>(buf.ptr), buf.shape[0],
+             reinterpret_cast<long *>(indices.request().ptr));
+    return indices;
+}
+
+Array<long> OneSpinWfn::py_add_occs_array(const Array<long> array) {
+    pybind11::buffer_info buf = array.request();
+    if (buf.ndim != 2 || buf.shape[1] != nocc_up)
+        throw std::invalid_argument("occs_array must have shape (n, nocc_up)");
+    const long n = buf.shape[0];
+    const long *ptr = reinterpret_cast<const long *>(buf.ptr);
+    AlignedVector<ulong> v_dets(n * nword);
+    for (long i = 0; i < n; ++i) {
+        fill_det(nocc_up, ptr + i * nocc_up, &v_dets[i * nword]);
+    }
+    Array<long> indices(n);
+    add_dets(v_dets.data(), n, reinterpret_cast<long *>(indices.request().ptr));
+    return indices;
+}
+
 Hash OneSpinWfn::py_rank_det(const Array<ulong> det) const {
     return rank_det(reinterpret_cast<const ulong *>(det.request().ptr));
 }
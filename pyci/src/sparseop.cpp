@@ -26,54 +26,521 @@ inline void append(AlignedVector<T> &v, const T &t) {
     v.push_back(t);
 }
 
+template<class WfnType>
+void index_excited_dets(const WfnType &wfn, const long nw, const ulong *det, const long offset,
+                        const long i, const long *virs, const long n, ulong *t_dets,
+                        long *t_jdets) {
+    // look up the determinants made by exciting orbital i of the string at word offset in det to
+    // each of the n virtual orbitals, as one batch; t_dets and t_jdets are scratch space that each
+    // thread allocates once, for wfn.nvir determinants of wfn.nword2 words and 2 * wfn.nvir indices
+    for (long j = 0; j < n; ++j) {
+        std::memcpy(t_dets + j * nw, det, sizeof(ulong) * nw);
+        excite_det(i, virs[j], t_dets + j * nw + offset);
+    }
+    wfn.index_dets(t_dets, n, t_jdets);
+}
+
+void append_connected(const long *t_jdets, const long n, const long jmin, const long ncol,
+                      AlignedVector<long> &t_indices) {
+    // append the indices of the looked-up determinants that are columns of the row
+    for (long j = 0, jdet; j < n; ++j) {
+        jdet = t_jdets[j];
+        if ((jdet != -1) && (jdet < jmin) && (jdet < ncol))
+            append<long>(t_indices, jdet);
+    }
+}
+
+long drop_elements(AlignedVector<double> &t_data, AlignedVector<long> &t_indices,
+                   AlignedVector<long> &t_indptr, const long jstart, const long idet,
+                   const double tol) {
+    // remove the off-diagonal elements of the last row whose magnitude is below tol
+    long k = jstart, nelem = t_indices.size();
+    for (long j = jstart; j < nelem; ++j) {
+        if (t_indices[j] == idet || std::abs(t_data[j]) >= tol) {
+            t_data[k] = t_data[j];
+            t_indices[k++] = t_indices[j];
+        }
+    }
+    t_data.resize(k);
+    t_indices.resize(k);
+    t_indptr.back() = k;
+    return nelem - k;
+}
+
+void sort_row(double *data, long *indices, const long start, const long end) {
+    typedef std::sort_with_arg::value_iterator_t<double, long> iter;
+    std::sort(iter(data + start, indices + start), iter(data + end, indices + end));
+}
+
+inline long varint_size(ulong val) {
+    long n = 1;
+    while (val >= 0x80) {
+        val >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+inline void encode_varint(ulong val, std::uint8_t *&p) {
+    while (val >= 0x80) {
+        *p++ = static_cast<std::uint8_t>(val | 0x80);
+        val >>= 7;
+    }
+    *p++ = static_cast<std::uint8_t>(val);
+}
+
+inline long decode_varint(const std::uint8_t *&p) {
+    ulong val = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        val |= static_cast<ulong>(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    val |= static_cast<ulong>(*p++) << shift;
+    return val;
+}
+
+template<typename Index>
+void sparseop_copy_thread(AlignedVector<double> &t_data, AlignedVector<long> &t_indices,
+                          AlignedVector<long> &t_indptr, double *data, Index *indices, long *indptr,
+                          const long offset) {
+    std::memcpy(data + offset, t_data.data(), sizeof(double) * t_data.size());
+    std::copy(t_indices.begin(), t_indices.end(), indices + offset);
+    for (std::size_t i = 0; i < t_indptr.size(); ++i)
+        indptr[i] = t_indptr[i] + offset;
+    AlignedVector<double>().swap(t_data);
+    AlignedVector<long>().swap(t_indices);
+    AlignedVector<long>().swap(t_indptr);
+}
+
+long sparseop_count_bytes(const AlignedVector<long> &t_indices,
+                          const AlignedVector<long> &t_indptr) {
+    long nbyte = 0;
+    for (long i = 0, j = 0, n = t_indptr.size(); i < n; ++i)
+        for (long prev = 0; j < t_indptr[i]; prev = t_indices[j++])
+            nbyte += varint_size(t_indices[j] - prev);
+    return nbyte;
+}
+
+void sparseop_encode_thread(AlignedVector<double> &t_data, AlignedVector<long> &t_indices,
+                            AlignedVector<long> &t_indptr, double *data, std::uint8_t *bytes,
+                            long *indptr, long *byteptr, const long offset,
+                            const long byte_offset) {
+    std::uint8_t *p = bytes + byte_offset;
+    std::memcpy(data + offset, t_data.data(), sizeof(double) * t_data.size());
+    // store the first column of each row and the gaps between consecutive columns as varints
+    for (long i = 0, j = 0, n = t_indptr.size(); i < n; ++i) {
+        for (long prev = 0; j < t_indptr[i]; prev = t_indices[j++])
+            encode_varint(t_indices[j] - prev, p);
+        indptr[i] = t_indptr[i] + offset;
+        byteptr[i] = p - bytes;
+    }
+    AlignedVector<double>().swap(t_data);
+    AlignedVector<long>().swap(t_indices);
+    AlignedVector<long>().swap(t_indptr);
+}
+
+template<typename Index>
+class IndexReader {
+public:
+    IndexReader(const Index *indices_, const long *indptr_) : indices(indices_), indptr(indptr_) {
+    }
+
+    void seek(const long row) {
+        p = indices + indptr[row];
+    }
+
+    long next(void) {
+        return *p++;
+    }
+
+private:
+    const Index *indices, *p;
+    const long *indptr;
+};
+
+class VarintReader {
+public:
+    VarintReader(const std::uint8_t *bytes_, const long *byteptr_)
+        : bytes(bytes_), byteptr(byteptr_) {
+    }
+
+    void seek(const long row) {
+        p = bytes + byteptr[row];
+        col = 0;
+    }
+
+    long next(void) {
+        return col += decode_varint(p);
+    }
+
+private:
+    const std::uint8_t *bytes, *p;
+    const long *byteptr;
+    long col;
+};
+
+template<class Reader>
+void spmv_thread(Reader reader, const double *data, const long *indptr, const double *x, double *y,
+                 const long start, const long end) {
+    for (long i = start; i < end; ++i) {
+        double val = 0.0;
+        reader.seek(i);
+        for (long j = indptr[i]; j < indptr[i + 1]; ++j)
+            val += data[j] * x[reader.next()];
+        y[i] = val;
+    }
+}
+
+template<class Reader>
+void spmv_symm_thread(Reader reader, const double *data, const long *indptr, const double *x,
+                      double *y, AlignedVector<double> &t_y, const long start, const long end) {
+    // transposed elements that land in this thread's rows go straight to y, and the rest are
+    // accumulated in the thread's buffer over rows [0, start)
+    t_y.assign(start, 0.0);
+    std::fill(y + start, y + end, 0.0);
+    for (long i = start; i < end; ++i) {
+        double val = 0.0;
+        reader.seek(i);
+        for (long j = indptr[i], k; j < indptr[i + 1]; ++j) {
+            k = reader.next();
+            val += data[j] * x[k];
+            if (k >= start && k != i)
+                y[k] += data[j] * x[i];
+            else if (k < start)
+                t_y[k] += data[j] * x[i];
+        }
+        y[i] += val;
+    }
+}
+
+void spmv_symm_reduce_thread(const Vector<AlignedVector<double>> &v_y, double *y, const long start,
+                             const long end) {
+    for (const auto &t_y : v_y)
+        for (long k = start, n = std::min<long>(end, t_y.size()); k < n; ++k)
+            y[k] += t_y[k];
+}
+
+template<class Reader>
+void spmv_symm(Reader reader, const double *data, const long *indptr, const double *x, double *y,
+               const long nrow) {
+    long nthread = get_num_threads();
+    long chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    }
+    // split the lower triangle into chunks with equal numbers of nonzero elements
+    long nnz = indptr[nrow];
+    Vector<long> v_rows(nthread + 1);
+    Vector<AlignedVector<double>> v_y(nthread);
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0; i < nthread; ++i)
+        v_rows[i] =
+            std::lower_bound(indptr, indptr + nrow, end_chunk_idx(i, nthread, nnz)) - indptr;
+    v_rows[nthread] = nrow;
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&spmv_symm_thread<Reader>, reader, data, indptr, x, y,
+                               std::ref(v_y[i]), v_rows[i], v_rows[i + 1]);
+    for (auto &thread : v_threads)
+        thread.join();
+    // add the buffered transposed elements to y
+    v_threads.clear();
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&spmv_symm_reduce_thread, std::cref(v_y), y,
+                               end_chunk_idx(i, nthread, nrow),
+                               std::min(end_chunk_idx(i + 1, nthread, nrow), nrow));
+    for (auto &thread : v_threads)
+        thread.join();
+}
+
+template<class Reader>
+void spmv(Reader reader, const double *data, const long *indptr, const double *x, double *y,
+          const long nrow, const bool symmetric) {
+    if (symmetric)
+        return spmv_symm(reader, data, indptr, x, y, nrow);
+    long nthread = get_num_threads();
+    long chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    }
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&spmv_thread<Reader>, reader, data, indptr, x, y,
+                               end_chunk_idx(i, nthread, nrow),
+                               std::min(end_chunk_idx(i + 1, nthread, nrow), nrow));
+    for (auto &thread : v_threads)
+        thread.join();
+}
+
+template<class Reader>
+void decode_indices(Reader reader, const long *indptr, long *indices, const long nrow) {
+    for (long i = 0; i < nrow; ++i) {
+        reader.seek(i);
+        for (long j = indptr[i]; j < indptr[i + 1]; ++j)
+            indices[j] = reader.next();
+    }
+}
+
+/* Excitation descriptors: the annihilated (p, r) and created (q, s) orbitals of the excitation
+ * from a row determinant to a column determinant, packed into four 16-bit fields. Spin-down
+ * orbitals of FullCI determinants are offset by nbasis. Every field of a diagonal element's
+ * descriptor is empty. */
+
+constexpr long NOEXC = 0xFFFF;
+
+constexpr ulong DIAGEXC = ~0UL;
+
+inline long excitation_orb(const ulong exc, const int field) {
+    return static_cast<long>((exc >> (16 * field)) & NOEXC);
+}
+
+ulong pack_excitation(const long nword, const long nspin, const long nbasis, const ulong *rdet,
+                      const ulong *cdet) {
+    ulong orbs[4] = {NOEXC, NOEXC, NOEXC, NOEXC}, word;
+    long nhole = 0, npart = 0;
+    for (long i = 0, offset; i < nword * nspin; ++i) {
+        offset = (i % nword) * Size<ulong>() + (i / nword) * nbasis;
+        for (word = rdet[i] & ~cdet[i]; word && nhole < 2; word &= word - 1)
+            orbs[2 * nhole++] = offset + Ctz(word);
+        for (word = cdet[i] & ~rdet[i]; word && npart < 2; word &= word - 1)
+            orbs[2 * npart++ + 1] = offset + Ctz(word);
+    }
+    return orbs[0] | (orbs[1] << 16) | (orbs[2] << 32) | (orbs[3] << 48);
+}
+
+double matrix_element(const SQuantOp &ham, const DOCIWfn &wfn, const ulong *, const long *occs,
+                      const ulong exc) {
+    long n1 = wfn.nbasis, p = excitation_orb(exc, 0);
+    if (p != NOEXC)
+        return ham.v[p * n1 + excitation_orb(exc, 1)];
+    double val1 = 0.0, val2 = 0.0;
+    for (long i = 0, j, k; i < wfn.nocc_up; ++i) {
+        k = occs[i];
+        val1 += ham.v[k * (n1 + 1)];
+        val2 += ham.h[k];
+        for (j = i + 1; j < wfn.nocc_up; ++j)
+            val2 += ham.w[k * n1 + occs[j]];
+    }
+    return val1 + val2 * 2;
+}
+
+double matrix_element(const SQuantOp &ham, const FullCIWfn &wfn, const ulong *rdet_up,
+                      const long *occs_up, const ulong exc) {
+    long n1 = wfn.nbasis, n2 = n1 * n1, n3 = n1 * n2;
+    long p = excitation_orb(exc, 0), q = excitation_orb(exc, 1);
+    long r = excitation_orb(exc, 2), s = excitation_orb(exc, 3);
+    const ulong *rdet_dn = rdet_up + wfn.nword;
+    const long *occs_dn = occs_up + wfn.nocc_up;
+    double val = 0.0;
+    if (p == NOEXC) {
+        // diagonal element
+        return diag_det(ham, wfn.nocc_up, occs_up, wfn.nocc_dn, occs_dn);
+    } else if (r == NOEXC && p < n1) {
+        // 1-0 excitation element
+        val = ham.one_mo[n1 * p + q];
+        for (long k = 0, kk, koffset; k < wfn.nocc_up; ++k) {
+            kk = occs_up[k];
+            koffset = n3 * p + n2 * kk;
+            val += ham.two_mo[koffset + n1 * q + kk] - ham.two_mo[koffset + n1 * kk + q];
+        }
+        for (long k = 0, kk; k < wfn.nocc_dn; ++k) {
+            kk = occs_dn[k];
+            val += ham.two_mo[n3 * p + n2 * kk + n1 * q + kk];
+        }
+        return phase_single_det(wfn.nword, p, q, rdet_up) * val;
+    } else if (r == NOEXC) {
+        // 0-1 excitation element
+        p -= n1;
+        q -= n1;
+        val = ham.one_mo[n1 * p + q];
+        for (long k = 0, kk; k < wfn.nocc_up; ++k) {
+            kk = occs_up[k];
+            val += ham.two_mo[n3 * p + n2 * kk + n1 * q + kk];
+        }
+        for (long k = 0, kk, koffset; k < wfn.nocc_dn; ++k) {
+            kk = occs_dn[k];
+            koffset = n3 * p + n2 * kk;
+            val += ham.two_mo[koffset + n1 * q + kk] - ham.two_mo[koffset + n1 * kk + q];
+        }
+        return phase_single_det(wfn.nword, p, q, rdet_dn) * val;
+    } else if (r < n1) {
+        // 2-0 excitation element
+        return phase_double_det(wfn.nword, p, r, q, s, rdet_up) *
+               (ham.two_mo[n3 * p + n2 * r + n1 * q + s] -
+                ham.two_mo[n3 * p + n2 * r + n1 * s + q]);
+    } else if (p >= n1) {
+        // 0-2 excitation element
+        p -= n1;
+        q -= n1;
+        r -= n1;
+        s -= n1;
+        return phase_double_det(wfn.nword, p, r, q, s, rdet_dn) *
+               (ham.two_mo[n3 * p + n2 * r + n1 * q + s] -
+                ham.two_mo[n3 * p + n2 * r + n1 * s + q]);
+    }
+    // 1-1 excitation element
+    r -= n1;
+    s -= n1;
+    return phase_single_det(wfn.nword, p, q, rdet_up) *
+           phase_single_det(wfn.nword, r, s, rdet_dn) * ham.two_mo[n3 * p + n2 * r + n1 * q + s];
+}
+
+double matrix_element(const SQuantOp &ham, const GenCIWfn &wfn, const ulong *rdet,
+                      const long *occs, const ulong exc) {
+    long n1 = wfn.nbasis, n2 = n1 * n1, n3 = n1 * n2;
+    long p = excitation_orb(exc, 0), q = excitation_orb(exc, 1);
+    long r = excitation_orb(exc, 2), s = excitation_orb(exc, 3);
+    double val = 0.0;
+    if (p == NOEXC) {
+        // diagonal element
+        return diag_det(ham, wfn.nocc, occs, 0, nullptr);
+    } else if (r == NOEXC) {
+        // single excitation element
+        val = ham.one_mo[n1 * p + q];
+        for (long k = 0, kk, koffset; k < wfn.nocc; ++k) {
+            kk = occs[k];
+            koffset = n3 * p + n2 * kk;
+            val += ham.two_mo[koffset + n1 * q + kk] - ham.two_mo[koffset + n1 * kk + q];
+        }
+        return phase_single_det(wfn.nword, p, q, rdet) * val;
+    }
+    // double excitation element
+    return phase_double_det(wfn.nword, p, r, q, s, rdet) *
+           (ham.two_mo[n3 * p + n2 * r + n1 * q + s] - ham.two_mo[n3 * p + n2 * r + n1 * s + q]);
+}
+
+void init_sigma(FullCISigma &sigma, const SQuantOp &, const OneSpinWfn &, const long, const long) {
+    sigma = FullCISigma();
+}
+
+void init_sigma(FullCISigma &sigma, const SQuantOp &ham, const FullCIWfn &wfn, const long rows,
+                const long cols) {
+    // the string-factorized sigma engine handles square FullCI operators
+    sigma = (rows == cols) ? FullCISigma(ham, wfn, rows) : FullCISigma();
+}
+
+class SparseOpProd {
+public:
+    typedef double Scalar;
+
+    explicit SparseOpProd(const SparseOp &op_) : op(op_) {
+    }
+
+    long rows(void) const {
+        return op.nrow;
+    }
+
+    long cols(void) const {
+        return op.ncol;
+    }
+
+    void perform_op(const double *x, double *y) const {
+        op.perform_op(x, y);
+    }
+
+private:
+    const SparseOp &op;
+};
+
 } // namespace
 
 SparseOp::SparseOp(const SparseOp &op)
-    : nrow(op.nrow), ncol(op.ncol), size(op.size), ecore(op.ecore), symmetric(op.symmetric),
-      shape(op.shape), data(op.data), indices(op.indices), indptr(op.indptr) {
+    : nrow(op.nrow), ncol(op.ncol), size(op.size), compact(op.compact), ndrop(op.ndrop),
+      ecore(op.ecore), droptol(op.droptol), symmetric(op.symmetric), direct(op.direct),
+      exact(op.exact), shape(op.shape), data(op.data),
+      indices(op.indices), indptr(op.indptr), byteptr(op.byteptr), cindices(op.cindices),
+      bytes(op.bytes), excitations(op.excitations), ham_ptr(op.ham_ptr), wfn_ptr(op.wfn_ptr),
+      wfn_generation(op.wfn_generation), nview(0), ham_ref(op.ham_ref), wfn_ref(op.wfn_ref),
+      direct_thread(op.direct_thread), diagonal_thread(op.diagonal_thread),
+      direct_element(op.direct_element),
+      refill_thread(op.refill_thread), sigma(op.sigma) {
 }
 
 SparseOp::SparseOp(SparseOp &&op) noexcept
     : nrow(std::exchange(op.nrow, 0)), ncol(std::exchange(op.ncol, 0)),
-      size(std::exchange(op.size, 0)), ecore(std::exchange(op.ecore, 0.0)),
-      symmetric(std::exchange(op.symmetric, 0)), shape(std::move(op.shape)),
-      data(std::move(op.data)), indices(std::move(op.indices)), indptr(std::move(op.indptr)) {
+      size(std::exchange(op.size, 0)), compact(std::exchange(op.compact, 0)),
+      ndrop(std::exchange(op.ndrop, 0)), ecore(std::exchange(op.ecore, 0.0)),
+      droptol(std::exchange(op.droptol, 0.0)), symmetric(std::exchange(op.symmetric, 0)),
+      direct(std::exchange(op.direct, 0)), exact(std::exchange(op.exact, 0)),
+      shape(std::move(op.shape)), data(std::move(op.data)), indices(std::move(op.indices)),
+      indptr(std::move(op.indptr)),
+      byteptr(std::move(op.byteptr)), cindices(std::move(op.cindices)),
+      bytes(std::move(op.bytes)), excitations(std::move(op.excitations)),
+      ham_ptr(std::exchange(op.ham_ptr, nullptr)), wfn_ptr(std::exchange(op.wfn_ptr, nullptr)),
+      wfn_generation(std::exchange(op.wfn_generation, 0)), nview(0),
+      ham_ref(std::move(op.ham_ref)), wfn_ref(std::move(op.wfn_ref)),
+      direct_thread(std::exchange(op.direct_thread, nullptr)),
+      diagonal_thread(std::exchange(op.diagonal_thread, nullptr)),
+      direct_element(std::exchange(op.direct_element, nullptr)),
+      refill_thread(std::exchange(op.refill_thread, nullptr)), sigma(std::move(op.sigma)) {
 }
 
 SparseOp::SparseOp(const long rows, const long cols, const bool symm)
-    : nrow(rows), ncol(cols), size(0), ecore(0.0), symmetric(symm) {
+    : nrow(rows), ncol(cols), size(0), compact(0), ndrop(0), ecore(0.0), droptol(0.0),
+      symmetric(symm), direct(false), exact(false), ham_ptr(nullptr), wfn_ptr(nullptr),
+      wfn_generation(0), nview(0), direct_thread(nullptr),
+      diagonal_thread(nullptr), direct_element(nullptr), refill_thread(nullptr) {
     shape = pybind11::make_tuple(pybind11::cast(nrow), pybind11::cast(ncol));
     append<long>(indptr, 0);
 }
 
 SparseOp::SparseOp(const SQuantOp &ham, const DOCIWfn &wfn, const long rows, const long cols,
-                   const bool symm)
+                   const bool symm, const bool drct, const pybind11::object cmpct,
+                   const bool exct, const double tol)
     : nrow((rows > -1) ? rows : wfn.ndet), ncol((cols > -1) ? cols : wfn.ndet), size(0),
-      ecore(ham.ecore), symmetric(symm) {
+      compact(compact_mode(cmpct)), ndrop(0), ecore(ham.ecore), droptol(tol), symmetric(symm),
+      direct(drct), exact(exct), nview(0) {
     append<long>(indptr, 0);
     update<DOCIWfn>(ham, wfn, nrow, ncol, 0);
 }
 
 SparseOp::SparseOp(const SQuantOp &ham, const FullCIWfn &wfn, const long rows, const long cols,
-                   const bool symm)
+                   const bool symm, const bool drct, const pybind11::object cmpct,
+                   const bool exct, const double tol)
     : nrow((rows > -1) ? rows : wfn.ndet), ncol((cols > -1) ? cols : wfn.ndet), size(0),
-      ecore(ham.ecore), symmetric(symm) {
+      compact(compact_mode(cmpct)), ndrop(0), ecore(ham.ecore), droptol(tol), symmetric(symm),
+      direct(drct), exact(exct), nview(0) {
     append<long>(indptr, 0);
     update<FullCIWfn>(ham, wfn, nrow, ncol, 0);
 }
 
 SparseOp::SparseOp(const SQuantOp &ham, const GenCIWfn &wfn, const long rows, const long cols,
-                   const bool symm)
+                   const bool symm, const bool drct, const pybind11::object cmpct,
+                   const bool exct, const double tol)
     : nrow((rows > -1) ? rows : wfn.ndet), ncol((cols > -1) ? cols : wfn.ndet), size(0),
-      ecore(ham.ecore), symmetric(symm) {
+      compact(compact_mode(cmpct)), ndrop(0), ecore(ham.ecore), droptol(tol), symmetric(symm),
+      direct(drct), exact(exct), nview(0) {
     append<long>(indptr, 0);
     update<GenCIWfn>(ham, wfn, nrow, ncol, 0);
 }
 
+long SparseOp::compact_mode(const pybind11::object cmpct) {
+    if (cmpct.is_none())
+        return 0;
+    std::string mode = cmpct.cast<std::string>();
+    if (mode == "uint32")
+        return 1;
+    else if (mode == "varint")
+        return 2;
+    throw std::invalid_argument("compact must be None, 'uint32', or 'varint'");
+}
+
 pybind11::object SparseOp::dtype(void) const {
     return pybind11::dtype::of<double>();
 }
 
+pybind11::object SparseOp::py_compact(void) const {
+    if (compact == 1)
+        return pybind11::cast(std::string("uint32"));
+    else if (compact == 2)
+        return pybind11::cast(std::string("varint"));
+    return pybind11::none();
+}
+
 const double *SparseOp::data_ptr(const long index) const {
     return &data[index];
 }
@@ -87,6 +554,26 @@ const long *SparseOp::indptr_ptr(const long index) const {
 }
 
 double SparseOp::get_element(const long i, const long j) const {
+    if (i < 0 || i >= nrow || j < 0 || j >= ncol)
+        throw std::invalid_argument("element index out of range");
+    else if (direct) {
+        check_wfn();
+        return (this->*direct_element)(i, j);
+    } else if (compact == 1) {
+        const std::uint32_t *start = cindices.data() + indptr[i];
+        const std::uint32_t *end = cindices.data() + indptr[i + 1];
+        const std::uint32_t *e = std::lower_bound(start, end, j);
+        return (e != end && *e == j) ? data[indptr[i] + e - start] : 0.0;
+    } else if (compact == 2) {
+        VarintReader reader(bytes.data(), byteptr.data());
+        reader.seek(i);
+        for (long k = indptr[i], col; k < indptr[i + 1]; ++k) {
+            col = reader.next();
+            if (col >= j)
+                return (col == j) ? data[k] : 0.0;
+        }
+        return 0.0;
+    }
     const long *start = &indices[indptr[i]];
     const long *end = &indices[indptr[i + 1]];
     const long *e = std::lower_bound(start, end, j);
@@ -94,7 +581,11 @@ double SparseOp::get_element(const long i, const long j) const {
 }
 
 void SparseOp::perform_op(const double *x, double *y) const {
-    if (symmetric)
+    if (direct)
+        return perform_op_direct(x, y);
+    else if (compact)
+        return perform_op_compact(x, y);
+    else if (symmetric)
         return perform_op_symm(x, y);
     typedef Eigen::Map<const Eigen::SparseMatrix<double, Eigen::RowMajor, long>> SparseMatrix;
     SparseMatrix mat(nrow, ncol, size, &indptr[0], &indices[0], &data[0], 0);
@@ -104,11 +595,123 @@ void SparseOp::perform_op(const double *x, double *y) const {
 }
 
 void SparseOp::perform_op_symm(const double *x, double *y) const {
-    typedef Eigen::Map<const Eigen::SparseMatrix<double, Eigen::RowMajor, long>> SparseMatrix;
-    SparseMatrix mat(nrow, ncol, size, &indptr[0], &indices[0], &data[0], 0);
-    Eigen::Map<const Eigen::VectorXd> xvec(x, ncol);
-    Eigen::Map<Eigen::VectorXd> yvec(y, nrow);
-    yvec = mat.selfadjointView<Eigen::Lower>() * xvec;
+    spmv_symm(IndexReader<long>(indices.data(), indptr.data()), data.data(), indptr.data(), x, y,
+              nrow);
+}
+
+void SparseOp::perform_op_direct(const double *x, double *y) const {
+    check_wfn();
+    if (sigma.ndet)
+        return sigma.perform_op(x, y);
+    long nthread = get_num_threads();
+    long chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    }
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0, start, end; i < nthread; ++i) {
+        start = end_chunk_idx(i, nthread, nrow);
+        end = std::min(end_chunk_idx(i + 1, nthread, nrow), nrow);
+        v_threads.emplace_back(direct_thread, this, x, y + start, start, end);
+    }
+    for (auto &thread : v_threads)
+        thread.join();
+}
+
+void SparseOp::perform_op_compact(const double *x, double *y) const {
+    if (compact == 1)
+        spmv(IndexReader<std::uint32_t>(cindices.data(), indptr.data()), data.data(),
+             indptr.data(), x, y, nrow, symmetric);
+    else
+        spmv(VarintReader(bytes.data(), byteptr.data()), data.data(), indptr.data(), x, y, nrow,
+             symmetric);
+}
+
+void SparseOp::diagonal(double *d) const {
+    if (direct)
+        check_wfn();
+    if (direct && sigma.ndet)
+        return sigma.diagonal(d);
+    long nthread = get_num_threads();
+    long chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    }
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0, start, end; i < nthread; ++i) {
+        start = end_chunk_idx(i, nthread, nrow);
+        end = std::min(end_chunk_idx(i + 1, nthread, nrow), nrow);
+        v_threads.emplace_back(direct ? diagonal_thread : &SparseOp::diagonal_stored_thread, this,
+                               d + start, start, end);
+    }
+    for (auto &thread : v_threads)
+        thread.join();
+}
+
+void SparseOp::refill(const SQuantOp &ham) {
+    if (wfn_ptr == nullptr)
+        throw std::runtime_error("sparse_op was not built from a wave function");
+    else if (!direct && wfn_ref && wfn_ref().is_none())
+        throw std::runtime_error("the wave function of this sparse_op no longer exists");
+    else if (ham.nbasis != wfn_ptr->nbasis)
+        throw std::invalid_argument("ham and wfn must have the same number of basis functions");
+    // the elements dropped for the old Hamiltonian are not the ones that the new one would drop
+    else if (!direct && droptol > 0)
+        throw std::invalid_argument("cannot refill a sparse_op built with droptol > 0; build a new "
+                                    "sparse_op");
+    check_wfn();
+    check_views();
+    ham_ptr = &ham;
+    ecore = ham.ecore;
+    // a direct operator only needs to point to the new integrals, and holds them in place of the
+    // old ones
+    if (direct) {
+        ham_ref = pybind11::cast(&ham, pybind11::return_value_policy::reference);
+        if (sigma.ndet)
+            init_sigma(sigma, ham, static_cast<const FullCIWfn &>(*wfn_ptr), nrow, ncol);
+        return;
+    } else if (2 * wfn_ptr->nbasis >= NOEXC) {
+        throw std::domain_error("nbasis is too large for excitation descriptors");
+    }
+    // the excitation descriptors of rows added since the last refill are computed first, then
+    // every element is recomputed from its descriptor without any determinant lookups
+    long pstart = std::lower_bound(indptr.begin(), indptr.end(),
+                                   static_cast<long>(excitations.size())) -
+                  indptr.begin();
+    excitations.resize(size);
+    long nthread = get_num_threads();
+    long chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    }
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0, start, end; i < nthread; ++i) {
+        start = end_chunk_idx(i, nthread, nrow);
+        end = std::min(end_chunk_idx(i + 1, nthread, nrow), nrow);
+        v_threads.emplace_back(refill_thread, this, std::ref(ham), start, end, pstart);
+    }
+    for (auto &thread : v_threads)
+        thread.join();
+}
+
+void SparseOp::check_wfn(void) const {
+    // rows and columns refer to the determinants of the wave function by index, which stay valid
+    // while determinants are only appended
+    if (wfn_ptr->generation != wfn_generation || wfn_ptr->ndet < nrow)
+        throw std::runtime_error("the wave function of this sparse_op was modified since it was "
+                                 "built; build a new sparse_op");
+}
+
+void SparseOp::check_views(void) const {
+    // the arrays returned by data, indices and indptr point into the stored matrix
+    if (nview)
+        throw pybind11::buffer_error("cannot modify a sparse_op while views of its arrays exist");
 }
 
 void SparseOp::solve_ci(const long n, const double *coeffs, const long ncv, const long maxiter,
@@ -122,11 +725,9 @@ void SparseOp::solve_ci(const long n, const double *coeffs, const long ncv, cons
         *evecs = 1.0;
         return;
     }
-    typedef Eigen::Map<const Eigen::SparseMatrix<double, Eigen::RowMajor, long>> SparseMatrix;
-    SparseMatrix mat(nrow, ncol, size, &indptr[0], &indices[0], &data[0], 0);
-    Spectra::SparseSymMatProd<double, Eigen::Lower, Eigen::RowMajor, long> op(mat);
-    Spectra::SymEigsSolver<Spectra::SparseSymMatProd<double, Eigen::Lower, Eigen::RowMajor, long>>
-        eigs(op, n, (ncv != -1) ? ncv : std::min(nrow, std::max(n * 2 + 1, 20L)));
+    SparseOpProd op(*this);
+    Spectra::SymEigsSolver<SparseOpProd> eigs(
+        op, n, (ncv != -1) ? ncv : std::min(nrow, std::max(n * 2 + 1, 20L)));
     if (coeffs == nullptr)
         eigs.init();
     else
@@ -158,69 +759,464 @@ Array<double> SparseOp::py_matvec_out(const Array<double> x, Array<double> y) co
     return y;
 }
 
+Array<double> SparseOp::py_diagonal(void) const {
+    Array<double> array(nrow);
+    diagonal(reinterpret_cast<double *>(array.request().ptr));
+    return array;
+}
+
 pybind11::tuple SparseOp::py_solve_ci(const long n, pybind11::object coeffs, const long ncv,
-                                      const long maxiter, const double tol) const {
+                                      const long maxiter, const double tol,
+                                      const std::string &method,
+                                      const std::string &subspace) const {
     Array<double> eigvals(n);
     Array<double> eigvecs({n, nrow});
-    const double *cptr =
-        coeffs.is(pybind11::none())
-            ? nullptr
-            : reinterpret_cast<const double *>(coeffs.cast<Array<double>>().request().ptr);
     double *evals = reinterpret_cast<double *>(eigvals.request().ptr);
     double *evecs = reinterpret_cast<double *>(eigvecs.request().ptr);
-    solve_ci(n, cptr, ncv, maxiter, tol, evals, evecs);
+    const double *cptr = nullptr;
+    long ncoeffs = 0;
+    Array<double> carray;
+    if (!coeffs.is(pybind11::none())) {
+        carray = coeffs.cast<Array<double>>();
+        pybind11::buffer_info buf = carray.request();
+        if ((buf.ndim != 1 && buf.ndim != 2) || buf.shape[buf.ndim - 1] != nrow ||
+            (buf.ndim == 2 && buf.shape[0] < 1))
+            throw std::invalid_argument("c0 must have shape (nrow,) or (k, nrow)");
+        cptr = reinterpret_cast<const double *>(buf.ptr);
+        ncoeffs = (buf.ndim == 2) ? buf.shape[0] : 1;
+    }
+    if (method == "lanczos" && subspace != "double")
+        throw std::invalid_argument("the Lanczos solver only supports a double subspace");
+    else if (method == "lanczos")
+        solve_ci(n, cptr, ncv, maxiter, tol, evals, evecs);
+    else if (method == "davidson")
+        solve_davidson(n, cptr, ncoeffs, ncv, maxiter, tol, subspace, evals, evecs);
+    else
+        throw std::invalid_argument("method must be 'lanczos' or 'davidson'");
     return pybind11::make_tuple(eigvals, eigvecs);
 }
 
 template<class WfnType>
-void SparseOp::py_update(const SQuantOp &ham, const WfnType &wfn) {
+void SparseOp::py_update(const SQuantOp &ham, const WfnType &wfn, const pybind11::object tol) {
+    // the rows already built were dropped with the current tolerance, which the new rows must share
+    if (!tol.is(pybind11::none()) && tol.cast<double>() != droptol)
+        throw std::invalid_argument("droptol must match the tolerance of the rows already built");
+    // the rows already built must still match the wave function that they are extended from
+    if (wfn_ptr == &wfn)
+        check_wfn();
     update<WfnType>(ham, wfn, wfn.ndet, wfn.ndet, nrow);
 }
 
-template void SparseOp::py_update(const SQuantOp &, const DOCIWfn &);
+template void SparseOp::py_update(const SQuantOp &, const DOCIWfn &, const pybind11::object);
+
+template void SparseOp::py_update(const SQuantOp &, const FullCIWfn &, const pybind11::object);
 
-template void SparseOp::py_update(const SQuantOp &, const FullCIWfn &);
+template void SparseOp::py_update(const SQuantOp &, const GenCIWfn &, const pybind11::object);
 
-template void SparseOp::py_update(const SQuantOp &, const GenCIWfn &);
+template<class WfnType>
+void SparseOp::hold(const SQuantOp &ham, const WfnType &wfn) {
+    // a direct operator reads ham and wfn in every product, so it owns references to them; a
+    // stored operator only reads wfn again to refill, so it keeps a weak reference to it
+    pybind11::object wfn_obj = pybind11::cast(&wfn, pybind11::return_value_policy::reference);
+    if (direct) {
+        ham_ref = pybind11::cast(&ham, pybind11::return_value_policy::reference);
+        wfn_ref = wfn_obj;
+    } else {
+        ham_ref = pybind11::object();
+        wfn_ref = pybind11::weakref(wfn_obj);
+    }
+}
 
 template<class WfnType>
 void SparseOp::update(const SQuantOp &ham, const WfnType &wfn, const long rows, const long cols,
                       const long startrow) {
-    AlignedVector<ulong> det(wfn.nword2);
-    AlignedVector<long> occs(wfn.nocc);
-    AlignedVector<long> virs(wfn.nvir);
+    check_views();
     shape = pybind11::make_tuple(pybind11::cast(rows), pybind11::cast(cols));
     nrow = rows;
     ncol = cols;
-    indptr.reserve(nrow + 1);
-    for (long idet = startrow; idet < rows; ++idet) {
-        add_row(ham, wfn, idet, &det[0], &occs[0], &virs[0]);
-        sort_row(idet);
+    ham_ptr = &ham;
+    wfn_ptr = &wfn;
+    wfn_generation = wfn.generation;
+    hold(ham, wfn);
+    direct_thread = &SparseOp::perform_op_direct_thread<WfnType>;
+    diagonal_thread = &SparseOp::diagonal_direct_thread<WfnType>;
+    direct_element = &SparseOp::get_element_direct<WfnType>;
+    refill_thread = &SparseOp::refill_values_thread<WfnType>;
+    // matrix elements of a direct operator are evaluated on the fly in perform_op
+    if (direct) {
+        init_sigma(sigma, ham, wfn, rows, cols);
+        return;
+    } else if (compact == 1 && cols > Max<std::uint32_t>()) {
+        throw std::domain_error("ncol is too large for 32-bit column indices");
+    } else if (droptol < 0) {
+        throw std::invalid_argument("droptol must be >= 0");
+    } else if (exact) {
+        return update_exact<WfnType>(ham, wfn, rows, startrow);
+    }
+    long nthread = get_num_threads(), nrow_new = rows - startrow;
+    long chunksize = nrow_new / nthread + static_cast<bool>(nrow_new % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrow_new / nthread + static_cast<bool>(nrow_new % nthread);
+    }
+    // build a CSR fragment for each chunk of rows in parallel
+    Vector<AlignedVector<double>> v_data(nthread);
+    Vector<AlignedVector<long>> v_indices(nthread);
+    Vector<AlignedVector<long>> v_indptr(nthread);
+    Vector<long> v_rows(nthread + 1), v_ndrop(nthread);
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0; i <= nthread; ++i)
+        v_rows[i] = startrow + std::min(end_chunk_idx(i, nthread, nrow_new), nrow_new);
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&SparseOp::update_thread<WfnType>, this, std::ref(ham), std::ref(wfn),
+                               v_rows[i], v_rows[i + 1], std::ref(v_data[i]),
+                               std::ref(v_indices[i]), std::ref(v_indptr[i]),
+                               std::ref(v_ndrop[i]));
+    for (auto &thread : v_threads)
+        thread.join();
+    ndrop = std::accumulate(v_ndrop.begin(), v_ndrop.end(), ndrop);
+    // stitch the fragments together using a prefix sum over their sizes
+    Vector<long> v_offsets(nthread + 1);
+    v_offsets[0] = data.size();
+    for (long i = 0; i < nthread; ++i)
+        v_offsets[i + 1] = v_offsets[i] + v_indices[i].size();
+    data.resize(v_offsets[nthread]);
+    indptr.resize(rows + 1);
+    v_threads.clear();
+    if (compact == 0) {
+        indices.resize(v_offsets[nthread]);
+        for (long i = 0; i < nthread; ++i)
+            v_threads.emplace_back(&sparseop_copy_thread<long>, std::ref(v_data[i]),
+                                   std::ref(v_indices[i]), std::ref(v_indptr[i]), data.data(),
+                                   indices.data(), indptr.data() + v_rows[i] + 1, v_offsets[i]);
+    } else if (compact == 1) {
+        cindices.resize(v_offsets[nthread]);
+        for (long i = 0; i < nthread; ++i)
+            v_threads.emplace_back(&sparseop_copy_thread<std::uint32_t>, std::ref(v_data[i]),
+                                   std::ref(v_indices[i]), std::ref(v_indptr[i]), data.data(),
+                                   cindices.data(), indptr.data() + v_rows[i] + 1, v_offsets[i]);
+    } else {
+        // the encoded size of each fragment gives its offset in the byte vector
+        Vector<std::future<long>> v_nbyte;
+        Vector<long> v_byte_offsets(nthread + 1);
+        v_nbyte.reserve(nthread);
+        for (long i = 0; i < nthread; ++i)
+            v_nbyte.push_back(std::async(std::launch::async, &sparseop_count_bytes,
+                                         std::cref(v_indices[i]), std::cref(v_indptr[i])));
+        byteptr.resize(rows + 1);
+        v_byte_offsets[0] = byteptr[startrow];
+        for (long i = 0; i < nthread; ++i)
+            v_byte_offsets[i + 1] = v_byte_offsets[i] + v_nbyte[i].get();
+        bytes.resize(v_byte_offsets[nthread]);
+        for (long i = 0; i < nthread; ++i)
+            v_threads.emplace_back(&sparseop_encode_thread, std::ref(v_data[i]),
+                                   std::ref(v_indices[i]), std::ref(v_indptr[i]), data.data(),
+                                   bytes.data(), indptr.data() + v_rows[i] + 1,
+                                   byteptr.data() + v_rows[i] + 1, v_offsets[i],
+                                   v_byte_offsets[i]);
+    }
+    for (auto &thread : v_threads)
+        thread.join();
+    size = data.size();
+}
+
+template<class WfnType>
+void SparseOp::update_exact(const SQuantOp &ham, const WfnType &wfn, const long rows,
+                            const long startrow) {
+    // count the nonzero elements (and encoded bytes) of each new row, so that the matrix is
+    // allocated once and filled in place
+    indptr.resize(rows + 1);
+    if (compact == 2)
+        byteptr.resize(rows + 1);
+    ndrop += count_rows(ham, wfn, startrow, rows, indptr.data() + startrow + 1,
+                        (compact == 2) ? byteptr.data() + startrow + 1 : nullptr);
+    for (long i = startrow; i < rows; ++i)
+        indptr[i + 1] += indptr[i];
+    data.resize(indptr[rows]);
+    if (compact == 0) {
+        indices.resize(indptr[rows]);
+    } else if (compact == 1) {
+        cindices.resize(indptr[rows]);
+    } else {
+        for (long i = startrow; i < rows; ++i)
+            byteptr[i + 1] += byteptr[i];
+        bytes.resize(byteptr[rows]);
+    }
+    long nthread = get_num_threads(), nrow_new = rows - startrow;
+    long chunksize = nrow_new / nthread + static_cast<bool>(nrow_new % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrow_new / nthread + static_cast<bool>(nrow_new % nthread);
+    }
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0, start, end; i < nthread; ++i) {
+        start = startrow + end_chunk_idx(i, nthread, nrow_new);
+        end = startrow + std::min(end_chunk_idx(i + 1, nthread, nrow_new), nrow_new);
+        v_threads.emplace_back(&SparseOp::fill_thread<WfnType>, this, std::ref(ham), std::ref(wfn),
+                               start, end);
+    }
+    for (auto &thread : v_threads)
+        thread.join();
+    size = data.size();
+}
+
+template<class WfnType>
+long SparseOp::count_rows(const SQuantOp &ham, const WfnType &wfn, const long start,
+                          const long end, long *nnz, long *nbyte) const {
+    long nthread = get_num_threads(), n = end - start;
+    long chunksize = n / nthread + static_cast<bool>(n % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = n / nthread + static_cast<bool>(n % nthread);
+    }
+    Vector<long> v_ndrop(nthread);
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0, istart, iend; i < nthread; ++i) {
+        istart = end_chunk_idx(i, nthread, n);
+        iend = std::min(end_chunk_idx(i + 1, nthread, n), n);
+        v_threads.emplace_back(&SparseOp::count_thread<WfnType>, this, std::ref(ham), std::ref(wfn),
+                               start + istart, start + iend, nnz + istart,
+                               (nbyte != nullptr) ? nbyte + istart : nullptr,
+                               std::ref(v_ndrop[i]));
+    }
+    for (auto &thread : v_threads)
+        thread.join();
+    return std::accumulate(v_ndrop.begin(), v_ndrop.end(), 0L);
+}
+
+template<class WfnType>
+long SparseOp::py_count_nnz(const SQuantOp &ham, const WfnType &wfn, const long rows,
+                            const long cols, const bool symm, const double tol) {
+    SparseOp op((rows > -1) ? rows : wfn.ndet, (cols > -1) ? cols : wfn.ndet, symm);
+    op.droptol = tol;
+    AlignedVector<long> nnz(op.nrow);
+    op.count_rows(ham, wfn, 0, op.nrow, nnz.data());
+    return std::accumulate(nnz.begin(), nnz.end(), 0L);
+}
+
+template long SparseOp::py_count_nnz(const SQuantOp &, const DOCIWfn &, const long, const long,
+                                     const bool, const double);
+
+template long SparseOp::py_count_nnz(const SQuantOp &, const FullCIWfn &, const long, const long,
+                                     const bool, const double);
+
+template long SparseOp::py_count_nnz(const SQuantOp &, const GenCIWfn &, const long, const long,
+                                     const bool, const double);
+
+template<class WfnType>
+void SparseOp::count_thread(const SQuantOp &ham, const WfnType &wfn, const long start,
+                            const long end, long *nnz, long *nbyte, long &t_ndrop) const {
+    AlignedVector<ulong> det(wfn.nword2);
+    AlignedVector<long> occs(wfn.nocc);
+    AlignedVector<long> virs(wfn.nvir);
+    AlignedVector<ulong> t_dets(wfn.nvir * wfn.nword2);
+    AlignedVector<long> t_jdets(2 * wfn.nvir);
+    AlignedVector<double> t_data;
+    AlignedVector<long> t_indices, t_indptr;
+    for (long idet = start; idet < end; ++idet) {
+        t_indices.clear();
+        t_indptr.clear();
+        // the values are only needed to decide which elements are dropped
+        if (droptol > 0) {
+            t_data.clear();
+            add_row(ham, wfn, idet, &det[0], &occs[0], &virs[0], &t_dets[0], &t_jdets[0], t_data, t_indices, t_indptr);
+            t_ndrop += drop_elements(t_data, t_indices, t_indptr, 0, idet, droptol);
+        } else {
+            add_row_indices(wfn, idet, &det[0], &occs[0], &virs[0], &t_dets[0], &t_jdets[0], t_indices);
+            append<long>(t_indptr, t_indices.size());
+        }
+        nnz[idet - start] = t_indices.size();
+        if (nbyte != nullptr) {
+            std::sort(t_indices.begin(), t_indices.end());
+            nbyte[idet - start] = sparseop_count_bytes(t_indices, t_indptr);
+        }
+    }
+}
+
+template<class WfnType>
+void SparseOp::fill_thread(const SQuantOp &ham, const WfnType &wfn, const long start,
+                           const long end) {
+    AlignedVector<ulong> det(wfn.nword2);
+    AlignedVector<long> occs(wfn.nocc);
+    AlignedVector<long> virs(wfn.nvir);
+    AlignedVector<ulong> t_dets(wfn.nvir * wfn.nword2);
+    AlignedVector<long> t_jdets(2 * wfn.nvir);
+    AlignedVector<double> t_data;
+    AlignedVector<long> t_indices, t_indptr;
+    for (long idet = start; idet < end; ++idet) {
+        t_data.clear();
+        t_indices.clear();
+        t_indptr.clear();
+        add_row(ham, wfn, idet, &det[0], &occs[0], &virs[0], &t_dets[0], &t_jdets[0], t_data, t_indices, t_indptr);
+        if (droptol > 0)
+            drop_elements(t_data, t_indices, t_indptr, 0, idet, droptol);
+        sort_row(t_data.data(), t_indices.data(), 0, t_indices.size());
+        std::copy(t_data.begin(), t_data.end(), data.begin() + indptr[idet]);
+        if (compact == 0) {
+            std::copy(t_indices.begin(), t_indices.end(), indices.begin() + indptr[idet]);
+        } else if (compact == 1) {
+            std::copy(t_indices.begin(), t_indices.end(), cindices.begin() + indptr[idet]);
+        } else {
+            std::uint8_t *p = bytes.data() + byteptr[idet];
+            for (std::size_t j = 0, prev = 0; j < t_indices.size(); prev = t_indices[j++])
+                encode_varint(t_indices[j] - prev, p);
+        }
+    }
+}
+
+template<class WfnType>
+void SparseOp::update_thread(const SQuantOp &ham, const WfnType &wfn, const long start,
+                             const long end, AlignedVector<double> &t_data,
+                             AlignedVector<long> &t_indices, AlignedVector<long> &t_indptr,
+                             long &t_ndrop) const {
+    AlignedVector<ulong> det(wfn.nword2);
+    AlignedVector<long> occs(wfn.nocc);
+    AlignedVector<long> virs(wfn.nvir);
+    AlignedVector<ulong> t_dets(wfn.nvir * wfn.nword2);
+    AlignedVector<long> t_jdets(2 * wfn.nvir);
+    t_indptr.reserve(end - start);
+    for (long idet = start, jstart = 0; idet < end; ++idet) {
+        add_row(ham, wfn, idet, &det[0], &occs[0], &virs[0], &t_dets[0], &t_jdets[0], t_data, t_indices, t_indptr);
+        if (droptol > 0)
+            t_ndrop += drop_elements(t_data, t_indices, t_indptr, jstart, idet, droptol);
+        sort_row(t_data.data(), t_indices.data(), jstart, t_indptr.back());
+        jstart = t_indptr.back();
+    }
+}
+
+template<class WfnType>
+void SparseOp::perform_op_direct_thread(const double *x, double *y, const long start,
+                                        const long end) const {
+    const WfnType &wfn = static_cast<const WfnType &>(*wfn_ptr);
+    AlignedVector<ulong> det(wfn.nword2);
+    AlignedVector<long> occs(wfn.nocc);
+    AlignedVector<long> virs(wfn.nvir);
+    AlignedVector<ulong> t_dets(wfn.nvir * wfn.nword2);
+    AlignedVector<long> t_jdets(2 * wfn.nvir);
+    AlignedVector<double> t_data;
+    AlignedVector<long> t_indices, t_indptr;
+    double val;
+    for (long idet = start; idet < end; ++idet) {
+        t_data.clear();
+        t_indices.clear();
+        t_indptr.clear();
+        add_row(*ham_ptr, wfn, idet, &det[0], &occs[0], &virs[0], &t_dets[0], &t_jdets[0], t_data, t_indices, t_indptr);
+        val = 0.0;
+        for (std::size_t j = 0; j < t_indices.size(); ++j)
+            val += t_data[j] * x[t_indices[j]];
+        y[idet - start] = val;
+    }
+}
+
+template<class WfnType>
+double SparseOp::get_element_direct(const long i, const long j) const {
+    // build row i as a direct product does, and search it for column j
+    const WfnType &wfn = static_cast<const WfnType &>(*wfn_ptr);
+    AlignedVector<ulong> det(wfn.nword2);
+    AlignedVector<long> occs(wfn.nocc);
+    AlignedVector<long> virs(wfn.nvir);
+    AlignedVector<ulong> t_dets(wfn.nvir * wfn.nword2);
+    AlignedVector<long> t_jdets(2 * wfn.nvir);
+    AlignedVector<double> t_data;
+    AlignedVector<long> t_indices, t_indptr;
+    add_row(*ham_ptr, wfn, i, &det[0], &occs[0], &virs[0], &t_dets[0], &t_jdets[0], t_data,
+            t_indices, t_indptr);
+    for (std::size_t k = 0; k < t_indices.size(); ++k)
+        if (t_indices[k] == j)
+            return t_data[k];
+    return 0.0;
+}
+
+void SparseOp::diagonal_stored_thread(double *d, const long start, const long end) const {
+    for (long i = start; i < end; ++i)
+        d[i - start] = (i < ncol) ? get_element(i, i) : 0.0;
+}
+
+template<class WfnType>
+void SparseOp::diagonal_direct_thread(double *d, const long start, const long end) const {
+    const WfnType &wfn = static_cast<const WfnType &>(*wfn_ptr);
+    const long nspin = std::is_same<WfnType, FullCIWfn>::value ? 2 : 1;
+    AlignedVector<long> occs(wfn.nocc);
+    const ulong *rdet;
+    for (long idet = start; idet < end; ++idet) {
+        if (idet >= ncol) {
+            d[idet - start] = 0.0;
+            continue;
+        }
+        rdet = wfn.det_ptr(idet);
+        fill_occs(wfn.nword, rdet, &occs[0]);
+        if (nspin == 2)
+            fill_occs(wfn.nword, rdet + wfn.nword, &occs[wfn.nocc_up]);
+        d[idet - start] = matrix_element(*ham_ptr, wfn, rdet, &occs[0], DIAGEXC);
+    }
+}
+
+template<class WfnType>
+void SparseOp::refill_values_thread(const SQuantOp &ham, const long start, const long end,
+                                    const long pstart) {
+    const WfnType &wfn = static_cast<const WfnType &>(*wfn_ptr);
+    const long nspin = std::is_same<WfnType, FullCIWfn>::value ? 2 : 1;
+    AlignedVector<long> occs(wfn.nocc), cols;
+    const ulong *rdet;
+    for (long idet = start; idet < end; ++idet) {
+        rdet = wfn.det_ptr(idet);
+        if (idet >= pstart) {
+            cols.resize(indptr[idet + 1] - indptr[idet]);
+            decode_row(idet, cols.data());
+            for (std::size_t j = 0; j < cols.size(); ++j)
+                excitations[indptr[idet] + j] =
+                    pack_excitation(wfn.nword, nspin, wfn.nbasis, rdet, wfn.det_ptr(cols[j]));
+        }
+        fill_occs(wfn.nword, rdet, &occs[0]);
+        if (nspin == 2)
+            fill_occs(wfn.nword, rdet + wfn.nword, &occs[wfn.nocc_up]);
+        for (long j = indptr[idet]; j < indptr[idet + 1]; ++j)
+            data[j] = matrix_element(ham, wfn, rdet, &occs[0], excitations[j]);
+    }
+}
+
+void SparseOp::decode_row(const long row, long *cols) const {
+    if (compact == 0) {
+        std::copy(&indices[indptr[row]], &indices[indptr[row + 1]], cols);
+        return;
+    } else if (compact == 1) {
+        std::copy(&cindices[indptr[row]], &cindices[indptr[row + 1]], cols);
+        return;
     }
-    size = indices.size();
+    VarintReader reader(bytes.data(), byteptr.data());
+    reader.seek(row);
+    for (long j = indptr[row]; j < indptr[row + 1]; ++j)
+        *cols++ = reader.next();
 }
 
 void SparseOp::reserve(const long n) {
-    indices.reserve(n);
+    check_views();
+    if (compact == 0)
+        indices.reserve(n);
+    else if (compact == 1)
+        cindices.reserve(n);
     data.reserve(n);
 }
 
 void SparseOp::squeeze(void) {
+    check_views();
     indptr.shrink_to_fit();
     indices.shrink_to_fit();
+    byteptr.shrink_to_fit();
+    cindices.shrink_to_fit();
+    bytes.shrink_to_fit();
+    excitations.shrink_to_fit();
     data.shrink_to_fit();
 }
 
-void SparseOp::sort_row(const long idet) {
-    typedef std::sort_with_arg::value_iterator_t<double, long> iter;
-    long start = indptr[idet], end = indptr[idet + 1];
-    std::sort(iter(&data[start], &indices[start]), iter(&data[end], &indices[end]));
-}
-
 void SparseOp::add_row(const SQuantOp &ham, const DOCIWfn &wfn, const long idet, ulong *det, long *occs,
-                       long *virs) {
+                       long *virs, ulong *t_dets, long *t_jdets, AlignedVector<double> &t_data,
+                       AlignedVector<long> &t_indices, AlignedVector<long> &t_indptr) const {
     /* long i, j, k, l, jdet, jmin = symmetric ? idet - 1 : -1; */
-    long  jdet, jmin = symmetric ? idet : Max<long>();
+    long  jdet, jmin = (symmetric && !direct) ? idet : Max<long>();
     double val1 = 0.0, val2 = 0.0;
     wfn.copy_det(idet, det);
     fill_occs(wfn.nword, det, occs);
@@ -233,43 +1229,48 @@ void SparseOp::add_row(const SQuantOp &ham, const DOCIWfn &wfn, const long idet,
         val2 += ham.h[k];
         for (j = i + 1; j < wfn.nocc_up; ++j)
             val2 += ham.w[k * wfn.nbasis + occs[j]];
+        // look up the single/"pair"-excited determinants
+        index_excited_dets(wfn, wfn.nword, det, 0, k, virs, wfn.nvir_up, t_dets,
+                           t_jdets);
         // loop over virtual indices
         for (j = 0; j < wfn.nvir_up; ++j) {
             // compute single/"pair"-excited elements
             l = virs[j];
-            excite_det(k, l, det);
-            jdet = wfn.index_det(det);
+            jdet = t_jdets[j];
             // check if excited determinant is in wfn
             if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
                 // add single/"pair"-excited matrix element
-                append<double>(data, ham.v[k * wfn.nbasis + l]);
-                append<long>(indices, jdet);
+                append<double>(t_data, ham.v[k * wfn.nbasis + l]);
+                append<long>(t_indices, jdet);
             }
-            excite_det(l, k, det);
         }
     }
     // add diagonal element to matrix
     if (idet < ncol) {
-        append<double>(data, val1 + val2 * 2);
-        append<long>(indices, idet);
+        append<double>(t_data, val1 + val2 * 2);
+        append<long>(t_indices, idet);
     }
     // add pointer to next row's indices
-    append<long>(indptr, indices.size());
+    append<long>(t_indptr, t_indices.size());
 }
 
 void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long idet, ulong *det_up,
-                       long *occs_up, long *virs_up) {
-    long i, j, k, l, ii, jj, kk, ll, jdet, jmin = symmetric ? idet : Max<long>();
+                       long *occs_up, long *virs_up, ulong *t_dets, long *t_jdets,
+                       AlignedVector<double> &t_data, AlignedVector<long> &t_indices,
+                       AlignedVector<long> &t_indptr) const {
+    long i, j, k, l, ii, jj, kk, ll, jdet, jmin = (symmetric && !direct) ? idet : Max<long>();
     long ioffset, koffset, sign_up;
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
     long n3 = n1 * n2;
-    double val1, val2 = 0.0;
+    double val1;
     const ulong *rdet_up = wfn.det_ptr(idet);
     const ulong *rdet_dn = rdet_up + wfn.nword;
     ulong *det_dn = det_up + wfn.nword;
     long *occs_dn = occs_up + wfn.nocc_up;
     long *virs_dn = virs_up + wfn.nvir_up;
+    // the single excitations are kept in the second half of t_jdets while the doubles are looked up
+    long *s_jdets = t_jdets + wfn.nvir;
     std::memcpy(det_up, rdet_up, sizeof(ulong) * wfn.nword2);
     fill_occs(wfn.nword, rdet_up, occs_up);
     fill_occs(wfn.nword, rdet_dn, occs_dn);
@@ -279,24 +1280,16 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
     for (i = 0; i < wfn.nocc_up; ++i) {
         ii = occs_up[i];
         ioffset = n3 * ii;
-        // compute part of diagonal matrix element
-        val2 += ham.one_mo[(n1 + 1) * ii];
-        for (k = i + 1; k < wfn.nocc_up; ++k) {
-            kk = occs_up[k];
-            koffset = ioffset + n2 * kk;
-            val2 += ham.two_mo[koffset + n1 * ii + kk] - ham.two_mo[koffset + n1 * kk + ii];
-        }
-        for (k = 0; k < wfn.nocc_dn; ++k) {
-            kk = occs_dn[k];
-            val2 += ham.two_mo[ioffset + n2 * kk + n1 * ii + kk];
-        }
+        // look up the 1-0 excited determinants
+        index_excited_dets(wfn, wfn.nword2, det_up, 0, ii, virs_up, wfn.nvir_up, t_dets,
+                           s_jdets);
         // loop over spin-up virtual indices
         for (j = 0; j < wfn.nvir_up; ++j) {
             jj = virs_up[j];
             // 1-0 excitation elements
             excite_det(ii, jj, det_up);
             sign_up = phase_single_det(wfn.nword, ii, jj, rdet_up);
-            jdet = wfn.index_det(det_up);
+            jdet = s_jdets[j];
             // check if 1-0 excited determinant is in wfn
             if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
                 // compute 1-0 matrix element
@@ -311,49 +1304,51 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
                     val1 += ham.two_mo[ioffset + n2 * kk + n1 * jj + kk];
                 }
                 // add 1-0 matrix element
-                append<double>(data, sign_up * val1);
-                append<long>(indices, jdet);
+                append<double>(t_data, sign_up * val1);
+                append<long>(t_indices, jdet);
             }
             // loop over spin-down occupied indices
             for (k = 0; k < wfn.nocc_dn; ++k) {
                 kk = occs_dn[k];
                 koffset = ioffset + n2 * kk;
+                // look up the 1-1 excited determinants
+                index_excited_dets(wfn, wfn.nword2, det_up, wfn.nword, kk, virs_dn, wfn.nvir_dn,
+                                   t_dets, t_jdets);
                 // loop over spin-down virtual indices
                 for (l = 0; l < wfn.nvir_dn; ++l) {
                     ll = virs_dn[l];
                     // 1-1 excitation elements
-                    excite_det(kk, ll, det_dn);
-                    jdet = wfn.index_det(det_up);
+                    jdet = t_jdets[l];
                     // check if 1-1 excited determinant is in wfn
                     if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
                         // add 1-1 matrix element
-                        append<double>(data, sign_up *
+                        append<double>(t_data, sign_up *
                                                  phase_single_det(wfn.nword, kk, ll, rdet_dn) *
                                                  ham.two_mo[koffset + n1 * jj + ll]);
-                        append<long>(indices, jdet);
+                        append<long>(t_indices, jdet);
                     }
-                    excite_det(ll, kk, det_dn);
                 }
             }
             // loop over spin-up occupied indices
             for (k = i + 1; k < wfn.nocc_up; ++k) {
                 kk = occs_up[k];
                 koffset = ioffset + n2 * kk;
+                // look up the 2-0 excited determinants
+                index_excited_dets(wfn, wfn.nword2, det_up, 0, kk, virs_up + j + 1,
+                                   wfn.nvir_up - j - 1, t_dets, t_jdets);
                 // loop over spin-up virtual indices
                 for (l = j + 1; l < wfn.nvir_up; ++l) {
                     ll = virs_up[l];
                     // 2-0 excitation elements
-                    excite_det(kk, ll, det_up);
-                    jdet = wfn.index_det(det_up);
+                    jdet = t_jdets[l - j - 1];
                     // check if 2-0 excited determinant is in wfn
                     if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
                         // add 2-0 matrix element
-                        append<double>(data, phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_up) *
+                        append<double>(t_data, phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_up) *
                                                  (ham.two_mo[koffset + n1 * jj + ll] -
                                                   ham.two_mo[koffset + n1 * ll + jj]));
-                        append<long>(indices, jdet);
+                        append<long>(t_indices, jdet);
                     }
-                    excite_det(ll, kk, det_up);
                 }
             }
             excite_det(jj, ii, det_up);
@@ -363,19 +1358,15 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
     for (i = 0; i < wfn.nocc_dn; ++i) {
         ii = occs_dn[i];
         ioffset = n3 * ii;
-        // compute part of diagonal matrix element
-        val2 += ham.one_mo[(n1 + 1) * ii];
-        for (k = i + 1; k < wfn.nocc_dn; ++k) {
-            kk = occs_dn[k];
-            koffset = ioffset + n2 * kk;
-            val2 += ham.two_mo[koffset + n1 * ii + kk] - ham.two_mo[koffset + n1 * kk + ii];
-        }
+        // look up the 0-1 excited determinants
+        index_excited_dets(wfn, wfn.nword2, det_up, wfn.nword, ii, virs_dn, wfn.nvir_dn,
+                           t_dets, s_jdets);
         // loop over spin-down virtual indices
         for (j = 0; j < wfn.nvir_dn; ++j) {
             jj = virs_dn[j];
             // 0-1 excitation elements
             excite_det(ii, jj, det_dn);
-            jdet = wfn.index_det(det_up);
+            jdet = s_jdets[j];
             // check if 0-1 excited determinant is in wfn
             if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
                 // compute 0-1 matrix element
@@ -390,28 +1381,29 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
                     val1 += ham.two_mo[koffset + n1 * jj + kk] - ham.two_mo[koffset + n1 * kk + jj];
                 }
                 // add 0-1 matrix element
-                append<double>(data, phase_single_det(wfn.nword, ii, jj, rdet_dn) * val1);
-                append<long>(indices, jdet);
+                append<double>(t_data, phase_single_det(wfn.nword, ii, jj, rdet_dn) * val1);
+                append<long>(t_indices, jdet);
             }
             // loop over spin-down occupied indices
             for (k = i + 1; k < wfn.nocc_dn; ++k) {
                 kk = occs_dn[k];
                 koffset = ioffset + n2 * kk;
+                // look up the 0-2 excited determinants
+                index_excited_dets(wfn, wfn.nword2, det_up, wfn.nword, kk, virs_dn + j + 1,
+                                   wfn.nvir_dn - j - 1, t_dets, t_jdets);
                 // loop over spin-down virtual indices
                 for (l = j + 1; l < wfn.nvir_dn; ++l) {
                     ll = virs_dn[l];
                     // 0-2 excitation elements
-                    excite_det(kk, ll, det_dn);
-                    jdet = wfn.index_det(det_up);
+                    jdet = t_jdets[l - j - 1];
                     // check if excited determinant is in wfn
                     if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
                         // add 0-2 matrix element
-                        append<double>(data, phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_dn) *
+                        append<double>(t_data, phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_dn) *
                                                  (ham.two_mo[koffset + n1 * jj + ll] -
                                                   ham.two_mo[koffset + n1 * ll + jj]));
-                        append<long>(indices, jdet);
+                        append<long>(t_indices, jdet);
                     }
-                    excite_det(ll, kk, det_dn);
                 }
             }
             excite_det(jj, ii, det_dn);
@@ -419,21 +1411,23 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
     }
     // add diagonal element to matrix
     if (idet < ncol) {
-        append<double>(data, val2);
-        append<long>(indices, idet);
+        append<double>(t_data, diag_det(ham, wfn.nocc_up, occs_up, wfn.nocc_dn, occs_dn));
+        append<long>(t_indices, idet);
     }
     // add pointer to next row's indices
-    append<long>(indptr, indices.size());
+    append<long>(t_indptr, t_indices.size());
 }
 
 void SparseOp::add_row(const SQuantOp &ham, const GenCIWfn &wfn, const long idet, ulong *det, long *occs,
-                       long *virs) {
-    long jdet, jmin = symmetric ? idet : Max<long>();
+                       long *virs, ulong *t_dets, long *t_jdets, AlignedVector<double> &t_data,
+                       AlignedVector<long> &t_indices, AlignedVector<long> &t_indptr) const {
+    long jdet, jmin = (symmetric && !direct) ? idet : Max<long>();
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
     long n3 = n1 * n2;
-    double val1, val2 = 0.0;
+    double val1;
     const ulong *rdet = wfn.det_ptr(idet);
+    long *s_jdets = t_jdets + wfn.nvir;
     // fill working vectors
     std::memcpy(det, rdet, sizeof(ulong) * wfn.nword);
     fill_occs(wfn.nword, rdet, occs);
@@ -442,19 +1436,15 @@ void SparseOp::add_row(const SQuantOp &ham, const GenCIWfn &wfn, const long idet
     for (long i = 0, j, k, l, ii, jj, kk, ll, ioffset, koffset; i < wfn.nocc; ++i) {
         ii = occs[i];
         ioffset = n3 * ii;
-        // compute part of diagonal matrix element
-        val2 += ham.one_mo[(n1 + 1) * ii];
-        for (k = i + 1; k < wfn.nocc; ++k) {
-            kk = occs[k];
-            koffset = ioffset + n2 * kk;
-            val2 += ham.two_mo[koffset + n1 * ii + kk] - ham.two_mo[koffset + n1 * kk + ii];
-        }
+        // look up the single excited determinants
+        index_excited_dets(wfn, wfn.nword, det, 0, ii, virs, wfn.nvir_up, t_dets,
+                           s_jdets);
         // loop over virtual indices
-        for (j = 0; j < wfn.nvir; ++j) {
+        for (j = 0; j < wfn.nvir_up; ++j) {
             jj = virs[j];
             // single excitation elements
             excite_det(ii, jj, det);
-            jdet = wfn.index_det(det);
+            jdet = s_jdets[j];
             // check if singly-excited determinant is in wfn
             if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
                 // compute single excitation matrix element
@@ -465,28 +1455,29 @@ void SparseOp::add_row(const SQuantOp &ham, const GenCIWfn &wfn, const long idet
                     val1 += ham.two_mo[koffset + n1 * jj + kk] - ham.two_mo[koffset + n1 * kk + jj];
                 }
                 // add single excitation matrix element
-                append<double>(data, phase_single_det(wfn.nword, ii, jj, rdet) * val1);
-                append<long>(indices, jdet);
+                append<double>(t_data, phase_single_det(wfn.nword, ii, jj, rdet) * val1);
+                append<long>(t_indices, jdet);
             }
             // loop over occupied indices
             for (k = i + 1; k < wfn.nocc; ++k) {
                 kk = occs[k];
                 koffset = ioffset + n2 * kk;
+                // look up the double excited determinants
+                index_excited_dets(wfn, wfn.nword, det, 0, kk, virs + j + 1, wfn.nvir_up - j - 1,
+                                   t_dets, t_jdets);
                 // loop over virtual indices
-                for (l = j + 1; l < wfn.nvir; ++l) {
+                for (l = j + 1; l < wfn.nvir_up; ++l) {
                     ll = virs[l];
                     // double excitation elements
-                    excite_det(kk, ll, det);
-                    jdet = wfn.index_det(det);
+                    jdet = t_jdets[l - j - 1];
                     // check if double excited determinant is in wfn
                     if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
                         // add double matrix element
-                        append<double>(data, phase_double_det(wfn.nword, ii, kk, jj, ll, rdet) *
+                        append<double>(t_data, phase_double_det(wfn.nword, ii, kk, jj, ll, rdet) *
                                                  (ham.two_mo[koffset + n1 * jj + ll] -
                                                   ham.two_mo[koffset + n1 * ll + jj]));
-                        append<long>(indices, jdet);
+                        append<long>(t_indices, jdet);
                     }
-                    excite_det(ll, kk, det);
                 }
             }
             excite_det(jj, ii, det);
@@ -494,23 +1485,168 @@ void SparseOp::add_row(const SQuantOp &ham, const GenCIWfn &wfn, const long idet
     }
     // add diagonal element to matrix
     if (idet < ncol) {
-        append<double>(data, val2);
-        append<long>(indices, idet);
+        append<double>(t_data, diag_det(ham, wfn.nocc, occs, 0, nullptr));
+        append<long>(t_indices, idet);
     }
     // add pointer to next row's indices
-    append<long>(indptr, indices.size());
+    append<long>(t_indptr, t_indices.size());
+}
+
+void SparseOp::add_row_indices(const DOCIWfn &wfn, const long idet, ulong *det, long *occs,
+                               long *virs, ulong *t_dets, long *t_jdets,
+                               AlignedVector<long> &t_indices) const {
+    // enumerate the same columns as add_row without computing the matrix elements
+    long jmin = (symmetric && !direct) ? idet : Max<long>();
+    wfn.copy_det(idet, det);
+    fill_occs(wfn.nword, det, occs);
+    fill_virs(wfn.nword, wfn.nbasis, det, virs);
+    for (long i = 0; i < wfn.nocc_up; ++i) {
+        index_excited_dets(wfn, wfn.nword, det, 0, occs[i], virs, wfn.nvir_up, t_dets,
+                           t_jdets);
+        append_connected(t_jdets, wfn.nvir_up, jmin, ncol, t_indices);
+    }
+    if (idet < ncol)
+        append<long>(t_indices, idet);
 }
 
-Array<double> SparseOp::py_data() const {
-    return Array<double>(data.size(), &data[0]);
+void SparseOp::add_row_indices(const FullCIWfn &wfn, const long idet, ulong *det_up,
+                               long *occs_up, long *virs_up, ulong *t_dets, long *t_jdets,
+                               AlignedVector<long> &t_indices) const {
+    long i, j, k, ii, jj, jmin = (symmetric && !direct) ? idet : Max<long>();
+    const ulong *rdet_up = wfn.det_ptr(idet);
+    ulong *det_dn = det_up + wfn.nword;
+    long *occs_dn = occs_up + wfn.nocc_up;
+    long *virs_dn = virs_up + wfn.nvir_up;
+    std::memcpy(det_up, rdet_up, sizeof(ulong) * wfn.nword2);
+    fill_occs(wfn.nword, rdet_up, occs_up);
+    fill_occs(wfn.nword, rdet_up + wfn.nword, occs_dn);
+    fill_virs(wfn.nword, wfn.nbasis, rdet_up, virs_up);
+    fill_virs(wfn.nword, wfn.nbasis, rdet_up + wfn.nword, virs_dn);
+    for (i = 0; i < wfn.nocc_up; ++i) {
+        ii = occs_up[i];
+        // 1-0 excitations
+        index_excited_dets(wfn, wfn.nword2, det_up, 0, ii, virs_up, wfn.nvir_up, t_dets,
+                           t_jdets);
+        append_connected(t_jdets, wfn.nvir_up, jmin, ncol, t_indices);
+        for (j = 0; j < wfn.nvir_up; ++j) {
+            jj = virs_up[j];
+            excite_det(ii, jj, det_up);
+            // 1-1 excitations
+            for (k = 0; k < wfn.nocc_dn; ++k) {
+                index_excited_dets(wfn, wfn.nword2, det_up, wfn.nword, occs_dn[k], virs_dn,
+                                   wfn.nvir_dn, t_dets, t_jdets);
+                append_connected(t_jdets, wfn.nvir_dn, jmin, ncol, t_indices);
+            }
+            // 2-0 excitations
+            for (k = i + 1; k < wfn.nocc_up; ++k) {
+                index_excited_dets(wfn, wfn.nword2, det_up, 0, occs_up[k], virs_up + j + 1,
+                                   wfn.nvir_up - j - 1, t_dets, t_jdets);
+                append_connected(t_jdets, wfn.nvir_up - j - 1, jmin, ncol, t_indices);
+            }
+            excite_det(jj, ii, det_up);
+        }
+    }
+    for (i = 0; i < wfn.nocc_dn; ++i) {
+        ii = occs_dn[i];
+        // 0-1 excitations
+        index_excited_dets(wfn, wfn.nword2, det_up, wfn.nword, ii, virs_dn, wfn.nvir_dn,
+                           t_dets, t_jdets);
+        append_connected(t_jdets, wfn.nvir_dn, jmin, ncol, t_indices);
+        // 0-2 excitations
+        for (j = 0; j < wfn.nvir_dn; ++j) {
+            jj = virs_dn[j];
+            excite_det(ii, jj, det_dn);
+            for (k = i + 1; k < wfn.nocc_dn; ++k) {
+                index_excited_dets(wfn, wfn.nword2, det_up, wfn.nword, occs_dn[k], virs_dn + j + 1,
+                                   wfn.nvir_dn - j - 1, t_dets, t_jdets);
+                append_connected(t_jdets, wfn.nvir_dn - j - 1, jmin, ncol, t_indices);
+            }
+            excite_det(jj, ii, det_dn);
+        }
+    }
+    if (idet < ncol)
+        append<long>(t_indices, idet);
+}
+
+void SparseOp::add_row_indices(const GenCIWfn &wfn, const long idet, ulong *det, long *occs,
+                               long *virs, ulong *t_dets, long *t_jdets,
+                               AlignedVector<long> &t_indices) const {
+    long jmin = (symmetric && !direct) ? idet : Max<long>();
+    const ulong *rdet = wfn.det_ptr(idet);
+    std::memcpy(det, rdet, sizeof(ulong) * wfn.nword);
+    fill_occs(wfn.nword, rdet, occs);
+    fill_virs(wfn.nword, wfn.nbasis, rdet, virs);
+    for (long i = 0, j, k, ii, jj; i < wfn.nocc; ++i) {
+        ii = occs[i];
+        // single excitations
+        index_excited_dets(wfn, wfn.nword, det, 0, ii, virs, wfn.nvir_up, t_dets,
+                           t_jdets);
+        append_connected(t_jdets, wfn.nvir_up, jmin, ncol, t_indices);
+        // double excitations
+        for (j = 0; j < wfn.nvir_up; ++j) {
+            jj = virs[j];
+            excite_det(ii, jj, det);
+            for (k = i + 1; k < wfn.nocc; ++k) {
+                index_excited_dets(wfn, wfn.nword, det, 0, occs[k], virs + j + 1,
+                                   wfn.nvir_up - j - 1, t_dets, t_jdets);
+                append_connected(t_jdets, wfn.nvir_up - j - 1, jmin, ncol, t_indices);
+            }
+            excite_det(jj, ii, det);
+        }
+    }
+    if (idet < ncol)
+        append<long>(t_indices, idet);
+}
+
+Array<double> SparseOp::py_data(const pybind11::object &self) {
+    SparseOp *op = self.cast<SparseOp *>();
+    if (op->direct)
+        throw std::runtime_error("direct sparse_op does not store matrix elements");
+    return view_array<double>(self, op->nview, {static_cast<long>(op->data.size())},
+                              op->data.data());
+}
+
+Array<long> SparseOp::py_indices(const pybind11::object &self) {
+    // compressed indices are decoded into a new array
+    SparseOp *op = self.cast<SparseOp *>();
+    if (op->direct)
+        throw std::runtime_error("direct sparse_op does not store matrix elements");
+    else if (op->compact == 0)
+        return view_array<long>(self, op->nview, {static_cast<long>(op->indices.size())},
+                                op->indices.data());
+    Array<long> array(op->size);
+    long *ptr = reinterpret_cast<long *>(array.request().ptr);
+    if (op->compact == 1)
+        decode_indices(IndexReader<std::uint32_t>(op->cindices.data(), op->indptr.data()),
+                       op->indptr.data(), ptr, op->nrow);
+    else
+        decode_indices(VarintReader(op->bytes.data(), op->byteptr.data()), op->indptr.data(), ptr,
+                       op->nrow);
+    return array;
 }
 
-Array<long> SparseOp::py_indices() const {
-    return Array<long>(indices.size(), &indices[0]);
+Array<long> SparseOp::py_indptr(const pybind11::object &self) {
+    SparseOp *op = self.cast<SparseOp *>();
+    if (op->direct)
+        throw std::runtime_error("direct sparse_op does not store matrix elements");
+    return view_array<long>(self, op->nview, {static_cast<long>(op->indptr.size())},
+                            op->indptr.data());
 }
 
-Array<long> SparseOp::py_indptr() const {
-    return Array<long>(indptr.size(), &indptr[0]);
+pybind11::object SparseOp::py_to_scipy_csr(const pybind11::object &self) {
+    // the arrays are assigned to an empty matrix, since the constructor would copy the indices to
+    // the smallest sufficient integer type
+    const SparseOp *op = self.cast<const SparseOp *>();
+    // a symmetric operator stores only its lower triangle, which is not the matrix it represents
+    if (op->symmetric)
+        throw std::invalid_argument("symmetric sparse_op stores only one triangle; build it with "
+                                    "symmetric=False");
+    pybind11::object csr = pybind11::module_::import("scipy.sparse")
+                               .attr("csr_matrix")(pybind11::make_tuple(op->nrow, op->ncol));
+    csr.attr("data") = py_data(self);
+    csr.attr("indices") = py_indices(self);
+    csr.attr("indptr") = py_indptr(self);
+    return csr;
 }
 
 } // namespace pyci
@@ -26,17 +26,22 @@ SQuantOp::SQuantOp(void) {
 
 SQuantOp::SQuantOp(const SQuantOp &ham)
     : nbasis(ham.nbasis), ecore(ham.ecore), one_mo(ham.one_mo), two_mo(ham.two_mo), h(ham.h),
-      v(ham.v), w(ham.w), one_mo_array(ham.one_mo_array), two_mo_array(ham.two_mo_array),
-      h_array(ham.h_array), v_array(ham.v_array), w_array(ham.w_array) {
+      v(ham.v), w(ham.w), coulomb(ham.coulomb), exchange(ham.exchange),
+      one_mo_array(ham.one_mo_array), two_mo_array(ham.two_mo_array), h_array(ham.h_array),
+      v_array(ham.v_array), w_array(ham.w_array), coulomb_array(ham.coulomb_array),
+      exchange_array(ham.exchange_array), heatbath(ham.heatbath) {
 }
 
 SQuantOp::SQuantOp(SQuantOp &&ham) noexcept
     : nbasis(std::exchange(ham.nbasis, 0)), ecore(std::exchange(ham.ecore, 0.0)),
       one_mo(std::exchange(ham.one_mo, nullptr)), two_mo(std::exchange(ham.two_mo, nullptr)),
       h(std::exchange(ham.h, nullptr)), v(std::exchange(ham.v, nullptr)),
-      w(std::exchange(ham.w, nullptr)), one_mo_array(std::move(ham.one_mo_array)),
+      w(std::exchange(ham.w, nullptr)), coulomb(std::exchange(ham.coulomb, nullptr)),
+      exchange(std::exchange(ham.exchange, nullptr)), one_mo_array(std::move(ham.one_mo_array)),
       two_mo_array(std::move(ham.two_mo_array)), h_array(std::move(ham.h_array)),
-      v_array(std::move(ham.v_array)), w_array(std::move(ham.w_array)) {
+      v_array(std::move(ham.v_array)), w_array(std::move(ham.w_array)),
+      coulomb_array(std::move(ham.coulomb_array)), exchange_array(std::move(ham.exchange_array)),
+      heatbath(std::move(ham.heatbath)) {
 }
 
 namespace {
@@ -74,8 +79,96 @@ T read_parameter(const std::string &header, const std::string &name,
     return parameter;
 }
 
+double heat_bath_value(const SQuantOp &ham, const int kind, const long key, const long target) {
+    const long n1 = ham.nbasis, n2 = n1 * n1, n3 = n1 * n2;
+    const long i = key / n1, j = key % n1, a = target / n1, b = target % n1;
+    switch (kind) {
+    case HeatBath::pair:
+        // pair excitation key -> target
+        return (target != key) ? std::abs(ham.v[n1 * key + target]) : 0.0;
+    case HeatBath::same_spin:
+        // excitation i, j -> a, b with i < j and a < b
+        if (i >= j || a >= b || a == i || a == j || b == i || b == j)
+            return 0.0;
+        return std::abs(ham.two_mo[n3 * i + n2 * j + n1 * a + b] -
+                        ham.two_mo[n3 * i + n2 * j + n1 * b + a]);
+    default:
+        // excitation i -> a of one spin and j -> b of the other
+        return (a != i && b != j) ? std::abs(ham.two_mo[n3 * i + n2 * j + n1 * a + b]) : 0.0;
+    }
+}
+
+void heat_bath_thread(const SQuantOp &ham, const int kind, const long ntarget, const bool fill,
+                      long *ptr, unsigned *targets, double *values, const long start,
+                      const long end) {
+    // count the nonzero targets of each key, or write them in order once they are counted; values
+    // is null for lists that do not store their values
+    Vector<std::pair<double, unsigned>> items;
+    double value;
+    for (long key = start; key < end; ++key) {
+        items.clear();
+        for (long target = 0; target < ntarget; ++target) {
+            value = heat_bath_value(ham, kind, key, target);
+            if (value != 0.0)
+                items.emplace_back(-value, target);
+        }
+        if (!fill) {
+            ptr[key + 1] = items.size();
+            continue;
+        }
+        std::sort(items.begin(), items.end());
+        for (long k = 0, t = ptr[key]; k < static_cast<long>(items.size()); ++k, ++t) {
+            if (values != nullptr)
+                values[t] = -items[k].first;
+            targets[t] = items[k].second;
+        }
+    }
+}
+
 } // namespace
 
+HeatBath::HeatBath(const SQuantOp &ham, const int kind)
+    : nbasis(ham.nbasis), nkey((kind == pair) ? ham.nbasis : ham.nbasis * ham.nbasis),
+      ptr(nkey + 1) {
+    const long ntarget = nkey;
+    if (ntarget > Max<unsigned>())
+        throw std::domain_error("cannot build heat-bath lists for this many orbitals");
+    long nthread = get_num_threads();
+    long chunksize = nkey / nthread + static_cast<bool>(nkey % nthread);
+    while (nthread > 1 && chunksize * ntarget < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nkey / nthread + static_cast<bool>(nkey % nthread);
+    }
+    for (int pass = 0; pass < 2; ++pass) {
+        Vector<std::thread> v_threads;
+        v_threads.reserve(nthread);
+        for (long i = 0; i < nthread; ++i)
+            v_threads.emplace_back(&heat_bath_thread, std::cref(ham), kind, ntarget,
+                                   static_cast<bool>(pass), ptr.data(), targets.data(),
+                                   (kind == opposite_spin) ? nullptr : values.data(),
+                                   end_chunk_idx(i, nthread, nkey),
+                                   std::min(end_chunk_idx(i + 1, nthread, nkey), nkey));
+        for (auto &thread : v_threads)
+            thread.join();
+        if (pass)
+            break;
+        for (long key = 0; key < nkey; ++key)
+            ptr[key + 1] += ptr[key];
+        targets.resize(ptr[nkey]);
+        // the opposite-spin values are the two-electron integrals themselves, which are not copied
+        if (kind != opposite_spin)
+            values.resize(ptr[nkey]);
+    }
+}
+
+const HeatBath &SQuantOp::heat_bath(const int kind) const {
+    if (heatbath.empty())
+        heatbath.resize(3);
+    if (!heatbath[kind])
+        heatbath[kind] = std::make_shared<const HeatBath>(*this, kind);
+    return *heatbath[kind];
+}
+
 SQuantOp::SQuantOp(const std::string &filename) {
     std::ifstream f(filename);
     if (f.fail())
@@ -107,11 +200,15 @@ SQuantOp::SQuantOp(const std::string &filename) {
     h_array = Array<double>(nbasis);
     v_array = Array<double>({nbasis, nbasis});
     w_array = Array<double>({nbasis, nbasis});
+    coulomb_array = Array<double>({nbasis, nbasis});
+    exchange_array = Array<double>({nbasis, nbasis});
     one_mo = reinterpret_cast<double *>(one_mo_array.request().ptr);
     two_mo = reinterpret_cast<double *>(two_mo_array.request().ptr);
     h = reinterpret_cast<double *>(h_array.request().ptr);
     v = reinterpret_cast<double *>(v_array.request().ptr);
     w = reinterpret_cast<double *>(w_array.request().ptr);
+    coulomb = reinterpret_cast<double *>(coulomb_array.request().ptr);
+    exchange = reinterpret_cast<double *>(exchange_array.request().ptr);
 
     long n1, n2, n3;
     n1 = nbasis;
@@ -154,20 +251,25 @@ SQuantOp::SQuantOp(const std::string &filename) {
         h[k++] = one_mo[i * (n1 + 1)];
         for (j = 0; j != n1; ++j) {
             v[l] = two_mo[i * n3 + i * n2 + j * n1 + j];
-            w[l++] =
-                two_mo[i * n3 + j * n2 + i * n1 + j] * 2 - two_mo[i * n3 + j * n2 + j * n1 + i];
+            coulomb[l] = two_mo[i * n3 + j * n2 + i * n1 + j];
+            exchange[l] = two_mo[i * n3 + j * n2 + j * n1 + i];
+            w[l] = coulomb[l] * 2 - exchange[l];
+            ++l;
         }
     }
 }
 
 SQuantOp::SQuantOp(const double e, const Array<double> mo1, const Array<double> mo2)
     : nbasis(mo1.request().shape[0]), ecore(e), one_mo_array(mo1), two_mo_array(mo2),
-      h_array(nbasis), v_array({nbasis, nbasis}), w_array({nbasis, nbasis}) {
+      h_array(nbasis), v_array({nbasis, nbasis}), w_array({nbasis, nbasis}),
+      coulomb_array({nbasis, nbasis}), exchange_array({nbasis, nbasis}) {
     one_mo = reinterpret_cast<double *>(one_mo_array.request().ptr);
     two_mo = reinterpret_cast<double *>(two_mo_array.request().ptr);
     h = reinterpret_cast<double *>(h_array.request().ptr);
     v = reinterpret_cast<double *>(v_array.request().ptr);
     w = reinterpret_cast<double *>(w_array.request().ptr);
+    coulomb = reinterpret_cast<double *>(coulomb_array.request().ptr);
+    exchange = reinterpret_cast<double *>(exchange_array.request().ptr);
     long n1 = nbasis;
     long n2 = nbasis * n1;
     long n3 = nbasis * n2;
@@ -176,8 +278,10 @@ SQuantOp::SQuantOp(const double e, const Array<double> mo1, const Array<double>
         h[k++] = one_mo[i * (n1 + 1)];
         for (j = 0; j != n1; ++j) {
             v[l] = two_mo[i * n3 + i * n2 + j * n1 + j];
-            w[l++] =
-                two_mo[i * n3 + j * n2 + i * n1 + j] * 2 - two_mo[i * n3 + j * n2 + j * n1 + i];
+            coulomb[l] = two_mo[i * n3 + j * n2 + i * n1 + j];
+            exchange[l] = two_mo[i * n3 + j * n2 + j * n1 + i];
+            w[l] = coulomb[l] * 2 - exchange[l];
+            ++l;
         }
     }
 }
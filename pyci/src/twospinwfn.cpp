@@ -44,9 +44,7 @@ TwoSpinWfn::TwoSpinWfn(const std::string &filename) {
         throw std::ios_base::failure("error in file");
     Wfn::init(nb, nu, nd);
     ndet = n;
-    dict.reserve(n);
-    for (long idet = 0; idet < ndet; ++idet)
-        dict[rank_det(&dets[nword2 * idet])] = idet;
+    build_dict(2);
 }
 
 TwoSpinWfn::TwoSpinWfn(const long nb, const long nu, const long nd) : Wfn(nb, nu, nd) {
@@ -57,8 +55,7 @@ TwoSpinWfn::TwoSpinWfn(const long nb, const long nu, const long nd, const long n
     ndet = n;
     dets.resize(n * nword2);
     std::memcpy(&dets[0], ptr, sizeof(ulong) * n * nword2);
-    for (long i = 0; i < n; ++i)
-        dict[rank_det(ptr + i * nword2)] = i;
+    build_dict(2);
 }
 
 TwoSpinWfn::TwoSpinWfn(const long nb, const long nu, const long nd, const long n, const long *ptr)
@@ -74,8 +71,7 @@ TwoSpinWfn::TwoSpinWfn(const long nb, const long nu, const long nd, const long n
         j += nu;
         k += nword;
     }
-    for (long i = 0; i < n; ++i)
-        dict[rank_det(&dets[i * nword2])] = i;
+    build_dict(2);
 }
 
 TwoSpinWfn::TwoSpinWfn(const long nb, const long nu, const long nd, const Array<ulong> array)
@@ -127,15 +123,69 @@ void TwoSpinWfn::to_occ_array(const long low, const long high, long *ptr) const
 }
 
 long TwoSpinWfn::index_det(const ulong *det) const {
+    if (complete) {
+        long rank_up = rank_string(det, nocc_up), rank_dn = rank_string(det + nword, nocc_dn);
+        return (rank_up == -1 || rank_dn == -1) ? -1 : rank_up * maxrank_dn + rank_dn;
+    } else if (frozen) {
+        return search_det(det, 2);
+    } else if (lean) {
+        return find_slot(det, rank_det(det).first, 2);
+    }
     const auto &search = dict.find(rank_det(det));
     return (search == dict.end()) ? -1 : search->second;
 }
 
 long TwoSpinWfn::index_det_from_rank(const Hash rank) const {
+    if (complete || frozen || lean)
+        throw std::runtime_error("cannot index a complete, frozen, or lean wave function by hash");
+    const auto &search = dict.find(rank);
+    return (search == dict.end()) ? -1 : search->second;
+}
+
+long TwoSpinWfn::index_det_with_rank(const ulong *det, const Hash rank) const {
+    if (complete || frozen)
+        return index_det(det);
+    else if (lean)
+        return find_slot(det, rank.first, 2);
     const auto &search = dict.find(rank);
     return (search == dict.end()) ? -1 : search->second;
 }
 
+void TwoSpinWfn::index_dets(const ulong *ptr, const long n, long *out) const {
+    // hash a batch of determinants and prefetch their buckets before resolving the lookups, so
+    // that the cache misses of the batch overlap
+    if (complete || frozen) {
+        for (long i = 0; i < n; ++i)
+            out[i] = index_det(ptr + i * nword2);
+        return;
+    }
+    Hash ranks[PYCI_INDEX_BATCH];
+    for (long start = 0, end, i; start < n; start = end) {
+        end = std::min(start + PYCI_INDEX_BATCH, n);
+        for (i = start; i < end; ++i)
+            ranks[i - start] = rank_det(ptr + i * nword2);
+        index_dets_with_rank(ptr + start * nword2, ranks, end - start, out + start);
+    }
+}
+
+void TwoSpinWfn::index_dets_with_rank(const ulong *ptr, const Hash *ranks, const long n,
+                                      long *out) const {
+    // keep the buckets of the next PYCI_INDEX_BATCH determinants in flight while resolving each
+    // lookup
+    if (complete || frozen) {
+        for (long i = 0; i < n; ++i)
+            out[i] = index_det(ptr + i * nword2);
+        return;
+    }
+    for (long i = 0; i < n && i < PYCI_INDEX_BATCH; ++i)
+        prefetch_rank(ranks[i]);
+    for (long i = 0; i < n; ++i) {
+        if (i + PYCI_INDEX_BATCH < n)
+            prefetch_rank(ranks[i + PYCI_INDEX_BATCH]);
+        out[i] = index_det_with_rank(ptr + i * nword2, ranks[i]);
+    }
+}
+
 void TwoSpinWfn::copy_det(const long i, ulong *det) const {
     std::memcpy(det, &dets[i * nword2], sizeof(ulong) * nword2);
 }
@@ -145,7 +195,15 @@ Hash TwoSpinWfn::rank_det(const ulong *det) const {
 }
 
 long TwoSpinWfn::add_det(const ulong *det) {
-    if (dict.insert(std::make_pair(rank_det(det), ndet)).second) {
+    // a complete determinant space already contains every determinant
+    if (complete)
+        return -1;
+    else if (frozen)
+        throw std::runtime_error("cannot add determinants to a frozen wave function");
+    check_views();
+    if (lean)
+        return insert_slot(det, rank_det(det).first, 2);
+    else if (dict.insert(std::make_pair(rank_det(det), ndet)).second) {
         dets.resize(dets.size() + nword2);
         std::memcpy(&dets[nword2 * ndet], det, sizeof(ulong) * nword2);
         return ndet++;
@@ -154,7 +212,14 @@ long TwoSpinWfn::add_det(const ulong *det) {
 }
 
 long TwoSpinWfn::add_det_with_rank(const ulong *det, const Hash rank) {
-    if (dict.insert(std::make_pair(rank, ndet)).second) {
+    if (complete)
+        return -1;
+    else if (frozen)
+        throw std::runtime_error("cannot add determinants to a frozen wave function");
+    check_views();
+    if (lean)
+        return insert_slot(det, rank.first, 2);
+    else if (dict.insert(std::make_pair(rank, ndet)).second) {
         dets.resize(dets.size() + nword2);
         std::memcpy(&dets[nword2 * ndet], det, sizeof(ulong) * nword2);
         return ndet++;
@@ -220,9 +285,17 @@ void twospinwfn_add_all_dets_thread(const long nword, const long nbasis, const l
 
 } // namespace
 
-void TwoSpinWfn::add_all_dets(long nthread) {
+void TwoSpinWfn::add_all_dets(long nthread, const std::string &index) {
+    if (frozen)
+        throw std::runtime_error("cannot add determinants to a frozen wave function");
+    else if (index != "hash" && index != "rank")
+        throw std::invalid_argument("index must be 'hash' or 'rank'");
+    check_views();
     if (nthread == -1)
         nthread = get_num_threads();
+    // the determinants already present are moved to their colex rank
+    if (ndet)
+        ++generation;
     ndet = maxrank_up * maxrank_dn;
     long chunksize = ndet / nthread + static_cast<bool>(ndet % nthread);
     while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
@@ -231,8 +304,8 @@ void TwoSpinWfn::add_all_dets(long nthread) {
     }
     std::fill(dets.begin(), dets.end(), 0UL);
     dets.resize(ndet * nword2);
-    dict.clear();
-    dict.reserve(ndet);
+    if (index == "rank")
+        init_complete();
     Vector<std::thread> v_threads;
     v_threads.reserve(nthread);
     for (long i = 0; i < nthread; ++i)
@@ -240,8 +313,8 @@ void TwoSpinWfn::add_all_dets(long nthread) {
                                maxrank_up, maxrank_dn, &dets[0], i, nthread);
     for (auto &thread : v_threads)
         thread.join();
-    for (long i = 0; i < ndet; ++i)
-        dict[rank_det(&dets[i * nword2])] = i;
+    if (index == "hash")
+        rebuild_index(2);
 }
 
 void TwoSpinWfn::add_excited_dets(const ulong *rdet, const long e_up, const long e_dn) {
@@ -265,13 +338,68 @@ void TwoSpinWfn::add_excited_dets(const ulong *rdet, const long e_up, const long
 }
 
 void TwoSpinWfn::add_dets_from_wfn(const TwoSpinWfn &wfn) {
+    if (wfn.complete || wfn.frozen || wfn.lean) {
+        for (long i = 0; i < wfn.ndet; ++i)
+            add_det(wfn.det_ptr(i));
+        return;
+    }
     for (const auto &keyval : wfn.dict)
         add_det_with_rank(&wfn.dets[keyval.second * nword2], keyval.first);
 }
 
+void TwoSpinWfn::add_dets(const ulong *ptr, const long n, long *out) {
+    // hash the determinants in parallel, then add them in order; each output is the index of the
+    // determinant in the wave function, whether it was added or already present
+    AlignedVector<Hash> ranks(n);
+    hash_dets(ptr, n, 2, ranks.data());
+    for (long i = 0; i < n; ++i) {
+        if (i + PYCI_INDEX_BATCH < n && !(complete || frozen))
+            prefetch_rank(ranks[i + PYCI_INDEX_BATCH]);
+        out[i] = add_det_with_rank(ptr + i * nword2, ranks[i]);
+        if (out[i] == -1)
+            out[i] = index_det_with_rank(ptr + i * nword2, ranks[i]);
+    }
+}
+
+void TwoSpinWfn::remove_dets(const long *indices, const long n, long *map) {
+    std::fill(map, map + ndet, 0L);
+    for (long i = 0; i < n; ++i) {
+        if (indices[i] < 0 || indices[i] >= ndet)
+            throw std::invalid_argument("determinant index out of range");
+        map[indices[i]] = -1;
+    }
+    compact_dets(2, map);
+}
+
+void TwoSpinWfn::prune(const double *coeffs, const long nvec, const double threshold, long *map) {
+    // keep the determinants with a coefficient of magnitude >= threshold in any vector
+    for (long i = 0, k; i < ndet; ++i) {
+        map[i] = -1;
+        for (k = 0; k < nvec; ++k) {
+            if (std::abs(coeffs[k * ndet + i]) >= threshold) {
+                map[i] = i;
+                break;
+            }
+        }
+    }
+    compact_dets(2, map);
+}
+
+void TwoSpinWfn::freeze(long *perm) {
+    freeze_dets(2, perm);
+}
+
+void TwoSpinWfn::lean_index(void) {
+    init_lean(2);
+}
+
 void TwoSpinWfn::reserve(const long n) {
+    check_views();
     dets.reserve(n * nword2);
-    dict.reserve(n);
+    if (lean)
+        reserve_slots(2, n);
+    else if (!(complete || frozen))
+        dict.reserve(n);
 }
 
 Array<ulong> TwoSpinWfn::py_getitem(const long index) const {
@@ -292,6 +420,11 @@ Array<ulong> TwoSpinWfn::py_to_det_array(long start, long end) const {
     return array;
 }
 
+Array<ulong> TwoSpinWfn::py_det_view(const pybind11::object &self) {
+    TwoSpinWfn *wfn = self.cast<TwoSpinWfn *>();
+    return view_array<ulong>(self, wfn->nview, {wfn->ndet, 2L, wfn->nword}, wfn->dets.data());
+}
+
 Array<long> TwoSpinWfn::py_to_occ_array(long start, long end) const {
     if (start == -1) {
         start = 0;
@@ -310,6 +443,66 @@ long TwoSpinWfn::py_index_det(const Array<ulong> det) const {
     return index_det(reinterpret_cast<const ulong *>(det.request().ptr));
 }
 
+Array<long> TwoSpinWfn::py_freeze(void) {
+    Array<long> array(ndet);
+    freeze(reinterpret_cast<long *>(array.request().ptr));
+    return array;
+}
+
+Array<long> TwoSpinWfn::py_remove_dets(const Array<long> array) {
+    pybind11::buffer_info buf = array.request();
+    Array<long> map(ndet);
+    remove_dets(reinterpret_cast<const long *>(buf.ptr), buf.size,
+                reinterpret_cast<long *>(map.request().ptr));
+    return map;
+}
+
+Array<long> TwoSpinWfn::py_prune(const Array<double> coeffs, const double threshold) {
+    pybind11::buffer_info buf = coeffs.request();
+    if (buf.ndim < 1 || buf.ndim > 2 || buf.shape[buf.ndim - 1] != ndet)
+        throw std::invalid_argument("coeffs must have shape (ndet,) or (nvec, ndet)");
+    Array<long> map(ndet);
+    prune(reinterpret_cast<const double *>(buf.ptr), (buf.ndim == 2) ? buf.shape[0] : 1,
+          threshold, reinterpret_cast<long *>(map.request().ptr));
+    return map;
+}
+
+Array<long> TwoSpinWfn::py_index_dets(const Array<ulong> array) const {
+    pybind11::buffer_info buf = array.request();
+    if (buf.ndim != 3 || buf.shape[1] != 2 || buf.shape[2] != nword)
+        throw std::invalid_argument("dets must have shape (n, 2, nword)");
+    Array<long> indices(buf.shape[0]);
+    index_dets(reinterpret_cast<const ulong *>(buf.ptr), buf.shape[0],
+               reinterpret_cast<long *>(indices.request().ptr));
+    return indices;
+}
+
+Array<long> TwoSpinWfn::py_add_dets(const Array<ulong> array) {
+    pybind11::buffer_info buf = array.request();
+    if (buf.ndim != 3 || buf.shape[1] != 2 || buf.shape[2] != nword)
+        throw std::invalid_argument("dets must have shape (n, 2, nword)");
+    Array<long> indices(buf.shape[0]);
+    add_dets(reinterpret_cast<const ulong *>(buf.ptr), buf.shape[0],
+             reinterpret_cast<long *>(indices.request().ptr));
+    return indices;
+}
+
+Array<long> TwoSpinWfn::py_add_occs_array(const Array<long> array) {
+    pybind11::buffer_info buf = array.request();
+    if (buf.ndim != 3 || buf.shape[1] != 2 || buf.shape[2] != nocc_up)
+        throw std::invalid_argument("occs_array must have shape (n, 2, nocc_up)");
+    const long n = buf.shape[0];
+    const long *ptr = reinterpret_cast<const long *>(buf.ptr);
+    AlignedVector<ulong> v_dets(n * nword2);
+    for (long i = 0; i < n; ++i) {
+        fill_det(nocc_up, ptr + i * nocc_up * 2, &v_dets[i * nword2]);
+        fill_det(nocc_dn, ptr + i * nocc_up * 2 + nocc_up, &v_dets[i * nword2 + nword]);
+    }
+    Array<long> indices(n);
+    add_dets(v_dets.data(), n, reinterpret_cast<long *>(indices.request().ptr));
+    return indices;
+}
+
 Hash TwoSpinWfn::py_rank_det(const Array<ulong> det) const {
     return rank_det(reinterpret_cast<const ulong *>(det.request().ptr));
 }
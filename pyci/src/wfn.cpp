@@ -17,11 +17,31 @@
 
 namespace pyci {
 
+namespace {
+
+bool det_less(const long nword, const long nspin, const ulong *x, const ulong *y) {
+    // compare the spin-up strings first, each from its most significant word
+    for (long i = 0; i < nspin; ++i)
+        for (long j = (i + 1) * nword - 1; j >= i * nword; --j)
+            if (x[j] != y[j])
+                return x[j] < y[j];
+    return false;
+}
+
+void hash_dets_thread(const long nw, const ulong *dets, Hash *ranks, const long start,
+                      const long end) {
+    for (long i = start; i < end; ++i)
+        ranks[i] = spookyhash(nw, dets + i * nw);
+}
+
+} // namespace
+
 Wfn::Wfn(const Wfn &wfn)
     : nbasis(wfn.nbasis), nocc(wfn.nocc), nocc_up(wfn.nocc_up), nocc_dn(wfn.nocc_dn),
       nvir(wfn.nvir), nvir_up(wfn.nvir_up), nvir_dn(wfn.nvir_dn), ndet(wfn.ndet), nword(wfn.nword),
-      nword2(wfn.nword2), maxrank_up(wfn.maxrank_up), maxrank_dn(wfn.maxrank_dn), dets(wfn.dets),
-      dict(wfn.dict) {
+      nword2(wfn.nword2), maxrank_up(wfn.maxrank_up), maxrank_dn(wfn.maxrank_dn),
+      generation(wfn.generation), complete(wfn.complete), frozen(wfn.frozen), lean(wfn.lean),
+      nview(0), dets(wfn.dets), dict(wfn.dict), binoms(wfn.binoms), slots(wfn.slots) {
 }
 
 Wfn::Wfn(Wfn &&wfn) noexcept
@@ -31,7 +51,10 @@ Wfn::Wfn(Wfn &&wfn) noexcept
       nvir_dn(std::exchange(wfn.nvir_dn, 0)), ndet(std::exchange(wfn.ndet, 0)),
       nword(std::exchange(wfn.nword, 0)), nword2(std::exchange(wfn.nword2, 0)),
       maxrank_up(std::exchange(wfn.maxrank_up, 0)), maxrank_dn(std::exchange(wfn.maxrank_dn, 0)),
-      dets(std::move(wfn.dets)), dict(std::move(wfn.dict)) {
+      generation(std::exchange(wfn.generation, 0)), complete(std::exchange(wfn.complete, false)),
+      frozen(std::exchange(wfn.frozen, false)), lean(std::exchange(wfn.lean, false)), nview(0),
+      dets(std::move(wfn.dets)), dict(std::move(wfn.dict)),
+      binoms(std::move(wfn.binoms)), slots(std::move(wfn.slots)) {
 }
 
 Wfn::Wfn(const long nb, const long nu, const long nd) {
@@ -43,9 +66,42 @@ long Wfn::length(void) const {
 }
 
 void Wfn::squeeze(void) {
+    check_views();
     dets.shrink_to_fit();
 }
 
+void Wfn::add_dets_from_builder(WfnBuilder &builder) {
+    // the builder holds only determinants that are not in the wave function, so they are copied
+    // to the end of the determinant array and indexed without any lookups
+    const long n = builder.size(), nw = builder.nword, nspin = nw / nword;
+    if (complete)
+        return;
+    else if (frozen)
+        throw std::runtime_error("cannot add determinants to a frozen wave function");
+    check_views();
+    if (lean && ndet + n >= Max<unsigned>())
+        throw std::domain_error("cannot index >= 2 ** 32 - 1 determinants in a lean table");
+    AlignedVector<Hash> ranks(n);
+    if (lean)
+        reserve_slots(nspin, ndet + n);
+    else
+        dict.reserve(ndet + n);
+    dets.resize((ndet + n) * nw);
+    builder.compact(&dets[ndet * nw], ranks.data());
+    if (lean) {
+        const ulong mask = slots.size() - 1;
+        for (long i = 0; i < n; ++i) {
+            ulong pos = ranks[i].first & mask;
+            while (slots[pos] != Max<unsigned>())
+                pos = (pos + 1) & mask;
+            slots[pos] = ndet + i;
+        }
+    } else {
+        insert_dict(ranks.data(), n, ndet);
+    }
+    ndet += n;
+}
+
 Wfn::Wfn(void){};
 
 void Wfn::init(const long nb, const long nu, const long nd) {
@@ -67,6 +123,320 @@ void Wfn::init(const long nb, const long nu, const long nd) {
     nword2 = nword * 2;
     maxrank_up = binomial(nb, nu);
     maxrank_dn = binomial(nb, nd);
+    generation = 0;
+    nview = 0;
+    complete = false;
+    frozen = false;
+    lean = false;
+}
+
+void Wfn::init_complete(void) {
+    // determinants are indexed by their colex rank, so the hash map is not needed
+    complete = true;
+    lean = false;
+    ParallelHashMap<Hash, long>().swap(dict);
+    AlignedVector<unsigned>().swap(slots);
+    binoms.resize(nbasis * (nocc_up + 1));
+    for (long i = 0, k; i < nbasis; ++i)
+        for (k = 0; k <= nocc_up; ++k)
+            binoms[i * (nocc_up + 1) + k] = binomial(i, k);
+}
+
+void Wfn::check_views(void) const {
+    // det_view arrays point into the determinant array, which may be moved or reordered
+    if (nview)
+        throw pybind11::buffer_error("cannot modify a wave function while views of its "
+                                     "determinants exist");
+}
+
+long Wfn::rank_string(const ulong *str, const long n) const {
+    // colex rank of an occupation string, or -1 if it does not have n occupied orbitals
+    long rank = 0, k = 0, p;
+    for (long i = 0; i < nword; ++i) {
+        for (ulong word = str[i]; word; word &= word - 1) {
+            p = i * Size<ulong>() + Ctz(word);
+            if (++k > n || p >= nbasis)
+                return -1;
+            rank += binoms[p * (nocc_up + 1) + k];
+        }
+    }
+    return (k == n) ? rank : -1;
+}
+
+void Wfn::freeze_dets(const long nspin, long *perm) {
+    // sort the determinants so they can be found by binary search, and free the hash map; a
+    // complete determinant space is generated in this order already
+    const long n = nword * nspin;
+    std::iota(perm, perm + ndet, 0L);
+    if (!(complete || frozen)) {
+        check_views();
+        std::sort(perm, perm + ndet, [this, n, nspin](const long i, const long j) {
+            return det_less(nword, nspin, &dets[i * n], &dets[j * n]);
+        });
+        AlignedVector<ulong> sorted(ndet * n);
+        for (long i = 0; i < ndet; ++i)
+            std::memcpy(&sorted[i * n], &dets[perm[i] * n], sizeof(ulong) * n);
+        dets.swap(sorted);
+        ParallelHashMap<Hash, long>().swap(dict);
+        AlignedVector<unsigned>().swap(slots);
+        lean = false;
+        ++generation;
+    }
+    frozen = true;
+}
+
+void Wfn::compact_dets(const long nspin, long *map) {
+    // map holds -1 for each determinant to remove; the others are moved down in order, map is set
+    // to their new indices, and the index is rebuilt
+    const long n = nword * nspin;
+    long k = 0;
+    check_views();
+    for (long i = 0; i < ndet; ++i) {
+        if (map[i] == -1)
+            continue;
+        else if (k != i)
+            std::memcpy(&dets[k * n], &dets[i * n], sizeof(ulong) * n);
+        map[i] = k++;
+    }
+    if (k == ndet)
+        return;
+    ndet = k;
+    dets.resize(ndet * n);
+    ++generation;
+    rebuild_index(nspin);
+}
+
+void Wfn::rebuild_index(const long nspin) {
+    // index the determinant array again after it was rewritten; a frozen wave function stays
+    // sorted, but a complete one is indexed by hash from now on
+    if (complete) {
+        complete = false;
+        AlignedVector<long>().swap(binoms);
+    }
+    if (lean) {
+        AlignedVector<unsigned>().swap(slots);
+        reserve_slots(nspin, ndet);
+    } else if (!frozen) {
+        build_dict(nspin);
+    }
+}
+
+long Wfn::search_det(const ulong *det, const long nspin) const {
+    const long n = nword * nspin;
+    long first = 0, count = ndet, step;
+    while (count > 0) {
+        step = count / 2;
+        if (det_less(nword, nspin, &dets[(first + step) * n], det)) {
+            first += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+    return (first < ndet && std::equal(det, det + n, &dets[first * n])) ? first : -1;
+}
+
+void Wfn::init_lean(const long nspin) {
+    // replace the hash map with an open-addressing table of determinant indices; probes compare
+    // against the stored determinants, so no keys are kept
+    if (complete || frozen || lean)
+        return;
+    ParallelHashMap<Hash, long>().swap(dict);
+    lean = true;
+    reserve_slots(nspin, ndet);
+}
+
+void Wfn::reserve_slots(const long nspin, const long n) {
+    // keep the load factor of the table <= 3/4, and rehash the determinants when it grows
+    const long nw = nword * nspin;
+    long nslot = 16;
+    while (nslot * 3 < n * 4)
+        nslot *= 2;
+    if (nslot <= static_cast<long>(slots.size()))
+        return;
+    AlignedVector<unsigned>(nslot, Max<unsigned>()).swap(slots);
+    const ulong mask = nslot - 1;
+    for (long i = 0; i < ndet; ++i) {
+        ulong pos = spookyhash(nw, &dets[i * nw]).first & mask;
+        while (slots[pos] != Max<unsigned>())
+            pos = (pos + 1) & mask;
+        slots[pos] = i;
+    }
+}
+
+long Wfn::find_slot(const ulong *det, const ulong hash, const long nspin) const {
+    const long nw = nword * nspin;
+    const ulong mask = slots.size() - 1;
+    for (ulong pos = hash & mask; slots[pos] != Max<unsigned>(); pos = (pos + 1) & mask)
+        if (std::equal(det, det + nw, &dets[slots[pos] * nw]))
+            return slots[pos];
+    return -1;
+}
+
+long Wfn::insert_slot(const ulong *det, const ulong hash, const long nspin) {
+    const long nw = nword * nspin;
+    if (find_slot(det, hash, nspin) != -1)
+        return -1;
+    else if (ndet >= Max<unsigned>())
+        throw std::domain_error("cannot index >= 2 ** 32 - 1 determinants in a lean table");
+    reserve_slots(nspin, ndet + 1);
+    const ulong mask = slots.size() - 1;
+    ulong pos = hash & mask;
+    while (slots[pos] != Max<unsigned>())
+        pos = (pos + 1) & mask;
+    slots[pos] = ndet;
+    dets.resize(dets.size() + nw);
+    std::memcpy(&dets[ndet * nw], det, sizeof(ulong) * nw);
+    return ndet++;
+}
+
+void Wfn::hash_dets(const ulong *ptr, const long n, const long nspin, Hash *ranks) const {
+    long nthread = get_num_threads(), chunksize = n / nthread + static_cast<bool>(n % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = n / nthread + static_cast<bool>(n % nthread);
+    }
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&hash_dets_thread, nword * nspin, ptr, ranks,
+                               end_chunk_idx(i, nthread, n), end_chunk_idx(i + 1, nthread, n));
+    for (auto &thread : v_threads)
+        thread.join();
+}
+
+void Wfn::build_dict(const long nspin) {
+    // hash and insert the determinants one block at a time, both in parallel, so that only the
+    // hashes of one block are held at once
+    const long nw = nword * nspin;
+    AlignedVector<Hash> ranks(std::min(ndet, static_cast<long>(PYCI_DICT_BLOCK)));
+    dict.clear();
+    dict.reserve(ndet);
+    for (long start = 0, end; start < ndet; start = end) {
+        end = std::min(start + PYCI_DICT_BLOCK, ndet);
+        hash_dets(&dets[start * nw], end - start, nspin, ranks.data());
+        insert_dict(ranks.data(), end - start, start);
+    }
+}
+
+void Wfn::insert_dict(const Hash *ranks, const long n, const long offset) {
+    // each thread inserts the determinants that fall in its own submaps of the index, so that the
+    // threads never touch the same submap
+    long nthread = std::min(get_num_threads(), static_cast<long>(dict.subcnt()));
+    long chunksize = n / nthread + static_cast<bool>(n % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = n / nthread + static_cast<bool>(n % nthread);
+    }
+    if (nthread == 1) {
+        insert_dict_thread(ranks, n, offset, 0, 1);
+        return;
+    }
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&Wfn::insert_dict_thread, this, ranks, n, offset, i, nthread);
+    for (auto &thread : v_threads)
+        thread.join();
+}
+
+void Wfn::insert_dict_thread(const Hash *ranks, const long n, const long offset,
+                             const long ithread, const long nthread) {
+    for (long i = 0; i < n; ++i)
+        if (static_cast<long>(dict.subidx(dict.hash(ranks[i])) % nthread) == ithread)
+            dict[ranks[i]] = offset + i;
+}
+
+WfnBuilder::WfnBuilder(const long nw) : nword(nw), shards(PYCI_BUILDER_SHARDS) {
+}
+
+long WfnBuilder::size(void) const {
+    long n = 0;
+    for (const auto &shard : shards)
+        n += shard.dict.size();
+    return n;
+}
+
+bool WfnBuilder::add_det_with_rank(const ulong *det, const Hash &rank) {
+    Shard &shard = shards[rank.second % PYCI_BUILDER_SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (!shard.dict.insert(std::make_pair(rank, shard.dict.size())).second)
+        return false;
+    shard.dets.insert(shard.dets.end(), det, det + nword);
+    return true;
+}
+
+void WfnBuilder::compact(ulong *out, Hash *ranks) {
+    // move the shards to contiguous output in parallel; each shard is written in order of hash,
+    // so the result does not depend on the order in which the determinants were added
+    long n = 0, nthread = get_num_threads(), chunksize;
+    AlignedVector<long> offsets(PYCI_BUILDER_SHARDS + 1);
+    for (long i = 0; i < PYCI_BUILDER_SHARDS; ++i) {
+        offsets[i] = n;
+        n += shards[i].dict.size();
+    }
+    offsets[PYCI_BUILDER_SHARDS] = n;
+    nthread = std::min(nthread, static_cast<long>(PYCI_BUILDER_SHARDS));
+    chunksize = n / nthread + static_cast<bool>(n % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = n / nthread + static_cast<bool>(n % nthread);
+    }
+    Vector<std::thread> v_threads;
+    v_threads.reserve(nthread);
+    for (long i = 0; i < nthread; ++i)
+        v_threads.emplace_back(&WfnBuilder::compact_shards, this,
+                               end_chunk_idx(i, nthread, PYCI_BUILDER_SHARDS),
+                               end_chunk_idx(i + 1, nthread, PYCI_BUILDER_SHARDS), &offsets[0],
+                               out, ranks);
+    for (auto &thread : v_threads)
+        thread.join();
+}
+
+void WfnBuilder::compact_shards(const long start, const long end, const long *offsets, ulong *out,
+                                Hash *ranks) {
+    Vector<std::pair<Hash, long>> items;
+    for (long i = start; i < end; ++i) {
+        Shard &shard = shards[i];
+        items.assign(shard.dict.begin(), shard.dict.end());
+        std::sort(items.begin(), items.end());
+        for (long j = 0, k = offsets[i]; j < static_cast<long>(items.size()); ++j, ++k) {
+            ranks[k] = items[j].first;
+            std::memcpy(out + k * nword, &shard.dets[items[j].second * nword],
+                        sizeof(ulong) * nword);
+        }
+        HashMap<Hash, long>().swap(shard.dict);
+        AlignedVector<ulong>().swap(shard.dets);
+    }
+}
+
+DetBatch::DetBatch(const long nw) : nword(nw) {
+}
+
+long DetBatch::size(void) const {
+    return ranks.size();
+}
+
+const ulong *DetBatch::det_ptr(const long i) const {
+    return &dets[i * nword];
+}
+
+void DetBatch::push(const ulong *det, const Hash &rank) {
+    dets.insert(dets.end(), det, det + nword);
+    ranks.push_back(rank);
+}
+
+void DetBatch::clear(void) {
+    // keep the capacity, so that a batch reused for each determinant allocates only while it grows
+    dets.clear();
+    ranks.clear();
+}
+
+void Wfn::prefetch_rank(const Hash &rank) const {
+    if (lean)
+        __builtin_prefetch(&slots[rank.first & (slots.size() - 1)]);
+    else
+        dict.prefetch(rank);
 }
 
 } // namespace pyci
@@ -17,6 +17,7 @@ from tempfile import NamedTemporaryFile
 
 import pytest
 
+import numpy as np
 import numpy.testing as npt
 
 from pyci import secondquant_op
@@ -37,3 +38,12 @@ def test_to_from_file(filename):
     npt.assert_allclose(ham2.h, ham1.h, rtol=0.0, atol=1.0e-12)
     npt.assert_allclose(ham2.v, ham1.v, rtol=0.0, atol=1.0e-12)
     npt.assert_allclose(ham2.w, ham1.w, rtol=0.0, atol=1.0e-12)
+
+
+@pytest.mark.parametrize("filename", ["he_ccpvqz", "be_ccpvdz", "h2o_ccpvdz"])
+def test_coulomb_exchange(filename):
+    ham = secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+
+    npt.assert_allclose(ham.coulomb, np.einsum("ijij->ij", ham.two_mo), rtol=0.0, atol=1.0e-12)
+    npt.assert_allclose(ham.exchange, np.einsum("ijji->ij", ham.two_mo), rtol=0.0, atol=1.0e-12)
+    npt.assert_allclose(ham.w, 2 * ham.coulomb - ham.exchange, rtol=0.0, atol=1.0e-12)
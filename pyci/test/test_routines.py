@@ -34,6 +34,17 @@ def parity(p):
     return 1.0 if parity2(p) else -1.0
 
 
+def spinize_ham(ham):
+    n = ham.nbasis
+    one_mo = np.zeros((2 * n, 2 * n))
+    two_mo = np.zeros((2 * n, 2 * n, 2 * n, 2 * n))
+    for s in (slice(0, n), slice(n, 2 * n)):
+        one_mo[s, s] = ham.one_mo
+        for t in (slice(0, n), slice(n, 2 * n)):
+            two_mo[s, t, s, t] = ham.two_mo
+    return pyci.secondquant_op(ham.ecore, one_mo, two_mo)
+
+
 @pytest.mark.parametrize(
     "filename, wfn_type, occs, energy",
     [
@@ -54,6 +65,22 @@ def test_solve_sparse(filename, wfn_type, occs, energy):
     npt.assert_allclose(es[0], energy, rtol=0.0, atol=1.0e-9)
 
 
+def test_sparse_genci():
+    ham = pyci.secondquant_op(datafile("be_ccpvdz.fcidump"))
+    wfn = pyci.fullci_wfn(ham.nbasis, 2, 2)
+    wfn.add_all_dets()
+    gwfn = pyci.genci_wfn(2 * ham.nbasis, 4, 0)
+    for occs in wfn.to_occ_array():
+        gwfn.add_occs(np.concatenate((occs[0], occs[1] + ham.nbasis)))
+    x = np.sin(np.arange(len(wfn)))
+    npt.assert_allclose(
+        pyci.sparse_op(spinize_ham(ham), gwfn)(x),
+        pyci.sparse_op(ham, wfn)(x),
+        rtol=0.0,
+        atol=1.0e-12,
+    )
+
+
 @pytest.mark.parametrize(
     "filename, wfn_type, occs, energy",
     [
@@ -80,6 +107,357 @@ def test_sparse_rectangular(filename, wfn_type, occs, energy):
     npt.assert_allclose(y, z)
 
 
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs",
+    [
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2)),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2)),
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5)),
+    ],
+)
+def test_sparse_threaded_build(filename, wfn_type, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    nthread = pyci.get_num_threads()
+    try:
+        pyci.set_num_threads(1)
+        op1 = pyci.sparse_op(ham, wfn)
+        pyci.set_num_threads(4)
+        op2 = pyci.sparse_op(ham, wfn)
+    finally:
+        pyci.set_num_threads(nthread)
+    assert op1.size == op2.size
+    npt.assert_array_equal(op1.indptr(), op2.indptr())
+    npt.assert_array_equal(op1.indices(), op2.indices())
+    npt.assert_array_equal(op1.data(), op2.data())
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, compact",
+    [
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), None),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), "varint"),
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), None),
+    ],
+)
+def test_sparse_threaded_symm_matvec(filename, wfn_type, occs, compact):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    op = pyci.sparse_op(ham, wfn, symmetric=False)
+    symm_op = pyci.sparse_op(ham, wfn, symmetric=True, compact=compact)
+    x = np.random.rand(len(wfn))
+    y = op(x)
+    nthread = pyci.get_num_threads()
+    try:
+        for n in (1, 3, 4):
+            pyci.set_num_threads(n)
+            npt.assert_allclose(symm_op(x), y, rtol=0.0, atol=1.0e-12)
+    finally:
+        pyci.set_num_threads(nthread)
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, energy",
+    [
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2), -14.600556994),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), -14.617409507),
+    ],
+)
+def test_sparse_direct(filename, wfn_type, occs, energy):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    op = pyci.sparse_op(ham, wfn)
+    direct_op = pyci.sparse_op(ham, wfn, direct=True)
+    assert direct_op.direct
+    assert direct_op.size == 0
+    x = np.random.rand(len(wfn))
+    npt.assert_allclose(direct_op(x), op(x), rtol=0.0, atol=1.0e-12)
+    i = len(wfn) - 1
+    for j in range(0, len(wfn), 7):
+        assert direct_op.get_element(i, j) == op.get_element(i, j)
+    es, cs = direct_op.solve(n=1, ncv=30, tol=1.0e-6)
+    npt.assert_allclose(es[0], energy, rtol=0.0, atol=1.0e-9)
+    nrow = len(wfn) // 2
+    op = pyci.sparse_op(ham, wfn, nrow, symmetric=False)
+    direct_op = pyci.sparse_op(ham, wfn, nrow, symmetric=False, direct=True)
+    del ham, wfn
+    npt.assert_allclose(direct_op(x), op(x), rtol=0.0, atol=1.0e-12)
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, compact",
+    [
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2), "uint32"),
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2), "varint"),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), "uint32"),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), "varint"),
+    ],
+)
+def test_sparse_compact(filename, wfn_type, occs, compact):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    x = np.random.rand(len(wfn))
+    for symmetric in (True, False):
+        op = pyci.sparse_op(ham, wfn, symmetric=symmetric)
+        compact_op = pyci.sparse_op(ham, wfn, symmetric=symmetric, compact=compact)
+        assert compact_op.compact == compact
+        npt.assert_array_equal(compact_op.indptr(), op.indptr())
+        npt.assert_array_equal(compact_op.indices(), op.indices())
+        npt.assert_array_equal(compact_op.data(), op.data())
+        npt.assert_allclose(compact_op(x), op(x), rtol=0.0, atol=1.0e-12)
+        for j in op.indices()[op.indptr()[5] : op.indptr()[6]]:
+            assert compact_op.get_element(5, j) == op.get_element(5, j)
+    es, cs = compact_op.solve(n=1, tol=1.0e-6)
+    npt.assert_allclose(es, op.solve(n=1, tol=1.0e-6)[0], rtol=0.0, atol=1.0e-9)
+    assert op.compact is None
+    with pytest.raises(ValueError):
+        pyci.sparse_op(ham, wfn, compact="uint16")
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs",
+    [
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2)),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2)),
+        ("be_ccpvdz", pyci.genci_wfn, (2, 0)),
+    ],
+)
+def test_sparse_exact_build(filename, wfn_type, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    for symmetric in (True, False):
+        op = pyci.sparse_op(ham, wfn, symmetric=symmetric)
+        assert pyci.sparse_op.count_nnz(ham, wfn, symmetric=symmetric) == op.size
+        for compact in (None, "varint"):
+            exact_op = pyci.sparse_op(ham, wfn, symmetric=symmetric, compact=compact, exact=True)
+            assert exact_op.exact
+            npt.assert_array_equal(exact_op.indptr(), op.indptr())
+            npt.assert_array_equal(exact_op.indices(), op.indices())
+            npt.assert_array_equal(exact_op.data(), op.data())
+    nrow = len(wfn) // 2
+    exact_op = pyci.sparse_op(ham, wfn, nrow, nrow, exact=True)
+    exact_op.update(ham, wfn)
+    npt.assert_array_equal(exact_op.indices(), pyci.sparse_op(ham, wfn).indices())
+
+
+@pytest.mark.parametrize(
+    "filename1, filename2, wfn_type, occs",
+    [
+        ("h6_sto_3g", "BH_sto-3g_eq", pyci.doci_wfn, (3, 3)),
+        ("h6_sto_3g", "BH_sto-3g_eq", pyci.fullci_wfn, (3, 3)),
+        ("h6_sto_3g", "BH_sto-3g_eq", pyci.genci_wfn, (3, 0)),
+    ],
+)
+def test_sparse_refill(filename1, filename2, wfn_type, occs):
+    ham1 = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename1)))
+    ham2 = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename2)))
+    wfn = wfn_type(ham1.nbasis, *occs)
+    wfn.add_all_dets()
+    for symmetric in (True, False):
+        op = pyci.sparse_op(ham1, wfn, symmetric=symmetric, compact="varint")
+        for ham in (ham2, ham1):
+            op.refill(ham)
+            ref = pyci.sparse_op(ham, wfn, symmetric=symmetric)
+            assert op.ecore == ref.ecore
+            npt.assert_array_equal(op.indices(), ref.indices())
+            npt.assert_allclose(op.data(), ref.data(), rtol=0.0, atol=1.0e-12)
+    # the refilled direct operator holds the only reference to its new Hamiltonian
+    direct_op = pyci.sparse_op(ham1, wfn, direct=True)
+    direct_op.refill(pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename2))))
+    x = np.random.rand(len(wfn))
+    npt.assert_allclose(direct_op(x), pyci.sparse_op(ham2, wfn)(x), rtol=0.0, atol=1.0e-12)
+    # the elements dropped for one Hamiltonian are not the ones dropped for another
+    drop_op = pyci.sparse_op(ham1, wfn, droptol=1.0e-4)
+    with pytest.raises(ValueError):
+        drop_op.refill(ham2)
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs",
+    [
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2)),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2)),
+    ],
+)
+def test_sparse_modified_wfn(filename, wfn_type, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_hartreefock_det()
+    pyci.add_hci(ham, wfn, np.ones(1), eps=0.0)
+    # appending determinants keeps the rows already built valid
+    op = pyci.sparse_op(ham, wfn)
+    direct_op = pyci.sparse_op(ham, wfn, direct=True)
+    pyci.add_hci(ham, wfn, np.ones(len(wfn)), eps=0.0)
+    op.update(ham, wfn)
+    npt.assert_allclose(op.diagonal(), pyci.sparse_op(ham, wfn).diagonal(), rtol=0.0, atol=0.0)
+    direct_op.diagonal()
+    # removing determinants moves the rest to new indices
+    wfn.remove_dets([0])
+    x = np.random.rand(direct_op.shape[1])
+    with pytest.raises(RuntimeError):
+        direct_op(x)
+    with pytest.raises(RuntimeError):
+        direct_op.diagonal()
+    with pytest.raises(RuntimeError):
+        direct_op.get_element(0, 0)
+    with pytest.raises(RuntimeError):
+        op.refill(ham)
+    with pytest.raises(RuntimeError):
+        op.update(ham, wfn)
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, droptol",
+    [
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2), 1.0e-10),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), 1.0e-10),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), 1.0e-4),
+    ],
+)
+def test_sparse_droptol(filename, wfn_type, occs, droptol):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    op = pyci.sparse_op(ham, wfn)
+    assert op.ndrop == 0
+    for exact in (False, True):
+        drop_op = pyci.sparse_op(ham, wfn, droptol=droptol, exact=exact)
+        assert drop_op.droptol == droptol
+        assert drop_op.size + drop_op.ndrop == op.size
+        assert pyci.sparse_op.count_nnz(ham, wfn, droptol=droptol) == drop_op.size
+        rows = np.repeat(np.arange(len(wfn)), np.diff(op.indptr()))
+        keep = (np.abs(op.data()) >= droptol) | (op.indices() == rows)
+        npt.assert_array_equal(drop_op.data(), op.data()[keep])
+        npt.assert_array_equal(drop_op.indices(), op.indices()[keep])
+    nrow = len(wfn) // 2
+    drop_op = pyci.sparse_op(ham, wfn, nrow, nrow, droptol=droptol)
+    drop_op.update(ham, wfn, droptol=droptol)
+    assert drop_op.droptol == droptol
+    assert drop_op.size + drop_op.ndrop == op.size
+    npt.assert_array_equal(drop_op.data(), pyci.sparse_op(ham, wfn, droptol=droptol).data())
+    # every row of an operator is dropped with the same tolerance
+    with pytest.raises(ValueError):
+        drop_op.update(ham, wfn, droptol=2 * droptol)
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, compact",
+    [
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2), None),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), None),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), "varint"),
+    ],
+)
+def test_sparse_to_scipy_csr(filename, wfn_type, occs, compact):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    op = pyci.sparse_op(ham, wfn, symmetric=False, compact=compact)
+    data = op.data()
+    assert np.shares_memory(data, op.data())
+    assert not data.flags["WRITEABLE"]
+    csr = op.to_scipy_csr()
+    assert csr.shape == op.shape
+    assert np.shares_memory(csr.data, data)
+    assert np.shares_memory(csr.indptr, op.indptr())
+    x = np.random.rand(len(wfn))
+    npt.assert_allclose(csr @ x, op(x), rtol=0.0, atol=1.0e-12)
+    # the stored matrix cannot be rewritten while views of it exist
+    with pytest.raises(BufferError):
+        op.refill(ham)
+    with pytest.raises(BufferError):
+        op.squeeze()
+    del op
+    npt.assert_allclose(csr.data, data)
+    op = pyci.sparse_op(ham, wfn, symmetric=False, compact=compact)
+    data = op.data()
+    del data
+    op.refill(ham)
+    # a symmetric operator stores only one triangle of the matrix
+    with pytest.raises(ValueError):
+        pyci.sparse_op(ham, wfn, symmetric=True, compact=compact).to_scipy_csr()
+
+
+@pytest.mark.parametrize(
+    "filename, occs, eps",
+    [
+        ("be_ccpvdz", (2, 2), 1.0e-2),
+        ("h2o_ccpvdz", (5, 5), 1.0e-2),
+    ],
+)
+def test_sparse_direct_fullci_strings(filename, occs, eps):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = pyci.fullci_wfn(ham.nbasis, *occs)
+    wfn.add_hartreefock_det()
+    pyci.add_hci(ham, wfn, np.ones(1), eps=0.0)
+    pyci.add_hci(ham, wfn, np.ones(len(wfn)), eps=eps)
+    op = pyci.sparse_op(ham, wfn, symmetric=False)
+    direct_op = pyci.sparse_op(ham, wfn, direct=True)
+    x = np.random.rand(len(wfn))
+    npt.assert_allclose(direct_op(x), op(x), rtol=0.0, atol=1.0e-12)
+    n = len(wfn) // 3
+    op = pyci.sparse_op(ham, wfn, n, n)
+    direct_op = pyci.sparse_op(ham, wfn, n, n, direct=True)
+    npt.assert_allclose(direct_op(x[:n]), op(x[:n]), rtol=0.0, atol=1.0e-12)
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, n, direct",
+    [
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2), 3, False),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), 1, False),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), 1, True),
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), 2, False),
+    ],
+)
+def test_solve_davidson(filename, wfn_type, occs, n, direct):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    op = pyci.sparse_op(ham, wfn, direct=direct)
+    npt.assert_allclose(op.diagonal(), [op.get_element(i, i) for i in range(len(wfn))])
+    es, cs = op.solve(n=n, tol=1.0e-12)
+    es_dav, cs_dav = op.solve(n=n, tol=1.0e-12, method="davidson")
+    npt.assert_allclose(es_dav, es, rtol=0.0, atol=1.0e-9)
+    for c, c_dav in zip(cs, cs_dav):
+        npt.assert_allclose(np.abs(np.dot(c, c_dav)), 1.0, rtol=0.0, atol=1.0e-6)
+    # warm start from several previous eigenvectors
+    es_warm, _ = op.solve(n=n, c0=cs_dav, tol=1.0e-12, method="davidson", maxiter=2)
+    npt.assert_allclose(es_warm, es, rtol=0.0, atol=1.0e-9)
+    with pytest.raises(ValueError):
+        op.solve(n=n, method="arnoldi")
+    with pytest.raises(ValueError):
+        op.solve(n=n, c0=cs_dav[:, :-1], method="davidson")
+    with pytest.raises(ValueError):
+        op.solve(n=n, c0=np.ones(len(wfn) + 1))
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, n, subspace",
+    [
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2), 3, "float"),
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2), 3, "disk"),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), 1, "float"),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), 1, "disk"),
+    ],
+)
+def test_solve_davidson_subspace(filename, wfn_type, occs, n, subspace):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    op = pyci.sparse_op(ham, wfn)
+    es, _ = op.solve(n=n, tol=1.0e-12, method="davidson")
+    es_sub, _ = op.solve(n=n, ncv=3 * n, tol=1.0e-12, method="davidson", subspace=subspace)
+    npt.assert_allclose(es_sub, es, rtol=0.0, atol=1.0e-9)
+    with pytest.raises(ValueError):
+        op.solve(n=n, subspace=subspace)
+
+
 @pytest.mark.parametrize(
     "filename, wfn_type, occs, energy",
     [
@@ -470,6 +848,30 @@ def test_run_hci(filename, wfn_type, occs, energy):
     npt.assert_allclose(es[0], energy, rtol=0.0, atol=2.0e-9)
 
 
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, eps",
+    [
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), 1.0e-2),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), 1.0e-3),
+    ],
+)
+def test_add_hci_nthread(filename, wfn_type, occs, eps):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfns = []
+    for nthread in (1, 2):
+        wfn = wfn_type(ham.nbasis, *occs)
+        wfn.add_hartreefock_det()
+        for _ in range(3):
+            pyci.add_hci(ham, wfn, np.ones(len(wfn)), eps=eps, nthread=nthread)
+        # the last iteration has enough parent determinants to be split over two threads
+        assert len(wfn) > 2048
+        pyci.add_hci(ham, wfn, np.ones(len(wfn)), eps=eps, nthread=nthread)
+        wfns.append(wfn)
+    npt.assert_array_equal(wfns[0].to_det_array(), wfns[1].to_det_array())
+    for i, det in enumerate(wfns[0].to_det_array()):
+        assert wfns[0].index_det(det) == i
+
+
 @pytest.mark.parametrize(
     "filename, wfn_type, occs, energy",
     [
@@ -491,6 +893,95 @@ def test_enpt2(filename, wfn_type, occs, energy):
     npt.assert_allclose(e, energy)
 
 
+@pytest.fixture(params=[pyci.doci_wfn, pyci.fullci_wfn])
+def be_ccpvdz_singles(request):
+    # the lowest three states of be_ccpvdz in the space of single excitations
+    ham = pyci.secondquant_op(datafile("be_ccpvdz.fcidump"))
+    wfn = request.param(ham.nbasis, 2, 2)
+    pyci.add_excitations(wfn, 0, 1)
+    es, cs = pyci.sparse_op(ham, wfn).solve(n=3)
+    return ham, wfn, es, cs
+
+
+@pytest.fixture
+def be_ccpvdz_hci():
+    # the lowest three states of be_ccpvdz in a space grown by HCI, with enough determinants for
+    # two threads to get a chunk of at least PYCI_CHUNKSIZE_MIN each
+    ham = pyci.secondquant_op(datafile("be_ccpvdz.fcidump"))
+    wfn = pyci.fullci_wfn(ham.nbasis, 2, 2)
+    wfn.add_hartreefock_det()
+    for _ in range(3):
+        pyci.add_hci(ham, wfn, np.ones(len(wfn)), eps=1.0e-3)
+    assert len(wfn) > 2048
+    es, cs = pyci.sparse_op(ham, wfn).solve(n=3)
+    return ham, wfn, es, cs
+
+
+def test_enpt2_max_memory(be_ccpvdz_hci):
+    ham, wfn, es, cs = be_ccpvdz_hci
+    e = pyci.compute_enpt2(ham, wfn, cs[0], es[0], 1.0e-5)
+    for max_memory in (100000, 10000):
+        for nthread in (1, 2):
+            npt.assert_allclose(
+                pyci.compute_enpt2(
+                    ham, wfn, cs[0], es[0], 1.0e-5, nthread=nthread, max_memory=max_memory
+                ),
+                e,
+                rtol=0.0,
+                atol=1.0e-12,
+            )
+
+
+def test_enpt2_multistate(be_ccpvdz_hci):
+    ham, wfn, es, cs = be_ccpvdz_hci
+    pt_energies = pyci.compute_enpt2_multistate(ham, wfn, cs, es, 0.0)
+    assert pt_energies.shape == (3,)
+    for e, c, pt_energy in zip(es, cs, pt_energies):
+        npt.assert_allclose(
+            pt_energy, pyci.compute_enpt2(ham, wfn, c, e, 0.0), rtol=0.0, atol=1.0e-12
+        )
+    npt.assert_allclose(
+        pyci.compute_enpt2_multistate(ham, wfn, cs, es, 0.0, nthread=2, max_memory=10000),
+        pt_energies,
+        rtol=0.0,
+        atol=1.0e-12,
+    )
+
+
+def test_enpt2_semistochastic(be_ccpvdz_singles):
+    ham, wfn, es, cs = be_ccpvdz_singles
+    e = pyci.compute_enpt2(ham, wfn, cs[0], es[0], 1.0e-7)
+    e1, err1 = pyci.compute_enpt2_semistochastic(
+        ham, wfn, cs[0], es[0], eps=1.0e-7, eps_d=1.0e-4, nsample=50, tol=1.0e-6, nthread=1
+    )
+    e2, err2 = pyci.compute_enpt2_semistochastic(
+        ham, wfn, cs[0], es[0], eps=1.0e-7, eps_d=1.0e-4, nsample=50, tol=1.0e-6, nthread=2
+    )
+    assert e1 == e2 and err1 == err2
+    assert err1 <= 1.0e-6
+    assert abs(e1 - e) < 5 * err1
+
+
+def test_hci_enpt2_genci():
+    ham = pyci.secondquant_op(datafile("be_ccpvdz.fcidump"))
+    gham = spinize_ham(ham)
+    wfn = pyci.fullci_wfn(ham.nbasis, 2, 2)
+    wfn.add_hartreefock_det()
+    pyci.add_hci(ham, wfn, np.ones(1), eps=1.0e-3)
+    gwfn = pyci.genci_wfn(wfn)
+    pyci.add_hci(ham, wfn, np.ones(len(wfn)), eps=1.0e-3)
+    pyci.add_hci(gham, gwfn, np.ones(len(gwfn)), eps=1.0e-3)
+    assert len(gwfn) == len(wfn)
+    gwfn = pyci.genci_wfn(wfn)
+    cs = np.sin(np.arange(1, len(wfn) + 1))
+    npt.assert_allclose(
+        pyci.compute_enpt2(gham, gwfn, cs, -15.0, 1.0e-4),
+        pyci.compute_enpt2(ham, wfn, cs, -15.0, 1.0e-4),
+        rtol=0.0,
+        atol=1.0e-10,
+    )
+
+
 def test_compute_rdm_two_particles_one_up_one_dn():
     wfn = pyci.fullci_wfn(2, 1, 1)
     wfn.add_all_dets()
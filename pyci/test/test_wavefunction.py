@@ -18,6 +18,7 @@ from tempfile import NamedTemporaryFile
 
 import pytest
 
+import numpy as np
 import numpy.testing as npt
 
 from scipy.special import comb
@@ -25,6 +26,27 @@ from scipy.special import comb
 import pyci
 
 
+WFN_PARAMS = [
+    (pyci.doci_wfn, 16, 4, 4),
+    (pyci.doci_wfn, 65, 2, 2),
+    (pyci.fullci_wfn, 8, 3, 2),
+    (pyci.fullci_wfn, 65, 2, 1),
+]
+
+
+def empty_like(wfn):
+    return type(wfn)(wfn.nbasis, wfn.nocc_up, wfn.nocc_dn)
+
+
+@pytest.fixture(params=WFN_PARAMS)
+def excited_wfn(request):
+    wfn_type, nbasis, nocc_up, nocc_dn = request.param
+    wfn = wfn_type(nbasis, nocc_up, nocc_dn)
+    for i in range(3):
+        wfn.add_excited_dets(i)
+    return wfn
+
+
 def test_doci_raises():
     npt.assert_raises(ValueError, pyci.doci_wfn, 10, 11, 11)
     wfn = pyci.doci_wfn(5, 3, 3)
@@ -88,9 +110,22 @@ def test_doci_copy(nbasis, nocc):
 def test_doci_add_all_dets(nbasis, nocc):
     wfn = pyci.doci_wfn(nbasis, nocc, nocc)
     wfn.add_all_dets()
-    for det in wfn.to_det_array():
+    assert not wfn.complete
+    for i, det in enumerate(wfn.to_det_array()):
         assert pyci.popcnt(det) == wfn.nocc_up == wfn.nocc_dn == wfn.nocc // 2
+        assert wfn.index_det(det) == i
+        assert wfn.index_det_from_rank(wfn.rank_det(det)) == i
     assert len(wfn) == comb(wfn.nbasis, wfn.nocc_up, exact=True)
+    rank_wfn = pyci.doci_wfn(nbasis, nocc, nocc)
+    rank_wfn.add_all_dets(index="rank")
+    assert rank_wfn.complete
+    npt.assert_array_equal(rank_wfn.to_det_array(), wfn.to_det_array())
+    for i, det in enumerate(rank_wfn.to_det_array()):
+        assert rank_wfn.index_det(det) == i
+    assert rank_wfn.add_det(rank_wfn[0]) == -1
+    assert not pyci.doci_wfn(nbasis, nocc, nocc, rank_wfn.to_det_array()).complete
+    with pytest.raises(ValueError):
+        wfn.add_all_dets(index="colex")
 
 
 @pytest.mark.parametrize("nbasis, nocc", [(16, 8), (64, 1), (64, 4), (65, 1), (65, 4), (129, 3)])
@@ -164,10 +199,17 @@ def test_fullci_add_all_dets(nbasis, nocc_up, nocc_dn):
     ndet = comb(nbasis, nocc_up, exact=True) * comb(nbasis, nocc_dn, exact=True)
     wfn = pyci.fullci_wfn(nbasis, nocc_up, nocc_dn)
     wfn.add_all_dets()
-    for det in wfn.to_det_array():
+    assert not wfn.complete
+    for i, det in enumerate(wfn.to_det_array()):
         assert pyci.popcnt(det[0]) == wfn.nocc_up
         assert pyci.popcnt(det[1]) == wfn.nocc_dn
+        assert wfn.index_det(det) == i
     assert len(wfn) == ndet
+    wfn.add_all_dets(index="rank")
+    assert wfn.complete
+    for i, det in enumerate(wfn.to_det_array()):
+        assert wfn.index_det(det) == i
+    assert wfn.add_det(wfn[0]) == -1
 
 
 @pytest.mark.parametrize(
@@ -180,3 +222,129 @@ def test_fullci_add_excited_dets(nbasis, nocc_up, nocc_dn):
     for i in range(wfn.nocc_up + wfn.nocc_dn + 1):
         wfn.add_excited_dets(i)
     assert len(wfn) == ndet
+
+
+def test_freeze(excited_wfn):
+    wfn = excited_wfn
+    dets = wfn.to_det_array()
+    perm = wfn.freeze()
+    assert wfn.frozen
+    npt.assert_array_equal(wfn.to_det_array(), dets[perm])
+    for i, det in enumerate(dets[perm]):
+        assert wfn.index_det(det) == i
+    npt.assert_raises(RuntimeError, wfn.add_det, dets[0])
+
+
+def test_lean_index(excited_wfn):
+    wfn1 = excited_wfn
+    wfn2 = empty_like(wfn1)
+    wfn2.lean_index()
+    assert wfn2.lean
+    for i in range(3):
+        wfn2.add_excited_dets(i)
+    npt.assert_array_equal(wfn1.to_det_array(), wfn2.to_det_array())
+    for i, det in enumerate(wfn1.to_det_array()):
+        assert wfn2.index_det(det) == i
+        assert wfn2.add_det(det) == -1
+    assert len(wfn2) == len(wfn1)
+
+
+@pytest.mark.parametrize("wfn_type, nbasis, nocc_up, nocc_dn", WFN_PARAMS)
+def test_index_dets(wfn_type, nbasis, nocc_up, nocc_dn):
+    wfn = wfn_type(nbasis, nocc_up, nocc_dn)
+    for i in range(2):
+        wfn.add_excited_dets(i)
+    dets = wfn.to_det_array()
+    npt.assert_array_equal(wfn.index_dets(dets), range(len(wfn)))
+    other = wfn_type(nbasis, nocc_up, nocc_dn)
+    other.add_excited_dets(2)
+    indices = wfn.index_dets(other.to_det_array())
+    npt.assert_array_equal(indices, [wfn.index_det(det) for det in other.to_det_array()])
+    assert (indices == -1).any()
+
+
+@pytest.mark.parametrize("nbasis, nocc_up, nocc_dn", [(8, 3, 2), (64, 2, 1), (65, 2, 1)])
+def test_genci_from_fullci(nbasis, nocc_up, nocc_dn):
+    fullci = pyci.fullci_wfn(nbasis, nocc_up, nocc_dn)
+    fullci.add_excited_dets(0)
+    fullci.add_excited_dets(1)
+    genci = pyci.genci_wfn(fullci)
+    assert len(genci) == len(fullci)
+    for i, occs in enumerate(fullci.to_occ_array()):
+        npt.assert_array_equal(genci.to_occ_array()[i], list(occs[0]) + list(occs[1] + nbasis))
+        assert genci.index_det(genci[i]) == i
+
+
+def test_add_dets(excited_wfn):
+    ref = excited_wfn
+    dets = ref.to_det_array()
+    occs = ref.to_occ_array()
+    wfn1 = empty_like(ref)
+    wfn1.add_hartreefock_det()
+    npt.assert_array_equal(wfn1.add_dets(dets), range(len(ref)))
+    npt.assert_array_equal(wfn1.to_det_array(), dets)
+    wfn2 = empty_like(ref)
+    npt.assert_array_equal(wfn2.add_occs_array(occs[::-1]), range(len(ref)))
+    npt.assert_array_equal(wfn2.add_occs_array(occs), range(len(ref) - 1, -1, -1))
+    npt.assert_array_equal(wfn2.to_det_array(), dets[::-1])
+    # arrays of the wrong shape are rejected rather than read past their end
+    with pytest.raises(ValueError):
+        wfn1.add_dets(dets.reshape(-1))
+    with pytest.raises(ValueError):
+        wfn1.index_dets(dets[..., :-1])
+    with pytest.raises(ValueError):
+        wfn2.add_occs_array(occs[..., :-1])
+
+
+def test_remove_dets(excited_wfn):
+    wfn = excited_wfn
+    dets = wfn.to_det_array()
+    indices = np.arange(0, len(dets), 3)
+    index_map = wfn.remove_dets(indices)
+    keep = np.ones(len(dets), dtype=bool)
+    keep[indices] = False
+    npt.assert_array_equal(index_map != -1, keep)
+    npt.assert_array_equal(wfn.to_det_array(), dets[keep])
+    for det, i in zip(dets, index_map):
+        assert wfn.index_det(det) == i
+    coeffs = np.ones((2, len(wfn)))
+    coeffs[0, ::2] = 0.0
+    coeffs[1, :4] = 0.0
+    index_map = wfn.prune(coeffs, 0.5)
+    npt.assert_array_equal(index_map == -1, (coeffs[0] == 0) & (coeffs[1] == 0))
+    for det, i in zip(dets[keep], index_map):
+        assert wfn.index_det(det) == i
+    if isinstance(wfn, pyci.doci_wfn):
+        wfn = empty_like(wfn)
+        wfn.add_all_dets(index="rank")
+        wfn.remove_dets([0])
+        assert not wfn.complete
+        assert len(wfn) == comb(wfn.nbasis, wfn.nocc_up, exact=True) - 1
+        assert wfn.index_det(wfn[0]) == 0
+
+
+@pytest.mark.parametrize(
+    "wfn_type, nbasis, nocc_up, nocc_dn",
+    [
+        (pyci.doci_wfn, 16, 4, 4),
+        (pyci.fullci_wfn, 65, 2, 1),
+    ],
+)
+def test_det_view(wfn_type, nbasis, nocc_up, nocc_dn):
+    wfn = wfn_type(nbasis, nocc_up, nocc_dn)
+    for i in range(3):
+        wfn.add_excited_dets(i)
+    view = wfn.det_view()
+    assert not view.flags["WRITEABLE"]
+    npt.assert_array_equal(view, wfn.to_det_array())
+    # the determinants cannot be moved while a view of them exists
+    with pytest.raises(BufferError):
+        wfn.remove_dets([0])
+    with pytest.raises(BufferError):
+        wfn.reserve(2 * len(wfn))
+    del view
+    wfn.remove_dets([0])
+    view = wfn.det_view()
+    dets = wfn.to_det_array()
+    del wfn
+    npt.assert_array_equal(view, dets)
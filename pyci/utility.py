@@ -488,16 +488,17 @@ def odometer_two_spin(wfn, cost, t, qmax):
     odometer_one_spin(wfn_up, cost, t, qmax)
     if not len(wfn_up):
         return
+    dets_up = wfn_up.to_det_array()
     if wfn.nocc_dn:
         wfn_dn = pyci.doci_wfn(wfn.nbasis, wfn.nocc_dn, wfn.nocc_dn)
         odometer_one_spin(wfn_dn, cost, t, qmax)
         if not len(wfn_dn):
             return
-        for i in range(len(wfn_up)):
-            det_up = wfn_up[i]
-            for j in range(len(wfn_dn)):
-                wfn.add_det(np.vstack((det_up, wfn_dn[j])))
+        dets_dn = wfn_dn.to_det_array()
     else:
-        det_dn = np.zeros_like(wfn_up[0])
-        for i in range(len(wfn_up)):
-            wfn.add_det(np.vstack((wfn_up[i], det_dn)))
+        dets_dn = np.zeros_like(dets_up[:1])
+    # Add every pair of spin-up and spin-down determinants in one call
+    dets = np.empty((len(dets_up), len(dets_dn), 2, dets_up.shape[1]), dtype=pyci.c_ulong)
+    dets[:, :, 0] = dets_up[:, None]
+    dets[:, :, 1] = dets_dn[None, :]
+    wfn.add_dets(dets.reshape(-1, 2, dets_up.shape[1]))